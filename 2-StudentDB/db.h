@@ -1,6 +1,8 @@
 #ifndef __DB_H__
     #define __DB_H__
 
+#include <stdint.h>
+
 // Basic student database record.  Note:
 //  1. id must be > 0.  A student id==0 means the record has been deleted
 //  2. gpa is an int, should be between 0<=gpa<=500, real gpa is gpa/100.0 this
@@ -18,7 +20,8 @@ typedef struct student{
 //be stored as integers but printed as floats.  For example a GPA of 450 is really
 //that value divided by 100.0 or 4.50.
 #define MIN_STD_ID      1
-#define MAX_STD_ID      100000
+#define MAX_STD_ID      100000      //id range of a new db, see SDB_MAX_ID
+#define MAX_STD_ID_LIMIT 33554431   //largest id range a db can be created with
 #define MIN_STD_GPA     0
 #define MAX_STD_GPA     500
 
@@ -28,8 +31,35 @@ static const student_t EMPTY_STUDENT_RECORD = {0};
 static const int STUDENT_RECORD_SIZE  = sizeof(struct student);
 static const int DELETED_STUDENT_ID = 0;
 
+//Slot 0 of the db file can never hold a student, so it holds a header that
+//describes the file.  Its first int is zero, so everything that only looks
+//at ids still sees an empty record there.  A db without a header was made
+//before headers existed and is upgraded in place with the defaults above.
+//A db whose header this build cannot read is refused rather than misread.
+typedef struct db_header {
+    int32_t  zero;          // DELETED_STUDENT_ID
+    uint32_t magic;         // DB_HEADER_MAGIC
+    uint32_t version;       // DB_HEADER_VERSION
+    uint32_t layout;        // how ids map to slots, DB_LAYOUT_*
+    uint32_t min_id;        // ids the db can hold, inclusive
+    uint32_t max_id;
+    uint32_t record_size;   // sizeof(student_t) when the db was created
+    uint32_t fname_width;   // sizeof(student_t.fname)
+    uint32_t lname_width;   // sizeof(student_t.lname)
+    char reserved[28];      // pad the header to one record
+} db_header_t;
+
+#define DB_HEADER_MAGIC     0x48424453      // "SDBH"
+#define DB_HEADER_VERSION   1
+#define DB_LAYOUT_DIRECT    1               // student id lives in slot id
+
 
 #define DB_FILE     "student.db"            //name of database file
 #define TMP_DB_FILE ".tmp_student.db"       //for extra credit
+#define DB_BITMAP_EXT ".bmp"                //occupancy bitmap, e.g. student.db.bmp
+#define DB_INDEX_EXT  ".idx"                //last/first name index
+#define DB_WAL_EXT    ".wal"                //write ahead log
+#define DB_CRC_EXT    ".crc"                //record checksums
+#define DB_SOCKET_EXT ".sock"               //sdbsc -S listens here
 
 #endif
\ No newline at end of file
@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <time.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+#include "sdbbench.h"
+
+/*
+ *  sdbsc benchmark
+ *
+ *  sdbsc -T times add_student(), get_student(), count_db_records(),
+ *  print_db() and compress_db() in process, so the numbers are the cost of
+ *  the operations and not of starting sdbsc.  It writes one result row per
+ *  engine, operation and cache state, with ops/sec and latency percentiles
+ *  in microseconds, as CSV or as a JSON array.  make bench runs it.
+ *
+ *  The dataset has every id from 1 to max_id present with a probability of
+ *  density percent, from a fixed seed, so runs with the same arguments are
+ *  comparable.  It is bulk loaded once per engine, SDB_ENGINE selects the
+ *  engine as usual.  The db is created with SDB_MAX_ID set to max_id, or
+ *  to MAX_STD_ID for a smaller dataset, so ids past the dataset are free
+ *  for add.
+ *
+ *  The warm samples run after print_db() has pulled the db and its sidecars
+ *  into memory.  Before every cold sample the db is closed, written back
+ *  and dropped from the page cache with posix_fadvise(POSIX_FADV_DONTNEED),
+ *  then reopened, which needs no root and leaves other files alone.  Pages
+ *  of a file that is still mapped elsewhere are not dropped.
+ *
+ *  compress_db() only works on student.db in the current directory, so the
+ *  benchmark runs in a scratch directory that it removes afterwards and
+ *  never touches the real student.db.  Everything the operations print goes
+ *  to /dev/null while they run.
+ */
+
+//warm plus cold add samples
+#define BENCH_ADDS  1050
+
+typedef struct bench_ctx {
+    int fd;             // db under test, compress_db() replaces it
+    int max_id;         // highest id in the dataset
+    int id_space;       // highest id the db holds
+    unsigned int seed;
+    int *free_ids;      // ids not in the dataset, shuffled, for add
+    int nfree;
+    int next_free;
+} bench_ctx_t;
+
+//returns NO_ERROR, or SRCH_NOT_FOUND when the operation has nothing left
+//to do and the remaining samples are skipped
+typedef int (*bench_fn_t)(bench_ctx_t *b);
+
+typedef struct bench_op {
+    const char *name;
+    bench_fn_t fn;
+    int warm_samples;
+    int cold_samples;
+} bench_op_t;
+
+static int bench_get(bench_ctx_t *b)
+{
+    student_t s;
+    int id = MIN_STD_ID + rand_r(&b->seed) % b->max_id;
+    int rc = get_student(b->fd, id, &s);
+
+    return rc == SRCH_NOT_FOUND ? NO_ERROR : rc;
+}
+
+static int bench_add(bench_ctx_t *b)
+{
+    if (b->next_free == b->nfree)
+        return SRCH_NOT_FOUND;
+    return add_student(b->fd, b->free_ids[b->next_free++], "bench", "student", 300);
+}
+
+static int bench_count(bench_ctx_t *b)
+{
+    return count_db_records(b->fd) < 0 ? ERR_DB_FILE : NO_ERROR;
+}
+
+static int bench_print(bench_ctx_t *b)
+{
+    return print_db(b->fd);
+}
+
+static int bench_compress(bench_ctx_t *b)
+{
+    b->fd = compress_db(b->fd);
+    return b->fd < 0 ? ERR_DB_FILE : NO_ERROR;
+}
+
+//compress_db() rewrites the db, so it has to run last
+static const bench_op_t bench_ops[] = {
+    {"get",      bench_get,      100000, 200},
+    {"add",      bench_add,      BENCH_ADDS - 50, 50},
+    {"count",    bench_count,    50,     5},
+    {"print",    bench_print,    5,      3},
+    {"compress", bench_compress, 3,      3},
+};
+
+static const char *bench_files[] = {
+    DB_FILE,
+    DB_FILE DB_BITMAP_EXT,
+    DB_FILE DB_INDEX_EXT,
+    DB_FILE DB_WAL_EXT,
+    DB_FILE DB_CRC_EXT,
+};
+
+static double elapsed_us(const struct timespec *t0, const struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) * 1e6 + (t1->tv_nsec - t0->tv_nsec) / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+//setenv() may free the string getenv() returned, so keep a copy
+static char *bench_env_save(const char *name)
+{
+    const char *value = getenv(name);
+
+    return (value != NULL) ? strdup(value) : NULL;
+}
+
+static void bench_env_restore(const char *name, char *value)
+{
+    if (value != NULL)
+        setenv(name, value, 1);
+    else
+        unsetenv(name);
+    free(value);
+}
+
+/*
+ *  bench_cold
+ *      b:  the benchmark, b->fd is replaced
+ *
+ *  Closes the db, writes its files back and drops them from the page cache,
+ *  then opens it again.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE if the db could not be reopened
+ */
+static int bench_cold(bench_ctx_t *b)
+{
+    size_t i;
+    int fd;
+
+    close_db(b->fd);
+    for (i = 0; i < sizeof(bench_files) / sizeof(bench_files[0]); i++) {
+        fd = open(bench_files[i], O_RDONLY);
+        if (fd < 0)
+            continue;
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+
+    b->fd = open_db(DB_FILE, false);
+    return b->fd < 0 ? ERR_DB_FILE : NO_ERROR;
+}
+
+/*
+ *  bench_load
+ *      b:  the benchmark, b->fd is the empty db
+ *      density_pct:  chance in percent that an id is in the dataset
+ *
+ *  Builds the dataset as raw records in a temporary file, batch loads it
+ *  and collects the ids that were left out for bench_add().
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int bench_load(bench_ctx_t *b, int density_pct)
+{
+    unsigned int seed = 283;    // same dataset for every engine and run
+    student_t s = {0};
+    FILE *f;
+    int id;
+    int rc;
+
+    f = tmpfile();
+    if (f == NULL)
+        return ERR_DB_FILE;
+
+    strcpy(s.fname, "bench");
+    b->nfree = 0;
+    for (id = MIN_STD_ID; id <= b->max_id; id++) {
+        if ((int)(rand_r(&seed) % 100) >= density_pct) {
+            b->free_ids[b->nfree++] = id;
+            continue;
+        }
+        s.id = id;
+        s.gpa = rand_r(&seed) % (MAX_STD_GPA + 1);
+        snprintf(s.lname, sizeof(s.lname), "student%d", id % 1000);
+        if (fwrite(&s, sizeof(s), 1, f) != 1) {
+            fclose(f);
+            return ERR_DB_FILE;
+        }
+    }
+
+    // ids past max_id are free as well, so a dense dataset can still add
+    for (id = b->max_id + 1; id <= b->id_space && b->nfree < BENCH_ADDS; id++)
+        b->free_ids[b->nfree++] = id;
+
+    for (int i = b->nfree - 1; i > 0; i--) {
+        int j = rand_r(&seed) % (i + 1);
+        int t = b->free_ids[i];
+
+        b->free_ids[i] = b->free_ids[j];
+        b->free_ids[j] = t;
+    }
+    b->next_free = 0;
+
+    rewind(f);
+    rc = batch_load(b->fd, f, true);
+    fclose(f);
+    return rc < 0 ? ERR_DB_FILE : NO_ERROR;
+}
+
+static void bench_report(FILE *out, const char *format, int row,
+                         const char *engine, const char *op, const char *cache,
+                         int max_id, int density_pct, double *lat, int n)
+{
+    double total = 0;
+    double p50 = 0, p90 = 0, p99 = 0, max = 0;
+
+    if (n > 0) {
+        qsort(lat, n, sizeof(double), cmp_double);
+        for (int i = 0; i < n; i++)
+            total += lat[i];
+        p50 = lat[n * 50 / 100];
+        p90 = lat[n * 90 / 100];
+        p99 = lat[n * 99 / 100];
+        max = lat[n - 1];
+    }
+
+    if (strcmp(format, BENCH_FMT_JSON) == 0) {
+        fprintf(out, "%s\n  {\"engine\": \"%s\", \"op\": \"%s\", \"cache\": \"%s\", "
+                "\"max_id\": %d, \"density\": %d, \"samples\": %d, "
+                "\"ops_per_sec\": %.1f, \"p50_us\": %.2f, \"p90_us\": %.2f, "
+                "\"p99_us\": %.2f, \"max_us\": %.2f}",
+                row == 0 ? "[" : ",", engine, op, cache, max_id, density_pct, n,
+                total > 0 ? n * 1e6 / total : 0, p50, p90, p99, max);
+        return;
+    }
+
+    if (row == 0)
+        fprintf(out, "engine,op,cache,max_id,density,samples,ops_per_sec,"
+                "p50_us,p90_us,p99_us,max_us\n");
+    fprintf(out, "%s,%s,%s,%d,%d,%d,%.1f,%.2f,%.2f,%.2f,%.2f\n",
+            engine, op, cache, max_id, density_pct, n,
+            total > 0 ? n * 1e6 / total : 0, p50, p90, p99, max);
+}
+
+/*
+ *  bench_engine
+ *      out, format:  where and how to write the results
+ *      row:  number of result rows written so far, updated
+ *      engine:  name of the engine, already selected in the environment
+ *      b:  the benchmark, b->fd is unused on entry
+ *      density_pct:  dataset density
+ *
+ *  Loads the dataset into a fresh db and runs every operation warm and
+ *  then cold.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int bench_engine(FILE *out, const char *format, int *row, const char *engine,
+                        bench_ctx_t *b, int density_pct)
+{
+    struct timespec t0, t1;
+    double *lat;
+    size_t i;
+    int rc = NO_ERROR;
+
+    lat = malloc(bench_ops[0].warm_samples * sizeof(double));
+    if (lat == NULL)
+        return ERR_DB_FILE;
+
+    b->fd = open_db(DB_FILE, true);
+    if (b->fd < 0 || bench_load(b, density_pct) != NO_ERROR) {
+        fprintf(stderr, M_ERR_BENCH_OP, "load", engine);
+        free(lat);
+        if (b->fd >= 0)
+            close_db(b->fd);
+        return ERR_DB_FILE;
+    }
+
+    for (i = 0; i < sizeof(bench_ops) / sizeof(bench_ops[0]) && rc == NO_ERROR; i++) {
+        const bench_op_t *op = &bench_ops[i];
+
+        for (int cold = 0; cold <= 1 && rc == NO_ERROR; cold++) {
+            int samples = cold ? op->cold_samples : op->warm_samples;
+            int n = 0;
+
+            if (!cold)
+                print_db(b->fd);
+            while (n < samples) {
+                if (cold && bench_cold(b) != NO_ERROR) {
+                    rc = ERR_DB_FILE;
+                    break;
+                }
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                rc = op->fn(b);
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                if (rc != NO_ERROR)
+                    break;
+                lat[n++] = elapsed_us(&t0, &t1);
+            }
+
+            if (rc == SRCH_NOT_FOUND)
+                rc = NO_ERROR;
+            if (rc != NO_ERROR) {
+                fprintf(stderr, M_ERR_BENCH_OP, op->name, engine);
+                break;
+            }
+            bench_report(out, format, (*row)++, engine, op->name,
+                         cold ? "cold" : "warm", b->max_id, density_pct, lat, n);
+        }
+    }
+
+    if (b->fd >= 0)
+        close_db(b->fd);
+    free(lat);
+    return rc;
+}
+
+/*
+ *  bench_db
+ *      max_id:  highest id in the dataset, at most MAX_STD_ID_LIMIT
+ *      density_pct:  chance in percent that an id is in the dataset
+ *      format:  BENCH_FMT_CSV or BENCH_FMT_JSON
+ *
+ *  Runs the benchmark for the mmap and the rw engine in a scratch directory
+ *  and writes the results to stdout.  SDB_ENGINE and SDB_MAX_ID are left as
+ *  they were found.
+ *
+ *  returns:  NO_ERROR on success
+ *            ERR_DB_OP on bad arguments
+ *            ERR_DB_FILE if the scratch directory or an operation failed
+ *
+ *  console:  M_ERR_BENCH_ARGS on bad arguments, errors go to stderr
+ */
+int bench_db(int max_id, int density_pct, const char *format)
+{
+    static const char *engines[] = {"mmap", DB_ENGINE_RW};
+    char *saved_engine, *saved_max_id;
+    char id_space[16];
+    char dir[] = BENCH_DIR;
+    bench_ctx_t b = {0};
+    FILE *out;
+    int home, devnull, saved_out;
+    int row = 0;
+    int rc = NO_ERROR;
+    size_t i;
+
+    if (max_id < MIN_STD_ID || max_id > MAX_STD_ID_LIMIT ||
+        density_pct < 1 || density_pct > 100 ||
+        (strcmp(format, BENCH_FMT_CSV) != 0 && strcmp(format, BENCH_FMT_JSON) != 0)) {
+        printf(M_ERR_BENCH_ARGS, MAX_STD_ID_LIMIT);
+        return ERR_DB_OP;
+    }
+
+    b.max_id = max_id;
+    b.id_space = (max_id > MAX_STD_ID) ? max_id : MAX_STD_ID;
+    b.seed = 283;
+    b.free_ids = malloc(((size_t)b.id_space + 1) * sizeof(int));
+    home = open(".", O_RDONLY | O_DIRECTORY);
+    if (b.free_ids == NULL || home < 0 || mkdtemp(dir) == NULL || chdir(dir) < 0) {
+        fprintf(stderr, M_ERR_BENCH_DIR);
+        free(b.free_ids);
+        if (home >= 0)
+            close(home);
+        return ERR_DB_FILE;
+    }
+
+    // results go to the real stdout, the operations' messages to /dev/null
+    fflush(stdout);
+    saved_out = dup(STDOUT_FILENO);
+    out = fdopen(dup(saved_out), "w");
+    devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    saved_engine = bench_env_save(DB_ENGINE_ENV);
+    saved_max_id = bench_env_save(DB_MAX_ID_ENV);
+    snprintf(id_space, sizeof(id_space), "%d", b.id_space);
+    setenv(DB_MAX_ID_ENV, id_space, 1);
+
+    for (i = 0; i < sizeof(engines) / sizeof(engines[0]) && rc == NO_ERROR; i++) {
+        if (strcmp(engines[i], DB_ENGINE_RW) == 0)
+            setenv(DB_ENGINE_ENV, DB_ENGINE_RW, 1);
+        else
+            unsetenv(DB_ENGINE_ENV);
+        rc = bench_engine(out, format, &row, engines[i], &b, density_pct);
+        for (size_t f = 0; f < sizeof(bench_files) / sizeof(bench_files[0]); f++)
+            unlink(bench_files[f]);
+    }
+    if (strcmp(format, BENCH_FMT_JSON) == 0)
+        fprintf(out, "%s]\n", row == 0 ? "[" : "\n");
+    fclose(out);
+
+    fflush(stdout);
+    dup2(saved_out, STDOUT_FILENO);
+    close(saved_out);
+
+    bench_env_restore(DB_ENGINE_ENV, saved_engine);
+    bench_env_restore(DB_MAX_ID_ENV, saved_max_id);
+
+    unlink(TMP_DB_FILE);
+    if (fchdir(home) == 0)
+        rmdir(dir);
+    close(home);
+    free(b.free_ids);
+    return rc;
+}
@@ -0,0 +1,19 @@
+#ifndef __SDBBENCH_H__
+    #define __SDBBENCH_H__
+
+//benchmark of the sdbsc.c operations on a synthetic dataset, see bench_db()
+int bench_db(int max_id, int density_pct, const char *format);
+
+//result formats
+#define BENCH_FMT_CSV   "csv"
+#define BENCH_FMT_JSON  "json"
+
+//scratch directory the benchmark runs in, created next to student.db
+#define BENCH_DIR       ".sdbbench.XXXXXX"
+
+//Output messages
+#define M_ERR_BENCH_ARGS  "Benchmark needs 1 <= max_id <= %d, 1 <= density <= 100 and csv or json\n"
+#define M_ERR_BENCH_DIR   "Error creating benchmark directory, exiting!\n"
+#define M_ERR_BENCH_OP    "Benchmark of %s on the %s engine failed, exiting!\n"
+
+#endif
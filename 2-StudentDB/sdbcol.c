@@ -0,0 +1,443 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+#include "sdbcol.h"
+
+/*
+ *  Columnar export and import
+ *
+ *  sdbsc -e writes the live records as a columnar snapshot, see sdbcol.h
+ *  for the format.  The records are collected with for_each_student()
+ *  into one growing array per field, so the id and gpa columns are 4 bytes
+ *  a row, 1/16 of a record.  With dict the names are replaced by codes into
+ *  a table of the distinct names, which is built with an open addressing
+ *  hash table.  The whole file is then written with a single writev().
+ *
+ *  sdbsc -i maps a snapshot, puts the rows back together in memory and
+ *  hands them to put_students(), so the import gets the same duplicate and
+ *  range checks as -B and a single log append.  Only the slots of the
+ *  imported ids are read and written, through io_uring on the rw engine,
+ *  so a few rows spread over a huge id range cost no more than a few rows.
+ */
+
+#define COL_FNAME_WIDTH     sizeof(EMPTY_STUDENT_RECORD.fname)
+#define COL_LNAME_WIDTH     sizeof(EMPTY_STUDENT_RECORD.lname)
+
+typedef struct col_build {
+    int32_t *id;
+    int32_t *gpa;
+    char *fname;            // rows * COL_FNAME_WIDTH, zero padded
+    char *lname;            // rows * COL_LNAME_WIDTH, zero padded
+    size_t rows;
+    size_t cap;
+    bool failed;            // out of memory
+} col_build_t;
+
+//a dictionary encoded name column
+typedef struct col_dict {
+    uint32_t *codes;        // one per row
+    char *names;            // count distinct names of width bytes
+    uint32_t count;
+} col_dict_t;
+
+static bool col_grow(void **p, size_t size)
+{
+    void *q = realloc(*p, size);
+
+    if (q == NULL)
+        return false;
+    *p = q;
+    return true;
+}
+
+/*
+ *  Copies a name up to its NUL and zero pads the rest, so names loaded raw
+ *  with -B compare equal when only the bytes after the NUL differ.
+ */
+static void col_name_copy(char *dst, const char *src, size_t width)
+{
+    size_t len = strnlen(src, width);
+
+    memcpy(dst, src, len);
+    memset(dst + len, 0, width - len);
+}
+
+//for_each_student() callback, appends a record to the columns
+static int col_collect(const student_t *s, void *arg)
+{
+    col_build_t *b = arg;
+
+    if (b->rows == b->cap) {
+        size_t cap = (b->cap == 0) ? 4096 : b->cap * 2;
+
+        if (!col_grow((void **)&b->id, cap * sizeof(int32_t)) ||
+            !col_grow((void **)&b->gpa, cap * sizeof(int32_t)) ||
+            !col_grow((void **)&b->fname, cap * COL_FNAME_WIDTH) ||
+            !col_grow((void **)&b->lname, cap * COL_LNAME_WIDTH)) {
+            b->failed = true;
+            return 1;
+        }
+        b->cap = cap;
+    }
+
+    b->id[b->rows] = s->id;
+    b->gpa[b->rows] = s->gpa;
+    col_name_copy(b->fname + b->rows * COL_FNAME_WIDTH, s->fname, COL_FNAME_WIDTH);
+    col_name_copy(b->lname + b->rows * COL_LNAME_WIDTH, s->lname, COL_LNAME_WIDTH);
+    b->rows++;
+    return 0;
+}
+
+static uint32_t col_hash(const char *name, size_t width)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < width; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ *  col_dict_build
+ *      *d:     dictionary to fill in
+ *      names:  rows names of width bytes each
+ *      rows:   number of names
+ *      width:  field width
+ *
+ *  Gives every distinct name a code in order of first appearance.  The
+ *  hash table holds code + 1, so zero marks a free bucket, and has at
+ *  least twice as many buckets as there are names.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE if memory ran out
+ */
+static int col_dict_build(col_dict_t *d, const char *names, size_t rows,
+                          size_t width)
+{
+    size_t buckets = 16;
+    uint32_t *table;
+
+    while (buckets < rows * 2)
+        buckets *= 2;
+    table = calloc(buckets, sizeof(uint32_t));
+    d->codes = malloc((rows > 0 ? rows : 1) * sizeof(uint32_t));
+    d->names = malloc((rows > 0 ? rows : 1) * width);
+    d->count = 0;
+    if (table == NULL || d->codes == NULL || d->names == NULL) {
+        free(table);
+        return ERR_DB_FILE;
+    }
+
+    for (size_t i = 0; i < rows; i++) {
+        const char *name = names + i * width;
+        size_t b = col_hash(name, width) & (buckets - 1);
+
+        while (table[b] != 0 &&
+               memcmp(d->names + (size_t)(table[b] - 1) * width, name, width) != 0)
+            b = (b + 1) & (buckets - 1);
+        if (table[b] == 0) {
+            memcpy(d->names + (size_t)d->count * width, name, width);
+            table[b] = ++d->count;
+        }
+        d->codes[i] = table[b] - 1;
+    }
+    free(table);
+    return NO_ERROR;
+}
+
+/*
+ *  Keeps calling writev() until every buffer is written, since a large
+ *  write is allowed to come back short.  Returns NO_ERROR or ERR_DB_FILE.
+ */
+static int col_writev_all(int fd, struct iovec *iov, int n)
+{
+    while (n > 0) {
+        ssize_t done = writev(fd, iov, n);
+
+        if (done < 0) {
+            if (errno == EINTR)
+                continue;
+            return ERR_DB_FILE;
+        }
+        while (n > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  Appends len bytes at data to the iovec list and the file layout, padded
+ *  to COL_ALIGN, and returns the offset they start at.
+ */
+static uint64_t col_place(struct iovec *iov, int *n, uint64_t *end,
+                          const void *data, size_t len)
+{
+    static const char pad[COL_ALIGN];
+    uint64_t offset = *end;
+    size_t gap = (COL_ALIGN - len % COL_ALIGN) % COL_ALIGN;
+
+    iov[*n].iov_base = (void *)data;
+    iov[(*n)++].iov_len = len;
+    if (gap > 0) {
+        iov[*n].iov_base = (void *)pad;
+        iov[(*n)++].iov_len = gap;
+    }
+    *end += len + gap;
+    return offset;
+}
+
+/*
+ *  export_columns
+ *      fd:    linux file descriptor
+ *      path:  columnar file to write, replaced if it exists
+ *      dict:  dictionary encode the name columns
+ *
+ *  Writes every live record to path in the columnar format of sdbcol.h,
+ *  in id order.
+ *
+ *  returns:  <number>       the number of records exported
+ *            ERR_DB_FILE    database or columnar file I/O issue
+ *
+ *  console:  M_COL_EXPORTED   on success
+ *            M_ERR_DB_READ    error reading the database file
+ *            M_ERR_COL_WRITE  error writing the columnar file
+ */
+int export_columns(int fd, const char *path, bool dict)
+{
+    col_header_t hdr = {0};
+    col_build_t b = {0};
+    col_dict_t names[2] = {{0}};    // fname, lname
+    struct iovec iov[2 + COL_COUNT * 4];
+    uint64_t end;
+    int n = 0;
+    int out_fd;
+    int rc = ERR_DB_FILE;
+
+    if (for_each_student(fd, col_collect, &b) < 0 || b.failed) {
+        printf(M_ERR_DB_READ);
+        goto out;
+    }
+    if (dict &&
+        (col_dict_build(&names[0], b.fname, b.rows, COL_FNAME_WIDTH) != NO_ERROR ||
+         col_dict_build(&names[1], b.lname, b.rows, COL_LNAME_WIDTH) != NO_ERROR)) {
+        printf(M_ERR_COL_WRITE, path);
+        goto out;
+    }
+
+    hdr.magic = COL_MAGIC;
+    hdr.version = COL_VERSION;
+    hdr.rows = b.rows;
+    end = 0;
+    col_place(iov, &n, &end, &hdr, sizeof(hdr));
+
+    hdr.cols[COL_ID] = (col_desc_t){.encoding = COL_ENC_PLAIN, .width = sizeof(int32_t)};
+    hdr.cols[COL_ID].offset = col_place(iov, &n, &end, b.id, b.rows * sizeof(int32_t));
+    hdr.cols[COL_GPA] = (col_desc_t){.encoding = COL_ENC_PLAIN, .width = sizeof(int32_t)};
+    hdr.cols[COL_GPA].offset = col_place(iov, &n, &end, b.gpa, b.rows * sizeof(int32_t));
+
+    for (int i = 0; i < 2; i++) {
+        col_desc_t *c = &hdr.cols[i == 0 ? COL_FNAME : COL_LNAME];
+        size_t width = (i == 0) ? COL_FNAME_WIDTH : COL_LNAME_WIDTH;
+
+        if (!dict) {
+            c->encoding = COL_ENC_PLAIN;
+            c->width = width;
+            c->offset = col_place(iov, &n, &end, i == 0 ? b.fname : b.lname,
+                                  b.rows * width);
+            continue;
+        }
+        c->encoding = COL_ENC_DICT;
+        c->width = sizeof(uint32_t);
+        c->dict_width = width;
+        c->dict_count = names[i].count;
+        c->offset = col_place(iov, &n, &end, names[i].codes,
+                              b.rows * sizeof(uint32_t));
+        c->dict_offset = col_place(iov, &n, &end, names[i].names,
+                                   (size_t)names[i].count * width);
+    }
+
+    out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (out_fd < 0 || col_writev_all(out_fd, iov, n) != NO_ERROR) {
+        printf(M_ERR_COL_WRITE, path);
+        if (out_fd >= 0)
+            close(out_fd);
+        goto out;
+    }
+    if (close(out_fd) < 0) {
+        printf(M_ERR_COL_WRITE, path);
+        goto out;
+    }
+
+    printf(M_COL_EXPORTED, (int)b.rows, path);
+    rc = b.rows;
+
+out:
+    for (int i = 0; i < 2; i++) {
+        free(names[i].codes);
+        free(names[i].names);
+    }
+    free(b.id);
+    free(b.gpa);
+    free(b.fname);
+    free(b.lname);
+    return rc;
+}
+
+/*
+ *  Returns true if column c of a file of size bytes with rows rows can be
+ *  read without going past the end of the file.  Names may be plain or
+ *  dictionary encoded, ids and gpas are always plain.
+ */
+static bool col_desc_valid(const col_desc_t *c, uint64_t rows, uint64_t size,
+                           uint32_t field_width, bool name)
+{
+    if (c->encoding == COL_ENC_PLAIN) {
+        if (c->width != field_width)
+            return false;
+    } else if (c->encoding == COL_ENC_DICT && name) {
+        if (c->width != sizeof(uint32_t) || c->dict_width != field_width ||
+            c->dict_offset > size ||
+            (uint64_t)c->dict_count * c->dict_width > size - c->dict_offset)
+            return false;
+    } else {
+        return false;
+    }
+    return c->offset % sizeof(uint32_t) == 0 && c->offset <= size &&
+           rows * c->width <= size - c->offset;
+}
+
+/*
+ *  Copies the name of row i out of column c into a field of width bytes,
+ *  leaving the last byte a NUL like add_student() does.  Returns false if
+ *  the row has no valid dictionary code.
+ */
+static bool col_name_get(const char *base, const col_desc_t *c, size_t i,
+                         char *field, size_t width)
+{
+    const char *name;
+
+    if (c->encoding == COL_ENC_PLAIN) {
+        name = base + c->offset + i * width;
+    } else {
+        uint32_t code = ((const uint32_t *)(base + c->offset))[i];
+
+        if (code >= c->dict_count)
+            return false;
+        name = base + c->dict_offset + (size_t)code * width;
+    }
+    memcpy(field, name, width);
+    field[width - 1] = '\0';
+    return true;
+}
+
+/*
+ *  import_columns
+ *      fd:    linux file descriptor
+ *      path:  columnar file written by export_columns()
+ *
+ *  Loads every row of a columnar file into the database with
+ *  put_students().  Ids that are already in the database are rejected the
+ *  same way -B rejects them.
+ *
+ *  returns:  NO_ERROR       every row was loaded
+ *            ERR_DB_OP      some rows were rejected
+ *            ERR_DB_FILE    database or columnar file I/O issue
+ *
+ *  console:  M_BATCH_LOADED    summary on completion
+ *            M_ERR_BATCH_RNG   ID or GPA out of allowable range
+ *            M_ERR_DB_ADD_DUP  student already exists
+ *            M_ERR_DB_WRITE    error writing to db file
+ *            M_ERR_COL_READ    the columnar file is missing or damaged
+ */
+int import_columns(int fd, const char *path)
+{
+    const col_header_t *hdr;
+    student_t *rows = NULL;
+    int *rcs = NULL;
+    struct stat st;
+    char *base = MAP_FAILED;
+    int cfd;
+    int rc = ERR_DB_FILE;
+
+    cfd = open(path, O_RDONLY);
+    if (cfd < 0 || fstat(cfd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr))
+        goto bad;
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, cfd, 0);
+    if (base == MAP_FAILED)
+        goto bad;
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    hdr = (const col_header_t *)base;
+    if (hdr->magic != COL_MAGIC || hdr->version != COL_VERSION ||
+        !col_desc_valid(&hdr->cols[COL_ID], hdr->rows, st.st_size,
+                        sizeof(int32_t), false) ||
+        !col_desc_valid(&hdr->cols[COL_GPA], hdr->rows, st.st_size,
+                        sizeof(int32_t), false) ||
+        !col_desc_valid(&hdr->cols[COL_FNAME], hdr->rows, st.st_size,
+                        COL_FNAME_WIDTH, true) ||
+        !col_desc_valid(&hdr->cols[COL_LNAME], hdr->rows, st.st_size,
+                        COL_LNAME_WIDTH, true))
+        goto bad;
+
+    rows = calloc(hdr->rows > 0 ? hdr->rows : 1, STUDENT_RECORD_SIZE);
+    rcs = calloc(hdr->rows > 0 ? hdr->rows : 1, sizeof(int));
+    if (rows == NULL || rcs == NULL)
+        goto bad;
+    for (size_t i = 0; i < hdr->rows; i++) {
+        student_t *s = &rows[i];
+
+        s->id = ((const int32_t *)(base + hdr->cols[COL_ID].offset))[i];
+        s->gpa = ((const int32_t *)(base + hdr->cols[COL_GPA].offset))[i];
+        if (!col_name_get(base, &hdr->cols[COL_FNAME], i, s->fname, COL_FNAME_WIDTH) ||
+            !col_name_get(base, &hdr->cols[COL_LNAME], i, s->lname, COL_LNAME_WIDTH))
+            goto bad;
+    }
+
+    int loaded = put_students(fd, rows, hdr->rows, rcs);
+    if (loaded < 0) {
+        printf(M_ERR_DB_WRITE);
+        goto out;
+    }
+    for (size_t i = 0; i < hdr->rows; i++) {
+        if (rcs[i] == ERR_DB_RANGE)
+            printf(M_ERR_BATCH_RNG, rows[i].id);
+        else if (rcs[i] == ERR_DB_OP)
+            printf(M_ERR_DB_ADD_DUP, rows[i].id);
+        else if (rcs[i] == ERR_DB_FILE)
+            printf(M_ERR_DB_WRITE);
+    }
+    printf(M_BATCH_LOADED, loaded, (int)hdr->rows - loaded);
+    rc = (loaded == (int)hdr->rows) ? NO_ERROR : ERR_DB_OP;
+    goto out;
+
+bad:
+    printf(M_ERR_COL_READ, path);
+out:
+    free(rows);
+    free(rcs);
+    if (base != MAP_FAILED)
+        munmap(base, st.st_size);
+    if (cfd >= 0)
+        close(cfd);
+    return rc;
+}
@@ -0,0 +1,62 @@
+#ifndef __SDBCOL_H__
+    #define __SDBCOL_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//Columnar snapshot of a student db, written by sdbsc -e and loaded back by
+//sdbsc -i.  The file starts with a col_header_t, followed by one contiguous
+//array per field, each starting on a COL_ALIGN boundary.  The offsets in
+//the header are from the start of the file, so a reader that only wants
+//gpa maps or reads rows * 4 bytes and nothing else.  Rows are in id order
+//and all integers are in the byte order of the host that wrote the file.
+//
+//A plain column holds width bytes per row: int32 ids and gpas, and the
+//names zero padded to their student_t field width.  A name column can be
+//dictionary encoded instead, then it holds a uint32 code per row that
+//indexes dict_count distinct names of dict_width bytes each.
+typedef enum {
+    COL_ID,
+    COL_GPA,
+    COL_FNAME,
+    COL_LNAME,
+    COL_COUNT,
+} col_field_t;
+
+#define COL_ENC_PLAIN   1
+#define COL_ENC_DICT    2
+
+typedef struct col_desc {
+    uint32_t encoding;      // COL_ENC_PLAIN or COL_ENC_DICT
+    uint32_t width;         // bytes per row in the value array
+    uint32_t dict_width;    // bytes per dictionary entry, 0 if plain
+    uint32_t dict_count;    // dictionary entries, 0 if plain
+    uint64_t offset;        // value array, rows * width bytes
+    uint64_t dict_offset;   // dictionary, dict_count * dict_width bytes
+} col_desc_t;
+
+typedef struct col_header {
+    uint32_t magic;         // COL_MAGIC
+    uint32_t version;       // COL_VERSION
+    uint32_t rows;
+    uint32_t reserved;
+    col_desc_t cols[COL_COUNT];     // indexed by col_field_t
+} col_header_t;
+
+#define COL_MAGIC       0x43424453      // "SDBC"
+#define COL_VERSION     1
+#define COL_ALIGN       64
+
+//sdbsc -e argument that selects dictionary encoded names
+#define COL_OPT_DICT    "dict"
+
+//prototypes
+int export_columns(int fd, const char *path, bool dict);
+int import_columns(int fd, const char *path);
+
+//Output messages
+#define M_COL_EXPORTED    "Exported %d student record(s) to %s.\n"
+#define M_ERR_COL_WRITE   "Error writing columnar file %s, exiting!\n"
+#define M_ERR_COL_READ    "Error reading columnar file %s, it is missing or damaged!\n"
+
+#endif
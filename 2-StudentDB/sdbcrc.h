@@ -0,0 +1,18 @@
+#ifndef __SDBCRC_H__
+    #define __SDBCRC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "db.h"
+
+//CRC32C (Castagnoli), computed with the SSE4.2 crc32 instruction when the
+//CPU has it and with a slicing-by-8 table otherwise.  SDB_SIMD=scalar
+//forces the table.
+uint32_t crc32c(uint32_t crc, const void *buff, size_t len);
+
+//Sets sums[i] to the checksum of record r[i].  An empty record, all zeros,
+//sums to 0, so a hole or a zero filled sidecar checks out as empty.
+void record_sums(const student_t *r, size_t n, uint32_t *sums);
+uint32_t record_sum(const student_t *s);
+
+#endif
@@ -0,0 +1,377 @@
+#define _GNU_SOURCE     // IOV_MAX
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+#include "sdbring.h"
+
+/*
+ *  Batched I/O
+ *
+ *  ring_read() and ring_write() take a batch of reads or writes at
+ *  arbitrary offsets of one file.  Runs of ops that are adjacent in the
+ *  file, in the order given, are merged into one vectored operation, so
+ *  callers that sort their ops by offset get one system call per run of
+ *  neighbouring records.  The runs are then queued on an io_uring with up
+ *  to RING_DEPTH of them in flight, which lets a random access batch keep
+ *  the device busy instead of waiting on one read at a time.  liburing is
+ *  not needed, the ring is set up with the raw system calls.
+ *
+ *  If the kernel has no io_uring, refuses it (seccomp, io_uring_disabled)
+ *  or SDB_IO=sync is set, every run is done with preadv()/pwritev() in
+ *  turn instead.  Either way each op ends up with its own result, a short
+ *  read past the end of the file included, and a short write is finished
+ *  with pwrite().
+ */
+
+typedef struct ring_run {
+    size_t first;           // first op of the run
+    size_t count;           // ops in the run, at most IOV_MAX
+    off_t offset;
+    ssize_t res;            // bytes transferred by the whole run, or -errno
+} ring_run_t;
+
+/*
+ *  Merges adjacent ops into runs and points one iovec at each op.  Returns
+ *  the number of runs.
+ */
+static size_t ring_plan(ring_op_t *ops, size_t n, struct iovec *iov,
+                        ring_run_t *runs)
+{
+    size_t nruns = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        iov[i].iov_base = ops[i].buff;
+        iov[i].iov_len = ops[i].len;
+        if (nruns > 0 && runs[nruns - 1].count < IOV_MAX &&
+            ops[i - 1].offset + (off_t)ops[i - 1].len == ops[i].offset) {
+            runs[nruns - 1].count++;
+            continue;
+        }
+        runs[nruns].first = i;
+        runs[nruns].count = 1;
+        runs[nruns].offset = ops[i].offset;
+        runs[nruns].res = -EAGAIN;      // not done yet
+        nruns++;
+    }
+    return nruns;
+}
+
+static ssize_t ring_run_sync(int fd, const struct iovec *iov, ring_run_t *r,
+                             bool write)
+{
+    ssize_t n;
+
+    do {
+        if (write)
+            n = pwritev(fd, iov + r->first, r->count, r->offset);
+        else
+            n = preadv(fd, iov + r->first, r->count, r->offset);
+    } while (n < 0 && errno == EINTR);
+    return (n < 0) ? -errno : n;
+}
+
+#ifdef __NR_io_uring_setup
+typedef struct ring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+} ring_t;
+
+static void ring_close(ring_t *ring)
+{
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr != NULL)
+        munmap(ring->sq_ptr, ring->sq_len);
+    close(ring->fd);
+}
+
+static bool ring_open(ring_t *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return false;
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+
+    sq = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto fail;
+    ring->sq_ptr = sq;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            goto fail;
+    }
+    ring->cq_ptr = cq;
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return true;
+
+fail:
+    ring_close(ring);
+    return false;
+}
+
+/*
+ *  Copies the result of every completion the kernel has posted into its
+ *  run.  Returns the number of completions reaped.
+ */
+static unsigned ring_reap(ring_t *ring, ring_run_t *runs)
+{
+    unsigned head = *ring->cq_head;
+    unsigned n = 0;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+        runs[cqe->user_data].res = cqe->res;
+        head++;
+        n++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+/*
+ *  Waits for the runs the kernel has taken.  Until they complete it may
+ *  still be reading or writing their buffers, so nothing can be redone
+ *  with preadv()/pwritev() and the ring cannot be closed before then.
+ *  Returns false if the wait itself failed.
+ */
+static bool ring_drain(ring_t *ring, ring_run_t *runs, unsigned taken)
+{
+    while (taken > 0) {
+        int rc = syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+
+        if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return false;
+        taken -= ring_reap(ring, runs);
+    }
+    return true;
+}
+
+/*
+ *  Runs every run through the ring, keeping up to entries in flight.
+ *  Returns false if the ring could not be used at all; runs that did not
+ *  complete are left with res -EAGAIN for the caller to redo.
+ */
+static bool ring_submit_all(int fd, struct iovec *iov, ring_run_t *runs,
+                            size_t nruns, bool write)
+{
+    unsigned entries = (nruns < RING_DEPTH) ? nruns : RING_DEPTH;
+    size_t queued = 0, done = 0;
+    unsigned pending = 0;       // queued but not yet taken by the kernel
+    unsigned in_flight = 0;
+    ring_t ring;
+
+    if (!ring_open(&ring, entries))
+        return false;
+
+    while (done < nruns) {
+        unsigned tail = *ring.sq_tail;
+
+        while (queued < nruns && in_flight < entries) {
+            ring_run_t *r = &runs[queued];
+            unsigned idx = tail & *ring.sq_mask;
+            struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = fd;
+            sqe->off = r->offset;
+            sqe->addr = (uintptr_t)(iov + r->first);
+            sqe->len = r->count;
+            sqe->user_data = queued;
+            ring.sq_array[idx] = idx;
+            tail++;
+            queued++;
+            pending++;
+            in_flight++;
+        }
+        __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+        int rc = syscall(__NR_io_uring_enter, ring.fd, pending, 1,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            // The rest are redone synchronously, once the kernel is done
+            // with what it took.  Runs it never took are still -EAGAIN.
+            if (!ring_drain(&ring, runs, in_flight - pending)) {
+                // Their buffers may yet be written, so they are failed
+                // rather than redone, and the ring is left open
+                for (size_t i = 0; i < queued - pending; i++) {
+                    if (runs[i].res == -EAGAIN)
+                        runs[i].res = -EIO;
+                }
+                return true;
+            }
+            break;
+        }
+        pending -= (unsigned)rc < pending ? (unsigned)rc : pending;
+
+        unsigned n = ring_reap(&ring, runs);
+        done += n;
+        in_flight -= n;
+    }
+
+    ring_close(&ring);
+    return true;
+}
+#endif
+
+static int ring_batch(int fd, ring_op_t *ops, size_t n, bool write)
+{
+    struct iovec *iov = malloc((n > 0 ? n : 1) * sizeof(struct iovec));
+    ring_run_t *runs = malloc((n > 0 ? n : 1) * sizeof(ring_run_t));
+    size_t nruns;
+    bool ringed = false;
+
+    if (iov == NULL || runs == NULL) {
+        free(iov);
+        free(runs);
+        return ERR_DB_FILE;
+    }
+    nruns = ring_plan(ops, n, iov, runs);
+
+#ifdef __NR_io_uring_setup
+    const char *mode = getenv(RING_IO_ENV);
+
+    // A single run gains nothing from a ring
+    if ((mode == NULL || strcmp(mode, RING_IO_SYNC) != 0) && nruns > 1)
+        ringed = ring_submit_all(fd, iov, runs, nruns, write);
+#endif
+    if (!ringed) {
+        for (size_t i = 0; i < nruns; i++)
+            runs[i].res = ring_run_sync(fd, iov, &runs[i], write);
+    }
+
+    // Hand each op its share of its run, and redo what the ring could not
+    for (size_t i = 0; i < nruns; i++) {
+        ring_run_t *r = &runs[i];
+        ssize_t left;
+
+        if (r->res == -EAGAIN || r->res == -EINTR || r->res == -EINVAL ||
+            r->res == -EOPNOTSUPP)
+            r->res = ring_run_sync(fd, iov, r, write);
+        left = r->res;
+        for (size_t j = r->first; j < r->first + r->count; j++) {
+            ring_op_t *op = &ops[j];
+
+            if (r->res < 0) {
+                op->res = r->res;
+                continue;
+            }
+            op->res = ((size_t)left < op->len) ? left : (ssize_t)op->len;
+            left -= op->res;
+
+            // Finish a short write, a short read is the end of the file
+            while (write && (size_t)op->res < op->len) {
+                ssize_t k = pwrite(fd, (char *)op->buff + op->res,
+                                   op->len - op->res, op->offset + op->res);
+
+                if (k < 0 && errno == EINTR)
+                    continue;
+                if (k <= 0) {
+                    op->res = (k < 0) ? -errno : -EIO;
+                    break;
+                }
+                op->res += k;
+            }
+        }
+    }
+
+    free(iov);
+    free(runs);
+    return NO_ERROR;
+}
+
+/*
+ *  ring_read
+ *      fd:   file to read from
+ *      ops:  the reads, each sets its res
+ *      n:    number of ops
+ *
+ *  Reads every op of the batch, see "Batched I/O" above.  Ops that follow
+ *  each other in the file should follow each other in ops.
+ *
+ *  returns:  NO_ERROR       the batch ran, look at each res
+ *            ERR_DB_FILE    out of memory, nothing was read
+ *
+ *  console:  Does not produce any console I/O
+ */
+int ring_read(int fd, ring_op_t *ops, size_t n)
+{
+    return ring_batch(fd, ops, n, false);
+}
+
+/*
+ *  ring_write
+ *      fd:   file to write to
+ *      ops:  the writes, each sets its res
+ *      n:    number of ops
+ *
+ *  Writes every op of the batch, like ring_read().  An op is complete when
+ *  its res equals its len.
+ *
+ *  returns:  NO_ERROR       the batch ran, look at each res
+ *            ERR_DB_FILE    out of memory, nothing was written
+ *
+ *  console:  Does not produce any console I/O
+ */
+int ring_write(int fd, ring_op_t *ops, size_t n)
+{
+    return ring_batch(fd, ops, n, true);
+}
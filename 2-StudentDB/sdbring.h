@@ -0,0 +1,27 @@
+#ifndef __SDBRING_H__
+    #define __SDBRING_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+//One read or write of a batch, see ring_read().  res is filled in with the
+//bytes transferred, or -errno if the I/O failed.
+typedef struct ring_op {
+    void *buff;
+    size_t len;
+    off_t offset;
+    ssize_t res;
+} ring_op_t;
+
+//operations in flight at once, the queue depth the device sees
+#define RING_DEPTH      128
+
+//SDB_IO=sync skips io_uring and always uses preadv()/pwritev()
+#define RING_IO_ENV     "SDB_IO"
+#define RING_IO_SYNC    "sync"
+
+//prototypes
+int ring_read(int fd, ring_op_t *ops, size_t n);
+int ring_write(int fd, ring_op_t *ops, size_t n);
+
+#endif
@@ -1,495 +1,4793 @@
+#define _GNU_SOURCE     // SEEK_DATA/SEEK_HOLE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h> //c library for system call file routines
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/uio.h>
 
 // database include files
 #include "db.h"
 #include "sdbsc.h"
+#include "sdbsrv.h"
+#include "sdbbench.h"
+#include "sdbcol.h"
+#include "sdbring.h"
+#include "sdbsnap.h"
+#include "sdbcrc.h"
 
 /*
- *  open_db
- *      dbFile:  name of the database file
- *      should_truncate:  indicates if opening the file also empties it
+ *  Per database state
  *
- *  returns:  File descriptor on success, or ERR_DB_FILE on failure
+ *  Everything below keeps using the existing function signatures, so the
+ *  extra state for an open database is kept in a small table keyed by fd.
  *
- *  console:  Does not produce any console I/O on success
- *            M_ERR_DB_OPEN on error
+ *  mmap storage engine
+ *
+ *  The database is a dense array of records indexed by id, so the whole id
+ *  space (max_id+1 records, about 6.4MB for the default MAX_STD_ID) is
+ *  mapped MAP_SHARED when a database is opened.  Point lookups and updates then become plain loads
+ *  and stores into the mapping.  Only the part of the mapping below EOF may
+ *  be touched, so the cached file size is checked first and the file is
+ *  grown with ftruncate() before storing a record past the end.  The cache
+ *  goes stale if another process shrinks the file, so every copy in or out
+ *  of the mapping is guarded against SIGBUS, see db_map_load().  If mmap()
+ *  fails, or SDB_ENGINE=rw is set in the environment, base is left NULL and
+ *  the functions fall back to the lseek()/read()/write() path.
+ *
+ *  File header
+ *
+ *  Slot 0 holds a db_header_t (see db.h) with the id range, record size and
+ *  field widths the file was created with.  open_db() reads it before
+ *  anything else, so the id range sizes the mapping, the sidecars and the
+ *  shards of each db.  The default MAX_STD_ID can be raised when a db is
+ *  created or zeroed with SDB_MAX_ID, the file stays a direct array with
+ *  the unused ids as holes.  Only the direct layout exists so far, a file
+ *  with any other layout, record size or field widths is refused.
+ *
+ *  Sidecar files
+ *
+ *  Derived data lives in sidecar files named after the db file, which are
+ *  mapped MAP_SHARED while the db is open.  Each one starts with a stamp of
+ *  the size and mtime of the data file it describes, plus a clean flag that
+ *  is dropped on the first change and set again by close_db().  A sidecar
+ *  that is missing, was not closed cleanly, or does not match the data file
+ *  is rebuilt by scanning the data file when the db is opened.
+ *
+ *  The occupancy bitmap (DB_BITMAP_EXT) holds one bit per slot, set when
+ *  the slot holds a student.  count_db_records() becomes a popcount and
+ *  print_db() only visits set slots.  A second array of bits marks the
+ *  slots written since the snapshot named by snap_id, so an incremental
+ *  snapshot only has to copy those, see snapshot_changes().
+ *
+ *  The name index (DB_INDEX_EXT) holds a (lname, fname, id) entry per slot,
+ *  chained into hash buckets by last name, so adding or deleting a student
+ *  relinks one entry and a lookup by name walks one short chain.
+ *
+ *  The checksum sidecar (DB_CRC_EXT) holds a CRC32C of every slot, updated
+ *  with the record under the same lock, see "Checksums" below.  Unlike the
+ *  other sidecars it is not rebuilt when it does not match the data file,
+ *  since a mismatch is exactly what it is there to catch.  Changes since
+ *  the last checkpoint are in the log and recovery stores their sums along
+ *  with the records, so the sums survive a crash as well as the data does.
+ *
+ *  Write ahead log
  *
+ *  Several sdbsc processes may write the same db at once.  A writer locks
+ *  the record it changes with an OFD lock on its 64 bytes of the data file,
+ *  so checking for a duplicate and storing the record cannot interleave with
+ *  another writer, and compact_db() cannot punch the block in between.
+ *  Before a change is applied its new record image is appended to the log
+ *  (DB_WAL_EXT).  The change is durable once the log is, and concurrent
+ *  writers share fdatasync() calls on it (group commit): whoever holds the
+ *  sync lock flushes everything appended so far, and writers whose records
+ *  were covered by that flush return without syncing themselves.
+ *
+ *  The first page of the log is a header mapped MAP_SHARED by every process
+ *  with the db open.  Locks are single bytes of the log file:
+ *
+ *      WAL_LOCK_CKPT    writers share it, a checkpoint takes it exclusive
+ *      WAL_LOCK_SYNC    held by the writer doing the group fdatasync()
+ *      WAL_LOCK_OPEN    shared by every open handle, see wal_attach()
+ *      WAL_LOCK_APPEND  held while a record is appended at the tail
+ *      WAL_LOCK_INDEX   held while changing the shared name index
+ *      WAL_LOCK_GROW    held while extending the data file
+ *
+ *  A checkpoint syncs the data file and empties the log.  It runs when the
+ *  log grows past DB_WAL_CKPT_BYTES and when the last handle is closed.  The
+ *  first process to open the db replays whatever a crash left in the log.
+ *  Replaying a record just stores its image again, so it does no harm if
+ *  the change had already reached the data file.
+ *
+ *  Threads
+ *
+ *  OFD locks only order different open file descriptions, so the threads of
+ *  sdbsc -S sharing one handle would all be granted the same lock.  Each
+ *  log lock byte therefore also has a pthread rwlock, and a shared OFD lock
+ *  is taken by the first thread in and dropped by the last one out.
+ *  Records are guarded by DB_SHARDS rwlocks, each covering shard_ids ids
+ *  (the id range split DB_SHARDS ways), that is shard_ids *
+ *  STUDENT_RECORD_SIZE bytes of the data file.  Readers share them, so reads never wait for each other and a
+ *  write only holds up the ids in its own shard.
  */
-int open_db(char *dbFile, bool should_truncate)
+#define DB_HANDLE_SLOTS 4
+
+typedef struct db_stamp {
+    uint32_t clean;         // 1 if the sidecar matches the stamp below
+    uint32_t reserved;
+    int64_t  db_size;       // data file size when last closed
+    int64_t  db_mtime_sec;  // data file mtime when last closed
+    int64_t  db_mtime_nsec;
+} db_stamp_t;
+
+#define DB_BITMAP_MAGIC     0x42424453      // "SDBB"
+#define DB_BITMAP_VERSION   4
+#define DB_BITMAP_WORDS(slots)  (((size_t)(slots) + 63) / 64)
+
+typedef struct db_bitmap {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;         // number of bits that follow
+    uint32_t compact_cursor;    // block where compact_db() resumes
+    db_stamp_t stamp;
+    uint64_t snap_id;       // snapshot the changed bits are relative to, 0 if none
+    uint64_t bits[];        // DB_BITMAP_WORDS(slots) words, then as many
+                            // words of changed bits, see bitmap_changed()
+} db_bitmap_t;
+
+#define DB_INDEX_MAGIC      0x49424453      // "SDBI"
+#define DB_INDEX_VERSION    2
+
+typedef struct db_index_entry {
+    char lname[32];         // zero padded, compared with memcmp()
+    char fname[24];
+    int32_t id;             // 0 if the slot is not indexed
+    uint32_t next;          // next slot in the bucket, 0 ends the chain
+    uint32_t prev;          // previous slot in the bucket, 0 if first
+    uint32_t reserved;
+} db_index_entry_t;
+
+typedef struct db_index {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;      // one entry per slot of the data file
+    uint32_t count;         // entries in use
+    db_stamp_t stamp;
+    uint32_t buckets;       // a power of two, the heads follow the entries
+    char reserved[20];      // pad the header to one entry
+    db_index_entry_t entries[];     // capacity entries, then buckets heads
+} db_index_t;
+
+#define DB_CRC_MAGIC        0x4b424453      // "SDBK"
+#define DB_CRC_VERSION      1
+
+typedef struct db_crc {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;         // number of sums that follow
+    uint32_t reserved;
+    uint32_t sums[];        // record_sum() of every slot, 0 if it is empty
+} db_crc_t;
+
+#define DB_WAL_MAGIC        0x57424453      // "SDBW"
+#define DB_WAL_VERSION      1
+#define DB_WAL_HDR_SIZE     4096            // records start on the next page
+#define DB_WAL_CKPT_BYTES   (4 << 20)
+
+typedef struct db_wal_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t tail;          // end of the last complete record
+    uint64_t synced;        // the log is durable up to here
+} db_wal_hdr_t;
+
+typedef struct db_wal_rec {
+    uint32_t magic;
+    int32_t slot;
+    uint64_t lsn;           // offset of this record in the log
+    uint32_t sum;           // FNV-1a of slot and image, catches torn writes
+    uint32_t reserved;
+    student_t image;        // new contents of the slot, zeros for a delete
+} db_wal_rec_t;
+
+enum {
+    WAL_LOCK_CKPT,
+    WAL_LOCK_SYNC,
+    WAL_LOCK_OPEN,
+    WAL_LOCK_APPEND,
+    WAL_LOCK_INDEX,
+    WAL_LOCK_GROW,
+    WAL_LOCK_COUNT,
+};
+
+typedef struct db_local_lock {
+    pthread_rwlock_t rw;    // orders the threads of this process
+    pthread_mutex_t mutex;  // guards readers
+    int readers;            // threads sharing the OFD read lock
+} db_local_lock_t;
+
+#define DB_SHARDS           64
+
+typedef struct db_handle {
+    int fd;                 // -1 when the slot is free
+    int max_id;             // highest id, from the file header
+    int shard_ids;          // ids covered by each shard lock
+    student_t *base;        // mapping of records 0..max_id, or NULL
+    off_t size;             // file size as of the last fstat()/ftruncate(),
+                            // only touched with __atomic builtins
+    db_bitmap_t *bmp;       // mapped sidecars, or NULL if unavailable
+    db_index_t *idx;
+    db_crc_t *crc;
+    int wal_fd;             // write ahead log, -1 if unavailable
+    db_wal_hdr_t *wal;
+    db_local_lock_t wal_locks[WAL_LOCK_COUNT];
+    pthread_rwlock_t shards[DB_SHARDS];
+} db_handle_t;
+
+static db_handle_t db_handles[DB_HANDLE_SLOTS] = {
+    {.fd = -1, .wal_fd = -1}, {.fd = -1, .wal_fd = -1},
+    {.fd = -1, .wal_fd = -1}, {.fd = -1, .wal_fd = -1}
+};
+
+_Static_assert(sizeof(db_header_t) == sizeof(student_t),
+               "the file header has to fill slot 0 exactly");
+
+static size_t db_map_len(const db_handle_t *h)
 {
-    // Set permissions: rw-rw----
-    // see sys/stat.h for constants
-    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
+    return ((size_t)h->max_id + 1) * STUDENT_RECORD_SIZE;
+}
 
-    // open the file if it exists for Read and Write,
-    // create it if it does not exist
-    int flags = O_RDWR | O_CREAT;
+static db_handle_t *db_handle_find(int fd)
+{
+    for (int i = 0; i < DB_HANDLE_SLOTS; i++) {
+        if (db_handles[i].fd == fd && fd >= 0)
+            return &db_handles[i];
+    }
+    return NULL;
+}
 
-    if (should_truncate)
-        flags += O_TRUNC;
+/*
+ *  Returns the highest id the db behind h can hold.  Without a handle the
+ *  header was never read, so the default applies.
+ */
+static int db_id_max(const db_handle_t *h)
+{
+    return (h != NULL) ? h->max_id : MAX_STD_ID;
+}
 
-    // Now open file
-    int fd = open(dbFile, flags, mode);
+/*
+ *  Returns the mmap engine state for fd, or NULL if fd is not mapped
+ */
+static db_handle_t *db_map_find(int fd)
+{
+    db_handle_t *h = db_handle_find(fd);
 
-    if (fd == -1)
-    {
-        // Handle the error
-        printf(M_ERR_DB_OPEN);
+    return (h != NULL && h->base != NULL) ? h : NULL;
+}
+
+/*
+ *  The cached size is read on every access through the mapping by all the
+ *  threads, and changed by whichever of them grows or refreshes it
+ */
+static off_t db_map_size(const db_handle_t *m)
+{
+    return __atomic_load_n(&m->size, __ATOMIC_ACQUIRE);
+}
+
+static void db_map_refresh(db_handle_t *m)
+{
+    struct stat st;
+
+    if (fstat(m->fd, &st) == 0)
+        __atomic_store_n(&m->size, st.st_size, __ATOMIC_RELEASE);
+}
+
+/*
+ *  Returns true if record id lies below EOF.  The cached size is refreshed
+ *  before answering no, since another writer may have grown the file.
+ */
+static bool db_map_has_slot(db_handle_t *m, int id)
+{
+    off_t end = ((off_t)id + 1) * STUDENT_RECORD_SIZE;
+
+    if (end <= db_map_size(m))
+        return true;
+    db_map_refresh(m);
+    return end <= db_map_size(m);
+}
+
+/*
+ *  Makes sure record id lies below EOF, growing the file with ftruncate()
+ *  if necessary.  The caller holds WAL_LOCK_GROW.  Returns NO_ERROR or
+ *  ERR_DB_FILE.
+ */
+static int db_map_reserve(db_handle_t *m, int id)
+{
+    off_t end = ((off_t)id + 1) * STUDENT_RECORD_SIZE;
+
+    if (db_map_has_slot(m, id))
+        return NO_ERROR;
+    if (ftruncate(m->fd, end) < 0)
         return ERR_DB_FILE;
+    __atomic_store_n(&m->size, end, __ATOMIC_RELEASE);
+    return NO_ERROR;
+}
+
+/*
+ *  Mapping faults
+ *
+ *  Touching the mapping past the end of the file raises SIGBUS, and the
+ *  cached size says nothing about a file another process has truncated
+ *  since.  Records are therefore copied in and out of the mapping by
+ *  map_copy(), with a SIGBUS handler armed for the calling thread that
+ *  turns the fault into a false return.  db_map_load() and db_map_store()
+ *  then refresh the size and redo the access with pread() or pwrite(),
+ *  which see the file as it is now.
+ */
+static __thread sigjmp_buf *volatile map_fault_jmp;
+static pthread_once_t map_fault_once = PTHREAD_ONCE_INIT;
+static struct sigaction map_fault_prev;
+
+static void map_fault_handler(int sig, siginfo_t *info, void *ctx)
+{
+    (void)sig;
+    (void)info;
+    (void)ctx;
+    if (map_fault_jmp != NULL)
+        siglongjmp(*map_fault_jmp, 1);
+    // not a guarded copy, the fault repeats with the old disposition
+    sigaction(SIGBUS, &map_fault_prev, NULL);
+}
+
+static void map_fault_install(void)
+{
+    struct sigaction sa = {0};
+
+    sa.sa_sigaction = map_fault_handler;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;    // siglongjmp() skips the unblock
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, &map_fault_prev);
+}
+
+/*
+ *  Copies one record to or from the mapping.  Returns false if the copy
+ *  faulted because that part of the file no longer exists.
+ */
+static bool map_copy(void *dst, const void *src)
+{
+    sigjmp_buf jb;
+
+    if (sigsetjmp(jb, 0) != 0) {
+        map_fault_jmp = NULL;
+        return false;
     }
+    map_fault_jmp = &jb;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    memcpy(dst, src, STUDENT_RECORD_SIZE);
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    map_fault_jmp = NULL;
+    return true;
+}
 
-    return fd;
+/*
+ *  Reads record slot through the mapping, or with pread() if it lies past
+ *  the end of the file as last seen or the file has shrunk since.  A slot
+ *  past EOF reads as an empty record.  Returns NO_ERROR or ERR_DB_FILE.
+ */
+static int db_map_load(db_handle_t *m, size_t slot, student_t *s)
+{
+    ssize_t n;
+
+    if (db_map_has_slot(m, slot) && map_copy(s, &m->base[slot]))
+        return NO_ERROR;
+    db_map_refresh(m);
+    n = pread(m->fd, s, STUDENT_RECORD_SIZE, (off_t)slot * STUDENT_RECORD_SIZE);
+    if (n < 0)
+        return ERR_DB_FILE;
+    if (n != STUDENT_RECORD_SIZE)
+        memset(s, 0, STUDENT_RECORD_SIZE);
+    return NO_ERROR;
 }
 
 /*
- *  get_student
- *      fd:  linux file descriptor
- *      id:  the student id we are looking forname of the
- *      *s:  a pointer where the located (if found) student data will be
- *           copied
+ *  write_all_at
+ *      fd:      linux file descriptor
+ *      buff:    data to write
+ *      len:     number of bytes to write
+ *      offset:  file offset to start writing at
  *
- *  returns:  NO_ERROR       student located and copied into *s
- *            ERR_DB_FILE    database file I/O issue
- *            SRCH_NOT_FOUND student was not located in the database
+ *  Helper that keeps calling pwrite() until len bytes are written, since a
+ *  large write is allowed to come back short.
  *
- *  console:  Does not produce any console I/O used by other functions
+ *  returns:  NO_ERROR on success, ERR_DB_FILE on a write error
  */
-int get_student(int fd, int id, student_t *s)
+static int write_all_at(int fd, const void *buff, size_t len, off_t offset)
 {
-    off_t offset;
-    ssize_t bytes_read;
-    student_t temp_student = {0};
+    const char *p = buff;
 
-    // Calculate file offset based on student ID
-    offset = (off_t)id * STUDENT_RECORD_SIZE;
-    
-    // Seek to the correct position
-    if (lseek(fd, offset, SEEK_SET) < 0) {
-        return ERR_DB_FILE;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return ERR_DB_FILE;
+        }
+        p += n;
+        len -= n;
+        offset += n;
     }
-    
-    // Read student record
-    bytes_read = read(fd, &temp_student, STUDENT_RECORD_SIZE);
-    if (bytes_read < 0) {
-        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  range_lock
+ *      fd:      linux file descriptor
+ *      type:    F_RDLCK, F_WRLCK or F_UNLCK
+ *      start:   first byte of the range
+ *      len:     number of bytes in the range
+ *      wait:    block until the lock is granted
+ *
+ *  Takes, converts or releases an OFD lock.  OFD locks belong to the open
+ *  file description, so unlike classic fcntl() locks they are not dropped
+ *  when some other fd on the same file is closed.
+ *
+ *  returns:  NO_ERROR, or ERR_DB_FILE if the lock was not granted
+ */
+static int range_lock(int fd, short type, off_t start, off_t len, bool wait)
+{
+    struct flock lock = {0};
+
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = start;
+    lock.l_len = len;
+    while (fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock) < 0) {
+        if (errno != EINTR)
+            return ERR_DB_FILE;
     }
-    
-    // Check if we actually read a record
-    if (bytes_read == 0) {
-        return SRCH_NOT_FOUND;
+    return NO_ERROR;
+}
+
+/*
+ *  Record classification kernels
+ *
+ *  A slot is live when its id is non-zero; deleted slots and holes are all
+ *  zeros (EMPTY_STUDENT_RECORD).  live_records() looks at n consecutive
+ *  records, sets bit i of mask (if mask is not NULL) when record i is live,
+ *  and returns the number of live records.  mask needs (n + 63) / 64 words.
+ *
+ *  Records are 64 bytes, so the ids sit at a fixed 64 byte stride.  The SSE2
+ *  kernel packs the ids of 4 records into one register and the AVX2 kernel
+ *  gathers 8, then a single compare and movemask classifies the whole group
+ *  with no per-record branch.  The kernel is picked at runtime from the CPU
+ *  features; SDB_SIMD=scalar|sse2|avx2 overrides the choice.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+typedef size_t (*live_kernel_t)(const student_t *r, size_t n, uint64_t *mask);
+
+static void live_mask_clear(uint64_t *mask, size_t n)
+{
+    if (mask != NULL)
+        memset(mask, 0, ((n + 63) / 64) * sizeof(uint64_t));
+}
+
+static size_t live_records_scalar(const student_t *r, size_t n, uint64_t *mask)
+{
+    size_t count = 0;
+
+    live_mask_clear(mask, n);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t live = (r[i].id != 0);
+
+        count += live;
+        if (mask != NULL)
+            mask[i / 64] |= live << (i % 64);
     }
-    
-    // Check if record exists and is not deleted
-    if (temp_student.id == 0) {
-        return SRCH_NOT_FOUND;
+    return count;
+}
+
+#ifdef HAVE_X86_SIMD
+static size_t live_records_sse2(const student_t *r, size_t n, uint64_t *mask)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t count = 0;
+    size_t i = 0;
+
+    live_mask_clear(mask, n);
+    for (; i + 4 <= n; i += 4) {
+        __m128i a = _mm_loadu_si128((const __m128i *)&r[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&r[i + 1]);
+        __m128i c = _mm_loadu_si128((const __m128i *)&r[i + 2]);
+        __m128i d = _mm_loadu_si128((const __m128i *)&r[i + 3]);
+        __m128i ids = _mm_unpacklo_epi64(_mm_unpacklo_epi32(a, b),
+                                         _mm_unpacklo_epi32(c, d));
+        int empty = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(ids, zero)));
+        uint64_t live = ~empty & 0xF;
+
+        count += __builtin_popcountll(live);
+        if (mask != NULL)
+            mask[i / 64] |= live << (i % 64);
     }
-    
-    // Copy found student to provided storage
-    memcpy(s, &temp_student, STUDENT_RECORD_SIZE);
-    return NO_ERROR;
+    for (; i < n; i++) {
+        uint64_t live = (r[i].id != 0);
+
+        count += live;
+        if (mask != NULL)
+            mask[i / 64] |= live << (i % 64);
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+static size_t live_records_avx2(const student_t *r, size_t n, uint64_t *mask)
+{
+    const int stride = STUDENT_RECORD_SIZE / sizeof(int);
+    const __m256i index = _mm256_setr_epi32(0, stride, 2 * stride, 3 * stride,
+                                            4 * stride, 5 * stride,
+                                            6 * stride, 7 * stride);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t count = 0;
+    size_t i = 0;
+
+    live_mask_clear(mask, n);
+    for (; i + 8 <= n; i += 8) {
+        __m256i ids = _mm256_i32gather_epi32(&r[i].id, index, sizeof(int));
+        int empty = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(ids, zero)));
+        uint64_t live = ~empty & 0xFF;
+
+        count += __builtin_popcountll(live);
+        if (mask != NULL)
+            mask[i / 64] |= live << (i % 64);
+    }
+    for (; i < n; i++) {
+        uint64_t live = (r[i].id != 0);
+
+        count += live;
+        if (mask != NULL)
+            mask[i / 64] |= live << (i % 64);
+    }
+    return count;
+}
+#endif
+
+static live_kernel_t live_kernel_select(void)
+{
+    const char *want = getenv(DB_SIMD_ENV);
+
+    if (want != NULL && strcmp(want, "scalar") == 0)
+        return live_records_scalar;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if ((want == NULL || strcmp(want, "avx2") == 0) &&
+        __builtin_cpu_supports("avx2"))
+        return live_records_avx2;
+    return live_records_sse2;
+#else
+    return live_records_scalar;
+#endif
+}
+
+static size_t live_records(const student_t *r, size_t n, uint64_t *mask)
+{
+    static live_kernel_t kernel = NULL;
+
+    if (kernel == NULL)
+        kernel = live_kernel_select();
+    return kernel(r, n, mask);
 }
 
 /*
- *  add_student
- *      fd:     linux file descriptor
- *      id:     student id (range is defined in db.h )
- *      fname:  student first name
- *      lname:  student last name
- *      gpa:    GPA as an integer (range defined in db.h)
+ *  Block scan iterator
  *
- *  Adds a new student to the database.  After calculating the index for the
- *  student, check if there is another student already at that location.  A good
- *  way is to use something like memcmp() to ensure that the location for this
- *  student contains all zero byes indicating the space is empty.
+ *  Every full pass over the db (count, print, compress, bitmap rebuild)
+ *  goes through this iterator.  It reads SCAN_BLOCK_SIZE bytes at a time
+ *  into a page aligned buffer and hands out pointers to the records in it,
+ *  so there is one syscall per block rather than one per record.  Records
+ *  are 64 bytes, a cache line, so a block never splits a record.  Each block
+ *  is classified with live_records() as it is read, and scan_next() walks
+ *  the resulting mask so empty slots cost no branch at all.
  *
- *  returns:  NO_ERROR       student added to database
- *            ERR_DB_FILE    database file I/O issue
- *            ERR_DB_OP      database operation logically failed (aka student
- *                           already exists)
+ *  Ids are spread over the file and most of a typical db is holes that the
+ *  filesystem never allocated.  The iterator asks for the allocated extents
+ *  with lseek(SEEK_DATA/SEEK_HOLE) and only reads those, so a scan costs
+ *  time in proportion to the data stored rather than the highest id.  On a
+ *  filesystem without SEEK_DATA support the whole file is one extent.
+ *
+ *  Setting SDB_DIRECT=1 reads through a second O_DIRECT descriptor, which
+ *  keeps a scan of a large cold db from evicting the rest of the page cache.
+ *  If the filesystem refuses O_DIRECT the normal descriptor is used.
+ *
+ *      scan_t sc;
+ *      const student_t *s;
+ *      size_t slot;
+ *
+ *      if (scan_open(&sc, fd) != NO_ERROR) ...
+ *      while ((s = scan_next(&sc, &slot)) != NULL) ...
+ *      if (sc.err != NO_ERROR) ...
+ *      scan_close(&sc);
+ */
+#define SCAN_BLOCK_SIZE     (1024 * 1024)
+#define SCAN_BLOCK_RECORDS  (SCAN_BLOCK_SIZE / 64)
+#define SCAN_ALIGN          4096
+
+typedef struct scan {
+    int fd;             // fd the scan reads from
+    int direct_fd;      // O_DIRECT descriptor, or -1
+    student_t *buff;    // SCAN_BLOCK_SIZE bytes, SCAN_ALIGN aligned
+    size_t count;       // records in buff
+    size_t live_count;  // non-empty records in buff
+    uint64_t live[SCAN_BLOCK_RECORDS / 64];    // bit i set if buff[i] is live
+    size_t word;        // next word of live to look at
+    uint64_t bits;      // live bits of the current word not yet returned
+    size_t first_slot;  // slot number of buff[0]
+    off_t offset;       // next file offset to read
+    off_t ext_end;      // end of the current allocated extent
+    off_t file_size;
+    int err;            // NO_ERROR, or ERR_DB_FILE after an I/O error
+} scan_t;
+
+/*
+ *  Finds the next allocated extent at or after offset.  Returns true and
+ *  sets [*start, *end) if there is one, false at the end of the data.
+ */
+static bool next_extent(int fd, off_t offset, off_t file_size,
+                        off_t *start, off_t *end)
+{
+    off_t data, hole;
+
+    if (offset >= file_size)
+        return false;
+
+    data = lseek(fd, offset, SEEK_DATA);
+    if (data < 0) {
+        if (errno == ENXIO)
+            return false;   // nothing but a hole up to EOF
+        data = offset;      // SEEK_DATA not supported, read everything
+        hole = file_size;
+    } else {
+        hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0)
+            hole = file_size;
+    }
+
+    // Extents are filesystem blocks, keep them on record boundaries
+    *start = data - data % STUDENT_RECORD_SIZE;
+    *end = hole + (STUDENT_RECORD_SIZE - hole % STUDENT_RECORD_SIZE) % STUDENT_RECORD_SIZE;
+    if (*end > file_size)
+        *end = file_size;
+    return *start < *end;
+}
+
+static int scan_open(scan_t *sc, int fd)
+{
+    const char *direct = getenv(DB_DIRECT_ENV);
+    struct stat st;
+    void *buff;
+
+    memset(sc, 0, sizeof(*sc));
+    sc->fd = fd;
+    sc->direct_fd = -1;
+    if (fstat(fd, &st) < 0)
+        return ERR_DB_FILE;
+    if (posix_memalign(&buff, SCAN_ALIGN, SCAN_BLOCK_SIZE) != 0)
+        return ERR_DB_FILE;
+    sc->buff = buff;
+    sc->file_size = st.st_size;
+
+    if (direct != NULL && strcmp(direct, "1") == 0) {
+        char path[64];
+
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+        sc->direct_fd = open(path, O_RDONLY | O_DIRECT);
+    }
+    return NO_ERROR;
+}
+
+static void scan_close(scan_t *sc)
+{
+    if (sc->direct_fd >= 0)
+        close(sc->direct_fd);
+    free(sc->buff);
+    sc->buff = NULL;
+}
+
+/*
+ *  Reads the next block into the buffer.  Returns false at the end of the
+ *  data or on error (sc->err is set).
+ */
+static bool scan_fill(scan_t *sc)
+{
+    off_t start, end;
+    ssize_t n;
+
+    if (sc->offset >= sc->ext_end) {
+        if (!next_extent(sc->fd, sc->offset, sc->file_size, &start, &end))
+            return false;
+        sc->offset = start;
+        sc->ext_end = end;
+    }
+
+    size_t want = sc->ext_end - sc->offset;
+    if (want > SCAN_BLOCK_SIZE)
+        want = SCAN_BLOCK_SIZE;
+
+    while (true) {
+        if (sc->direct_fd >= 0) {
+            // O_DIRECT needs an aligned offset and length, read the aligned
+            // span around the records and skip the leading bytes
+            off_t lead = sc->offset % SCAN_ALIGN;
+            size_t len = lead + want;
+
+            len += (SCAN_ALIGN - len % SCAN_ALIGN) % SCAN_ALIGN;
+            if (len > SCAN_BLOCK_SIZE) {
+                len -= SCAN_ALIGN;
+                want = len - lead;
+            }
+            n = pread(sc->direct_fd, sc->buff, len, sc->offset - lead);
+            if (n < 0 && errno == EINVAL) {
+                close(sc->direct_fd);   // fs does not do O_DIRECT
+                sc->direct_fd = -1;
+                continue;
+            }
+            if (n >= 0) {
+                n = (n > lead) ? n - lead : 0;
+                if ((size_t)n > want)
+                    n = want;
+                memmove(sc->buff, (char *)sc->buff + lead, n);
+            }
+        } else {
+            n = pread(sc->fd, sc->buff, want, sc->offset);
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        break;
+    }
+
+    if (n < 0) {
+        sc->err = ERR_DB_FILE;
+        return false;
+    }
+    if (n < STUDENT_RECORD_SIZE)
+        return false;   // file shrank or partial last record
+
+    sc->count = n / STUDENT_RECORD_SIZE;
+    sc->live_count = live_records(sc->buff, sc->count, sc->live);
+    sc->word = 0;
+    sc->bits = 0;
+    sc->first_slot = sc->offset / STUDENT_RECORD_SIZE;
+    sc->offset += sc->count * STUDENT_RECORD_SIZE;
+    return true;
+}
+
+/*
+ *  Returns the next non-empty record and its slot number, or NULL when the
+ *  scan is finished.  The pointer is only valid until the next call.
+ */
+static const student_t *scan_next(scan_t *sc, size_t *slot)
+{
+    while (true) {
+        while (sc->bits == 0 && sc->word < (sc->count + 63) / 64)
+            sc->bits = sc->live[sc->word++];
+        if (sc->bits != 0) {
+            size_t i = (sc->word - 1) * 64 + __builtin_ctzll(sc->bits);
+
+            sc->bits &= sc->bits - 1;
+            *slot = sc->first_slot + i;
+            return &sc->buff[i];
+        }
+        if (!scan_fill(sc))
+            return NULL;
+    }
+}
+
+/*
+ *  Reads the next block for callers that only need the per block totals.
+ *  Returns the number of live records in it, or -1 when the scan is
+ *  finished.
+ */
+static ssize_t scan_next_block(scan_t *sc)
+{
+    if (!scan_fill(sc))
+        return -1;
+    sc->bits = 0;
+    sc->word = (sc->count + 63) / 64;
+    return sc->live_count;
+}
+
+static void sidecar_path(char *buff, size_t len, const char *dbFile,
+                         const char *ext)
+{
+    snprintf(buff, len, "%s%s", dbFile, ext);
+}
+
+/*
+ *  Opens (creating if needed) and maps the sidecar dbFile+ext of len bytes.
+ *  Returns NULL if it cannot be used.
+ */
+static void *sidecar_map(const char *dbFile, const char *ext, size_t len)
+{
+    char path[512];
+    struct stat st;
+    void *p;
+    int sfd;
+
+    sidecar_path(path, sizeof(path), dbFile, ext);
+    sfd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (sfd < 0)
+        return NULL;
+    if (fstat(sfd, &st) < 0 ||
+        ((size_t)st.st_size != len && ftruncate(sfd, len) < 0)) {
+        close(sfd);
+        return NULL;
+    }
+
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, sfd, 0);
+    close(sfd);
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+static void sidecar_unmap(void *p, size_t len)
+{
+    msync(p, len, MS_SYNC);
+    munmap(p, len);
+}
+
+static bool stamp_matches(const db_stamp_t *stamp, const struct stat *st)
+{
+    return stamp->clean == 1 &&
+           stamp->db_size == (int64_t)st->st_size &&
+           stamp->db_mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+           stamp->db_mtime_nsec == (int64_t)st->st_mtim.tv_nsec;
+}
+
+static void stamp_dirty(db_stamp_t *stamp)
+{
+    if (stamp->clean)
+        stamp->clean = 0;
+}
+
+/*
+ *  File timestamps come from a coarse clock, so a write by some other tool in
+ *  the same tick as our stamp would leave the mtime unchanged and go
+ *  unnoticed.  Like git's racy index check, only trust an mtime once the
+ *  coarse clock has moved past it, waiting a few ms if necessary.
+ */
+static bool mtime_settled(const struct stat *st)
+{
+    struct timespec now;
+    struct timespec pause = {0, 1000000};
+
+    for (int tries = 0; tries < 50; tries++) {
+        if (clock_gettime(CLOCK_REALTIME_COARSE, &now) < 0)
+            return false;
+        if (now.tv_sec > st->st_mtim.tv_sec ||
+            (now.tv_sec == st->st_mtim.tv_sec &&
+             now.tv_nsec > st->st_mtim.tv_nsec))
+            return true;
+        nanosleep(&pause, NULL);
+    }
+    return false;
+}
+
+/*
+ *  Stamps a dirty sidecar with the current size and mtime of the data file
+ *  and marks it clean.  If the mtime cannot be trusted the sidecar is left
+ *  dirty and rebuilt on the next open.  Any data file mapping has to be
+ *  flushed first so the mtime is final.
+ */
+static void stamp_set(db_stamp_t *stamp, int fd)
+{
+    struct stat st;
+
+    if (!stamp->clean && fstat(fd, &st) == 0 && mtime_settled(&st)) {
+        stamp->db_size = st.st_size;
+        stamp->db_mtime_sec = st.st_mtim.tv_sec;
+        stamp->db_mtime_nsec = st.st_mtim.tv_nsec;
+        stamp->clean = 1;
+    }
+}
+
+/*
+ *  Returns the occupancy bitmap for fd, or NULL if there is none
+ */
+static db_bitmap_t *db_bitmap_find(int fd)
+{
+    db_handle_t *h = db_handle_find(fd);
+
+    return (h != NULL) ? h->bmp : NULL;
+}
+
+//bytes of a bitmap sidecar for slots slots, the occupied then the changed bits
+static size_t bitmap_size(size_t slots)
+{
+    return offsetof(db_bitmap_t, bits) + 2 * DB_BITMAP_WORDS(slots) * sizeof(uint64_t);
+}
+
+//bits of the slots written since snapshot snap_id
+static uint64_t *bitmap_changed(db_bitmap_t *b)
+{
+    return &b->bits[DB_BITMAP_WORDS(b->slots)];
+}
+
+/*
+ *  Updates the bit for slot.  Other sdbsc processes may have the same sidecar
+ *  mapped, so the word is updated atomically.
+ */
+static void bitmap_update(db_bitmap_t *b, size_t slot, bool used)
+{
+    uint64_t mask = (uint64_t)1 << (slot % 64);
+
+    if (b == NULL || slot >= b->slots)
+        return;
+    stamp_dirty(&b->stamp);
+    if (used)
+        __atomic_fetch_or(&b->bits[slot / 64], mask, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_and(&b->bits[slot / 64], ~mask, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&bitmap_changed(b)[slot / 64], mask, __ATOMIC_RELAXED);
+}
+
+static int bitmap_count(const db_bitmap_t *b)
+{
+    int count = 0;
+
+    for (size_t i = 0; i < DB_BITMAP_WORDS(b->slots); i++)
+        count += __builtin_popcountll(b->bits[i]);
+    return count;
+}
+
+static bool bitmap_matches(const db_bitmap_t *b, size_t slots,
+                           const struct stat *st)
+{
+    return b->magic == DB_BITMAP_MAGIC &&
+           b->version == DB_BITMAP_VERSION &&
+           b->slots == slots &&
+           (st == NULL || stamp_matches(&b->stamp, st));
+}
+
+/*
+ *  Recovery path: recomputes every bit from the data file.  What changed
+ *  since the last snapshot is lost, so the next snapshot is a full one.
+ *  Returns NO_ERROR or ERR_DB_FILE.
+ */
+static int bitmap_rebuild(db_bitmap_t *b, size_t slots, int fd)
+{
+    const student_t *s;
+    size_t slot;
+    scan_t sc;
+
+    memset(b, 0, bitmap_size(slots));
+    b->magic = DB_BITMAP_MAGIC;
+    b->version = DB_BITMAP_VERSION;
+    b->slots = slots;
+
+    if (scan_open(&sc, fd) != NO_ERROR)
+        return ERR_DB_FILE;
+    while ((s = scan_next(&sc, &slot)) != NULL) {
+        if (slot < slots)
+            b->bits[slot / 64] |= (uint64_t)1 << (slot % 64);
+    }
+    scan_close(&sc);
+    return sc.err;
+}
+
+/*
+ *  Maps the bitmap sidecar for dbFile with a bit for each of slots, rebuilding
+ *  it if it does not describe the data file open on fd.  If other processes have the db open (shared)
+ *  they keep the sidecar up to date, so only its format is checked.  Returns
+ *  NULL if the sidecar cannot be used, in which case callers fall back to
+ *  scanning the data file.
+ */
+static db_bitmap_t *bitmap_attach(int fd, const char *dbFile, size_t slots,
+                                  bool shared)
+{
+    struct stat st;
+    db_bitmap_t *b = sidecar_map(dbFile, DB_BITMAP_EXT, bitmap_size(slots));
+
+    if (b == NULL)
+        return NULL;
+    if (fstat(fd, &st) < 0 ||
+        (!bitmap_matches(b, slots, shared ? NULL : &st) &&
+         bitmap_rebuild(b, slots, fd) != NO_ERROR)) {
+        munmap(b, bitmap_size(slots));
+        return NULL;
+    }
+    return b;
+}
+
+static void bitmap_detach(db_bitmap_t *b, int fd)
+{
+    stamp_set(&b->stamp, fd);
+    sidecar_unmap(b, bitmap_size(b->slots));
+}
+
+/*
+ *  Returns the name index for fd, or NULL if there is none
+ */
+static db_index_t *db_index_find(int fd)
+{
+    db_handle_t *h = db_handle_find(fd);
+
+    return (h != NULL) ? h->idx : NULL;
+}
+
+/*
+ *  Bucket heads follow the entries, each the first slot of its chain or 0.
+ *  Slot 0 holds the db header, never a student, so 0 is free to mean none.
+ */
+static uint32_t *index_heads(db_index_t *ix)
+{
+    return (uint32_t *)&ix->entries[ix->capacity];
+}
+
+static size_t index_buckets(size_t capacity)
+{
+    size_t n = 1;
+
+    while (n < capacity)
+        n <<= 1;
+    return n;
+}
+
+/*
+ *  FNV-1a of the zero padded last name, masked to a bucket
+ */
+static uint32_t index_hash(const db_index_t *ix, const char *lname)
+{
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < sizeof(((db_index_entry_t *)0)->lname) && lname[i]; i++)
+        h = (h ^ (unsigned char)lname[i]) * 16777619u;
+    return h & (ix->buckets - 1);
+}
+
+static void index_unlink(db_index_t *ix, size_t slot)
+{
+    db_index_entry_t *e = &ix->entries[slot];
+
+    if (e->prev != 0)
+        ix->entries[e->prev].next = e->next;
+    else
+        index_heads(ix)[index_hash(ix, e->lname)] = e->next;
+    if (e->next != 0)
+        ix->entries[e->next].prev = e->prev;
+    memset(e, 0, sizeof(*e));
+    ix->count--;
+}
+
+//copies the name src into the size byte field dst, truncated and terminated
+static void index_name_copy(char *dst, const char *src, size_t size)
+{
+    size_t len = strnlen(src, size - 1);
+
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+/*
+ *  Indexes s as the student in slot, replacing whatever was indexed there
+ */
+static void index_insert(db_index_t *ix, size_t slot, const student_t *s)
+{
+    db_index_entry_t *e;
+    uint32_t *head;
+
+    if (ix == NULL || slot == 0 || slot >= ix->capacity)
+        return;
+    stamp_dirty(&ix->stamp);
+    e = &ix->entries[slot];
+    if (e->id != 0)
+        index_unlink(ix, slot);
+    index_name_copy(e->lname, s->lname, sizeof(e->lname));
+    index_name_copy(e->fname, s->fname, sizeof(e->fname));
+    e->id = s->id;
+
+    head = &index_heads(ix)[index_hash(ix, e->lname)];
+    e->next = *head;
+    if (*head != 0)
+        ix->entries[*head].prev = slot;
+    *head = slot;
+    ix->count++;
+}
+
+/*
+ *  Drops the entry of slot, going by the slot rather than the names so
+ *  it works when the record itself cannot be trusted
+ */
+static void index_remove(db_index_t *ix, size_t slot)
+{
+    if (ix == NULL || slot == 0 || slot >= ix->capacity ||
+        ix->entries[slot].id == 0)
+        return;
+    stamp_dirty(&ix->stamp);
+    index_unlink(ix, slot);
+}
+
+static size_t index_size(size_t capacity)
+{
+    return offsetof(db_index_t, entries) + capacity * sizeof(db_index_entry_t) +
+           index_buckets(capacity) * sizeof(uint32_t);
+}
+
+static bool index_matches(const db_index_t *ix, size_t capacity,
+                          const struct stat *st)
+{
+    return ix->magic == DB_INDEX_MAGIC &&
+           ix->version == DB_INDEX_VERSION &&
+           ix->capacity == capacity &&
+           ix->buckets == index_buckets(capacity) &&
+           ix->count <= ix->capacity &&
+           (st == NULL || stamp_matches(&ix->stamp, st));
+}
+
+/*
+ *  Recovery path: empties the index and links in every record of the data
+ *  file.  The old contents are dropped with MADV_REMOVE so a sparse sidecar
+ *  stays sparse, or zeroed if the filesystem cannot punch holes.  Returns
+ *  NO_ERROR or ERR_DB_FILE.
+ */
+static int index_rebuild(db_index_t *ix, size_t capacity, int fd)
+{
+    const student_t *s;
+    size_t slot;
+    scan_t sc;
+
+    if (madvise(ix, index_size(capacity), MADV_REMOVE) < 0)
+        memset(ix, 0, index_size(capacity));
+    ix->magic = DB_INDEX_MAGIC;
+    ix->version = DB_INDEX_VERSION;
+    ix->capacity = capacity;
+    ix->buckets = index_buckets(capacity);
+
+    if (scan_open(&sc, fd) != NO_ERROR)
+        return ERR_DB_FILE;
+    while ((s = scan_next(&sc, &slot)) != NULL)
+        index_insert(ix, slot, s);
+    scan_close(&sc);
+    return sc.err;
+}
+
+static db_index_t *index_attach(int fd, const char *dbFile, size_t capacity,
+                                bool shared)
+{
+    struct stat st;
+    db_index_t *ix = sidecar_map(dbFile, DB_INDEX_EXT, index_size(capacity));
+
+    if (ix == NULL)
+        return NULL;
+    if (fstat(fd, &st) < 0 ||
+        (!index_matches(ix, capacity, shared ? NULL : &st) &&
+         index_rebuild(ix, capacity, fd) != NO_ERROR)) {
+        munmap(ix, index_size(capacity));
+        return NULL;
+    }
+    return ix;
+}
+
+static void index_detach(db_index_t *ix, int fd)
+{
+    stamp_set(&ix->stamp, fd);
+    sidecar_unmap(ix, index_size(ix->capacity));
+}
+
+/*
+ *  Returns the checksum sidecar for fd, or NULL if there is none
+ */
+static db_crc_t *db_crc_find(int fd)
+{
+    db_handle_t *h = db_handle_find(fd);
+
+    return (h != NULL) ? h->crc : NULL;
+}
+
+static size_t crc_size(size_t slots)
+{
+    return offsetof(db_crc_t, sums) + slots * sizeof(uint32_t);
+}
+
+/*
+ *  Stores the sum of the record just written to slot.  The caller holds
+ *  the slot's lock.
+ */
+static void crc_update(db_handle_t *h, size_t slot, const student_t *s)
+{
+    if (h == NULL || h->crc == NULL || slot >= h->crc->slots)
+        return;
+    __atomic_store_n(&h->crc->sums[slot], record_sum(s), __ATOMIC_RELAXED);
+}
+
+/*
+ *  Returns false if the record read from slot does not match its sum
+ */
+static bool crc_slot_ok(db_handle_t *h, size_t slot, const student_t *s)
+{
+    if (h == NULL || h->crc == NULL || slot >= h->crc->slots ||
+        slot < MIN_STD_ID)
+        return true;
+    return record_sum(s) ==
+           __atomic_load_n(&h->crc->sums[slot], __ATOMIC_RELAXED);
+}
+
+/*
+ *  Sums every slot of the data file.  Whatever the file holds is taken as
+ *  good, so this only runs for a new sidecar or a db that was just
+ *  written from scratch.  Like index_rebuild(), the old sums are dropped
+ *  with MADV_REMOVE so only the pages of slots in the file's data extents
+ *  are written.  Returns NO_ERROR or ERR_DB_FILE.
+ */
+static int crc_rebuild(db_crc_t *c, size_t slots, int fd)
+{
+    scan_t sc;
+
+    if (madvise(c, crc_size(slots), MADV_REMOVE) < 0)
+        memset(c, 0, crc_size(slots));
+    c->magic = DB_CRC_MAGIC;
+    c->version = DB_CRC_VERSION;
+    c->slots = slots;
+
+    if (scan_open(&sc, fd) != NO_ERROR)
+        return ERR_DB_FILE;
+    while (scan_next_block(&sc) >= 0) {
+        size_t n = sc.count;
+
+        if (sc.first_slot >= slots)
+            break;
+        if (n > slots - sc.first_slot)
+            n = slots - sc.first_slot;
+        record_sums(sc.buff, n, &c->sums[sc.first_slot]);
+    }
+    scan_close(&sc);
+    c->sums[0] = 0;     // the header is not a record
+    return sc.err;
+}
+
+static bool crc_matches(const db_crc_t *c, size_t slots)
+{
+    return c->magic == DB_CRC_MAGIC &&
+           c->version == DB_CRC_VERSION &&
+           c->slots == slots;
+}
+
+/*
+ *  Checks the checksum sidecar c, mapped by db_handle_attach() before the
+ *  log was recovered.  It is only rebuilt if it is new or has another
+ *  format, or the data file held no records when it was opened (empty: a
+ *  new, zeroed or compressed db).  As with the other sidecars only a
+ *  process that has the db to itself (!shared) may rebuild it, one that
+ *  shares the db does without sums it cannot trust.  Returns NULL if it
+ *  cannot be used.
+ */
+static db_crc_t *crc_attach(db_crc_t *c, int fd, size_t slots, bool empty,
+                            bool shared)
+{
+    if (c == NULL)
+        return NULL;
+    if (crc_matches(c, slots) && (shared || !empty))
+        return c;
+    if (shared || crc_rebuild(c, slots, fd) != NO_ERROR) {
+        munmap(c, crc_size(slots));
+        return NULL;
+    }
+    return c;
+}
+
+/*
+ *  Write ahead log helpers.  They all do nothing for a handle without a log,
+ *  so the db stays usable (without the crash guarantees) if the log file
+ *  cannot be created.
+ *
+ *  wal_lock() takes (F_RDLCK, F_WRLCK) or releases (F_UNLCK) one of the
+ *  WAL_LOCK_* bytes, for this thread and for this process, see "Threads".
+ *  Without a log only the threads of this process are ordered.
+ */
+static int wal_lock(db_handle_t *h, int which, short type)
+{
+    db_local_lock_t *l;
+    int rc = NO_ERROR;
+
+    if (h == NULL)
+        return NO_ERROR;
+    l = &h->wal_locks[which];
+
+    switch (type) {
+    case F_WRLCK:
+        pthread_rwlock_wrlock(&l->rw);
+        if (h->wal != NULL)
+            rc = range_lock(h->wal_fd, F_WRLCK, which, 1, true);
+        break;
+    case F_RDLCK:
+        pthread_rwlock_rdlock(&l->rw);
+        pthread_mutex_lock(&l->mutex);
+        if (l->readers == 0 && h->wal != NULL)
+            rc = range_lock(h->wal_fd, F_RDLCK, which, 1, true);
+        if (rc == NO_ERROR)
+            l->readers++;
+        pthread_mutex_unlock(&l->mutex);
+        break;
+    default:
+        // readers is only non-zero while the lock is held shared
+        pthread_mutex_lock(&l->mutex);
+        if ((l->readers == 0 || --l->readers == 0) && h->wal != NULL)
+            range_lock(h->wal_fd, F_UNLCK, which, 1, false);
+        pthread_mutex_unlock(&l->mutex);
+        pthread_rwlock_unlock(&l->rw);
+        return NO_ERROR;
+    }
+
+    if (rc != NO_ERROR)
+        pthread_rwlock_unlock(&l->rw);
+    return rc;
+}
+
+/*
+ *  Locks the shards holding the records in bytes start..start+len of the
+ *  data file, in ascending order so two writers cannot deadlock.
+ */
+static void shard_lock(db_handle_t *h, off_t start, off_t len, bool write)
+{
+    size_t first, last;
+
+    if (h == NULL)
+        return;
+    first = start / STUDENT_RECORD_SIZE / h->shard_ids;
+    last = (start + len - 1) / STUDENT_RECORD_SIZE / h->shard_ids;
+    for (size_t i = first; i <= last && i < DB_SHARDS; i++) {
+        if (write)
+            pthread_rwlock_wrlock(&h->shards[i]);
+        else
+            pthread_rwlock_rdlock(&h->shards[i]);
+    }
+}
+
+static void shard_unlock(db_handle_t *h, off_t start, off_t len)
+{
+    size_t first, last;
+
+    if (h == NULL)
+        return;
+    first = start / STUDENT_RECORD_SIZE / h->shard_ids;
+    last = (start + len - 1) / STUDENT_RECORD_SIZE / h->shard_ids;
+    for (size_t i = first; i <= last && i < DB_SHARDS; i++)
+        pthread_rwlock_unlock(&h->shards[i]);
+}
+
+/*
+ *  Parallel scan
+ *
+ *  A scan_t has one read in flight at a time, which leaves most of a fast
+ *  SSD idle.  With SDB_SCAN_THREADS=n, n > 1, the full scans behind count,
+ *  print and compress cut the file into parts of SCAN_BLOCK_SIZE bytes and
+ *  a pool of n threads reads them with pread() into a ring of
+ *  SCAN_RING_PER_THREAD * n scan buffers.  Parts are claimed in file order
+ *  and each one goes through up to two callbacks:
+ *
+ *    part_fn   runs on the worker as soon as the part is read.  rank is the
+ *              number of live records in all earlier parts, so compress
+ *              knows where the part's records go in the packed file without
+ *              waiting for the earlier parts to be written.
+ *    block_fn  runs on the calling thread, strictly in part order, so
+ *              records come out in id order.  It returns 0 to go on, > 0
+ *              to stop early or < 0 on error.
+ *
+ *  The live counts are summed in part order as well; scan_parallel()
+ *  returns the total.  The default of one thread keeps the single threaded
+ *  scan_t path, the baseline the parallel scan is measured against.
+ */
+#define SCAN_MAX_THREADS        32
+#define SCAN_RING_PER_THREAD    2
+
+#define PSCAN_FREE      0       // slot can take the next part
+#define PSCAN_BUSY      1       // a worker is reading into the slot
+#define PSCAN_READY     2       // read, waiting for block_fn
+
+typedef int (*scan_part_fn_t)(scan_t *sc, size_t rank, void *arg);
+typedef int (*scan_block_fn_t)(scan_t *sc, void *arg);
+
+typedef struct pscan_slot {
+    scan_t sc;
+    size_t part;        // part in sc
+    int state;          // PSCAN_FREE, PSCAN_BUSY or PSCAN_READY
+} pscan_slot_t;
+
+typedef struct pscan {
+    int fd;
+    db_handle_t *h;     // for the shard locks, or NULL
+    off_t file_size;
+    size_t parts;
+    size_t next_part;   // next part a worker claims
+    size_t ranked;      // parts whose live records are in total
+    size_t total;       // live records in parts [0, ranked)
+    scan_part_fn_t part_fn;
+    scan_block_fn_t block_fn;
+    void *arg;
+    pscan_slot_t *ring;
+    size_t ring_len;
+    bool stop;
+    int err;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // broadcast on every state change
+} pscan_t;
+
+static int scan_threads(void)
+{
+    const char *want = getenv(DB_SCAN_THREADS_ENV);
+    int n = (want != NULL) ? atoi(want) : 1;
+
+    if (n < 1)
+        return 1;
+    return (n > SCAN_MAX_THREADS) ? SCAN_MAX_THREADS : n;
+}
+
+/*
+ *  Reads part of the file into sc, starting at its first allocated byte.
+ *  Parts start on a SCAN_ALIGN boundary and are at most SCAN_BLOCK_SIZE
+ *  long, so one read covers the rest of the part even through O_DIRECT.
+ *  Afterwards scan_next() walks the part without any further I/O.
+ */
+static int scan_fill_part(pscan_t *ps, scan_t *sc, size_t part)
+{
+    off_t start = (off_t)part * SCAN_BLOCK_SIZE;
+    off_t end = start + SCAN_BLOCK_SIZE;
+    off_t data;
+
+    if (end > ps->file_size)
+        end = ps->file_size;
+    sc->count = 0;
+    sc->live_count = 0;
+    sc->word = 0;
+    sc->bits = 0;
+    sc->err = NO_ERROR;
+
+    data = lseek(sc->fd, start, SEEK_DATA);
+    if (data < 0)
+        data = (errno == ENXIO) ? end : start;
+    data -= data % SCAN_ALIGN;
+    if (data < end) {
+        sc->offset = data;
+        sc->ext_end = end;
+        sc->file_size = end;
+        shard_lock(ps->h, data, end - data, false);
+        scan_fill(sc);
+        shard_unlock(ps->h, data, end - data);
+    }
+    sc->ext_end = sc->file_size = sc->offset = end;
+    return sc->err;
+}
+
+static void pscan_fail(pscan_t *ps, int err)
+{
+    if (ps->err == NO_ERROR)
+        ps->err = err;
+    ps->stop = true;
+}
+
+static void *pscan_worker(void *arg)
+{
+    pscan_t *ps = arg;
+
+    pthread_mutex_lock(&ps->lock);
+    while (!ps->stop && ps->next_part < ps->parts) {
+        size_t part = ps->next_part;
+        pscan_slot_t *slot = &ps->ring[part % ps->ring_len];
+        size_t rank;
+        int rc;
+
+        if (slot->state != PSCAN_FREE) {
+            pthread_cond_wait(&ps->changed, &ps->lock);
+            continue;
+        }
+        ps->next_part++;
+        slot->part = part;
+        slot->state = PSCAN_BUSY;
+        pthread_mutex_unlock(&ps->lock);
+
+        rc = scan_fill_part(ps, &slot->sc, part);
+
+        // Every earlier part has been claimed, wait for their live counts
+        pthread_mutex_lock(&ps->lock);
+        while (ps->ranked != part && !ps->stop)
+            pthread_cond_wait(&ps->changed, &ps->lock);
+        rank = ps->total;
+        if (rc == NO_ERROR && !ps->stop) {
+            ps->total += slot->sc.live_count;
+            ps->ranked++;
+            pthread_cond_broadcast(&ps->changed);
+            if (ps->part_fn != NULL) {
+                pthread_mutex_unlock(&ps->lock);
+                rc = ps->part_fn(&slot->sc, rank, ps->arg);
+                pthread_mutex_lock(&ps->lock);
+            }
+        }
+        if (rc != NO_ERROR)
+            pscan_fail(ps, rc);
+        slot->state = (ps->block_fn != NULL) ? PSCAN_READY : PSCAN_FREE;
+        pthread_cond_broadcast(&ps->changed);
+    }
+    pthread_mutex_unlock(&ps->lock);
+    return NULL;
+}
+
+/*
+ *  Runs a parallel scan of the db open on fd with threads workers, see
+ *  above.  Returns the number of live records, or the first error from a
+ *  read (ERR_DB_FILE), part_fn or block_fn.
+ */
+static int scan_parallel(int fd, int threads, scan_part_fn_t part_fn,
+                         scan_block_fn_t block_fn, void *arg)
+{
+    pthread_t tids[SCAN_MAX_THREADS];
+    int started = 0;
+    struct stat st;
+    pscan_t ps;
+
+    if (fstat(fd, &st) < 0)
+        return ERR_DB_FILE;
+    memset(&ps, 0, sizeof(ps));
+    ps.fd = fd;
+    ps.h = db_handle_find(fd);
+    ps.file_size = st.st_size;
+    ps.parts = (st.st_size + SCAN_BLOCK_SIZE - 1) / SCAN_BLOCK_SIZE;
+    ps.part_fn = part_fn;
+    ps.block_fn = block_fn;
+    ps.arg = arg;
+    ps.err = NO_ERROR;
+    if ((size_t)threads > ps.parts)
+        threads = (ps.parts > 0) ? ps.parts : 1;
+    ps.ring_len = (size_t)threads * SCAN_RING_PER_THREAD;
+    ps.ring = calloc(ps.ring_len, sizeof(pscan_slot_t));
+    if (ps.ring == NULL)
+        return ERR_DB_FILE;
+    for (size_t i = 0; i < ps.ring_len; i++) {
+        if (scan_open(&ps.ring[i].sc, fd) != NO_ERROR)
+            ps.err = ERR_DB_FILE;
+    }
+    pthread_mutex_init(&ps.lock, NULL);
+    pthread_cond_init(&ps.changed, NULL);
+
+    // Pick the classification kernel before the workers race to do it
+    live_records(NULL, 0, NULL);
+
+    for (; ps.err == NO_ERROR && started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, pscan_worker, &ps) != 0) {
+            pthread_mutex_lock(&ps.lock);
+            pscan_fail(&ps, ERR_DB_FILE);
+            pthread_mutex_unlock(&ps.lock);
+            break;
+        }
+    }
+
+    // Hand the parts to block_fn in file order
+    for (size_t part = 0; block_fn != NULL && part < ps.parts; part++) {
+        pscan_slot_t *slot = &ps.ring[part % ps.ring_len];
+        int rc;
+
+        pthread_mutex_lock(&ps.lock);
+        while (!ps.stop && !(slot->state == PSCAN_READY && slot->part == part))
+            pthread_cond_wait(&ps.changed, &ps.lock);
+        pthread_mutex_unlock(&ps.lock);
+        if (ps.stop)
+            break;
+
+        rc = block_fn(&slot->sc, arg);
+
+        pthread_mutex_lock(&ps.lock);
+        slot->state = PSCAN_FREE;
+        if (rc < 0)
+            pscan_fail(&ps, rc);
+        else if (rc > 0)
+            ps.stop = true;
+        pthread_cond_broadcast(&ps.changed);
+        pthread_mutex_unlock(&ps.lock);
+    }
+
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    for (size_t i = 0; i < ps.ring_len; i++)
+        scan_close(&ps.ring[i].sc);
+    free(ps.ring);
+    pthread_cond_destroy(&ps.changed);
+    pthread_mutex_destroy(&ps.lock);
+    return (ps.err != NO_ERROR) ? ps.err : (int)ps.total;
+}
+
+static uint32_t fnv1a(uint32_t hash, const void *buff, size_t len)
+{
+    const unsigned char *p = buff;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t wal_sum(const db_wal_rec_t *r)
+{
+    uint32_t hash = fnv1a(2166136261u, &r->slot, sizeof(r->slot));
+
+    return fnv1a(hash, &r->image, sizeof(r->image));
+}
+
+static void wal_rec_init(db_wal_rec_t *r, size_t slot, const student_t *image)
+{
+    memset(r, 0, sizeof(*r));
+    r->magic = DB_WAL_MAGIC;
+    r->slot = (int32_t)slot;
+    memcpy(&r->image, image, STUDENT_RECORD_SIZE);
+}
+
+/*
+ *  Appends n records at the tail of the log, filling in their lsn and
+ *  checksum.  *end is set to the log offset the caller has to pass to
+ *  wal_commit(), or 0 if nothing was logged.  Returns NO_ERROR or
+ *  ERR_DB_FILE.
+ */
+static int wal_append(db_handle_t *h, db_wal_rec_t *recs, size_t n,
+                      uint64_t *end)
+{
+    uint64_t off;
+    int rc;
+
+    *end = 0;
+    if (h == NULL || h->wal == NULL || n == 0)
+        return NO_ERROR;
+    if (wal_lock(h, WAL_LOCK_APPEND, F_WRLCK) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    off = __atomic_load_n(&h->wal->tail, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < n; i++) {
+        recs[i].lsn = off + i * sizeof(db_wal_rec_t);
+        recs[i].sum = wal_sum(&recs[i]);
+    }
+    rc = write_all_at(h->wal_fd, recs, n * sizeof(db_wal_rec_t), off);
+    if (rc == NO_ERROR) {
+        // the tail only moves past records that are completely written
+        *end = off + n * sizeof(db_wal_rec_t);
+        __atomic_store_n(&h->wal->tail, *end, __ATOMIC_RELEASE);
+    }
+
+    wal_lock(h, WAL_LOCK_APPEND, F_UNLCK);
+    return rc;
+}
+
+/*
+ *  Group commit: returns once the log is durable up to end.  Writers queue
+ *  on the sync lock.  The one holding it flushes everything up to the
+ *  current tail, so the writers behind it normally find their records were
+ *  covered by that flush and return without an fdatasync() of their own.
+ *  Returns NO_ERROR or ERR_DB_FILE.
+ */
+static int wal_commit(db_handle_t *h, uint64_t end)
+{
+    db_wal_hdr_t *w = (h != NULL) ? h->wal : NULL;
+    int rc = NO_ERROR;
+
+    while (w != NULL && rc == NO_ERROR &&
+           __atomic_load_n(&w->synced, __ATOMIC_ACQUIRE) < end) {
+        if (wal_lock(h, WAL_LOCK_SYNC, F_WRLCK) != NO_ERROR)
+            return ERR_DB_FILE;
+        if (__atomic_load_n(&w->synced, __ATOMIC_ACQUIRE) < end) {
+            uint64_t target = __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+
+            if (fdatasync(h->wal_fd) < 0)
+                rc = ERR_DB_FILE;
+            else
+                __atomic_store_n(&w->synced, target, __ATOMIC_RELEASE);
+        }
+        wal_lock(h, WAL_LOCK_SYNC, F_UNLCK);
+    }
+    return rc;
+}
+
+/*
+ *  Syncs the data file and the checksums of its records, which the log
+ *  stops covering once it is emptied.  Returns 0, or -1 like fdatasync().
+ */
+static int db_sync(db_handle_t *h)
+{
+    if (fdatasync(h->fd) < 0)
+        return -1;
+    if (h->crc != NULL && msync(h->crc, crc_size(h->crc->slots), MS_SYNC) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ *  Empties the log.  The data file has to be synced first, since until now
+ *  the log was what made the changes in it durable.
+ */
+static int wal_reset(db_handle_t *h)
+{
+    __atomic_store_n(&h->wal->tail, DB_WAL_HDR_SIZE, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->wal->synced, DB_WAL_HDR_SIZE, __ATOMIC_RELEASE);
+    if (msync(h->wal, DB_WAL_HDR_SIZE, MS_SYNC) < 0 ||
+        ftruncate(h->wal_fd, DB_WAL_HDR_SIZE) < 0)
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  Syncs the data file and empties the log.  Unless force is set, nothing
+ *  happens until the log has grown past DB_WAL_CKPT_BYTES.  Waits for the
+ *  writers in the middle of a change, so the caller must not be one of
+ *  them.  Returns NO_ERROR or ERR_DB_FILE.
+ */
+static int wal_checkpoint(db_handle_t *h, bool force)
+{
+    uint64_t limit = DB_WAL_HDR_SIZE + (force ? 0 : DB_WAL_CKPT_BYTES);
+    int rc = NO_ERROR;
+
+    if (h == NULL || h->wal == NULL ||
+        __atomic_load_n(&h->wal->tail, __ATOMIC_ACQUIRE) <= limit)
+        return NO_ERROR;
+    if (wal_lock(h, WAL_LOCK_CKPT, F_WRLCK) != NO_ERROR)
+        return ERR_DB_FILE;
+    // another writer may have checkpointed while we waited
+    if (h->wal->tail > limit &&
+        (db_sync(h) < 0 || wal_reset(h) != NO_ERROR))
+        rc = ERR_DB_FILE;
+    wal_lock(h, WAL_LOCK_CKPT, F_UNLCK);
+    return rc;
+}
+
+/*
+ *  Recovery path: stores every intact record image between the header and
+ *  the tail into dst_fd, the data file or a copy of it, in log order, and
+ *  the sums of the records stored into the data file.  A torn record was
+ *  never committed and ends the replay.  Returns NO_ERROR or ERR_DB_FILE.
+ */
+static int wal_replay(db_handle_t *h, int dst_fd)
+{
+    db_wal_rec_t recs[64];
+    uint64_t off = DB_WAL_HDR_SIZE;
+    uint64_t tail = h->wal->tail;
+
+    while (off < tail) {
+        size_t want = sizeof(recs);
+        ssize_t n;
+
+        if (tail - off < want)
+            want = tail - off;
+        n = pread(h->wal_fd, recs, want, off);
+        if (n < 0)
+            return ERR_DB_FILE;
+        if ((size_t)n < sizeof(db_wal_rec_t))
+            break;
+
+        for (size_t i = 0; i < n / sizeof(db_wal_rec_t); i++) {
+            const db_wal_rec_t *r = &recs[i];
+
+            if (r->magic != DB_WAL_MAGIC || r->lsn != off ||
+                r->slot < 0 || r->slot > h->max_id || r->sum != wal_sum(r))
+                return NO_ERROR;
+            if (write_all_at(dst_fd, &r->image, STUDENT_RECORD_SIZE,
+                             (off_t)r->slot * STUDENT_RECORD_SIZE) != NO_ERROR)
+                return ERR_DB_FILE;
+            if (dst_fd == h->fd)
+                crc_update(h, r->slot, &r->image);
+            off += sizeof(db_wal_rec_t);
+        }
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  Brings the log of a db that nobody else has open into a known state:
+ *  a new or unreadable log is initialized, and one left behind by a crash
+ *  is replayed and emptied.
+ */
+static int wal_recover(db_handle_t *h)
+{
+    db_wal_hdr_t *w = h->wal;
+
+    if (w->magic != DB_WAL_MAGIC || w->version != DB_WAL_VERSION ||
+        w->tail < DB_WAL_HDR_SIZE) {
+        memset(w, 0, sizeof(*w));
+        w->magic = DB_WAL_MAGIC;
+        w->version = DB_WAL_VERSION;
+        return wal_reset(h);
+    }
+    if (w->tail == DB_WAL_HDR_SIZE)
+        return NO_ERROR;
+    if (wal_replay(h, h->fd) != NO_ERROR || db_sync(h) < 0)
+        return ERR_DB_FILE;
+    return wal_reset(h);
+}
+
+/*
+ *  Opens the log for dbFile and maps its header.  Every handle holds
+ *  WAL_LOCK_OPEN shared, so a process that can take it exclusive is the
+ *  only one with the db open.  That process recovers the log before anyone
+ *  else gets in, and is the only one that may rebuild a sidecar, since
+ *  other processes would be updating it at the same time.  It keeps the
+ *  lock exclusive until db_handle_attach() has attached the sidecars.
+ *
+ *  returns:  true if other processes have the db open
+ */
+static bool wal_attach(db_handle_t *h, const char *dbFile)
+{
+    char path[512];
+    struct stat st;
+    void *p;
+    bool shared = false;
+
+    sidecar_path(path, sizeof(path), dbFile, DB_WAL_EXT);
+    h->wal_fd = open(path, O_RDWR | O_CREAT,
+                     S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (h->wal_fd < 0)
+        return false;
+    if (fstat(h->wal_fd, &st) < 0 ||
+        (st.st_size < DB_WAL_HDR_SIZE &&
+         ftruncate(h->wal_fd, DB_WAL_HDR_SIZE) < 0))
+        goto fail;
+    p = mmap(NULL, DB_WAL_HDR_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+             h->wal_fd, 0);
+    if (p == MAP_FAILED)
+        goto fail;
+    h->wal = p;
+
+    if (range_lock(h->wal_fd, F_WRLCK, WAL_LOCK_OPEN, 1, false) != NO_ERROR) {
+        // wait out a process that is recovering, then see if it is still
+        // around
+        if (range_lock(h->wal_fd, F_RDLCK, WAL_LOCK_OPEN, 1, true) != NO_ERROR)
+            goto fail;
+        shared = range_lock(h->wal_fd, F_WRLCK, WAL_LOCK_OPEN, 1,
+                            false) != NO_ERROR;
+    }
+    if (!shared && wal_recover(h) != NO_ERROR)
+        goto fail;
+    return shared;
+
+fail:
+    if (h->wal != NULL)
+        munmap(h->wal, DB_WAL_HDR_SIZE);
+    close(h->wal_fd);
+    h->wal = NULL;
+    h->wal_fd = -1;
+    return false;
+}
+
+/*
+ *  Closes the log.  The last handle to close checkpoints it, so the log of
+ *  a db that nobody has open is normally empty.
+ */
+static void wal_detach(db_handle_t *h)
+{
+    if (h->wal == NULL)
+        return;
+    if (h->wal->tail > DB_WAL_HDR_SIZE &&
+        range_lock(h->wal_fd, F_WRLCK, WAL_LOCK_OPEN, 1, false) == NO_ERROR &&
+        db_sync(h) == 0)
+        wal_reset(h);
+    munmap(h->wal, DB_WAL_HDR_SIZE);
+    close(h->wal_fd);
+    h->wal = NULL;
+    h->wal_fd = -1;
+}
+
+/*
+ *  Takes WAL_LOCK_OPEN of dbFile exclusive on a descriptor of its own, for
+ *  a change to the data file that no process may have it open or mapped
+ *  across.  Returns that descriptor, which drops the lock when closed, or
+ *  -1 if the db is open elsewhere or the log cannot be opened.
+ */
+static int wal_lock_exclusive(const char *dbFile)
+{
+    char path[512];
+    int lfd;
+
+    sidecar_path(path, sizeof(path), dbFile, DB_WAL_EXT);
+    lfd = open(path, O_RDWR | O_CREAT | O_CLOEXEC,
+               S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+    if (lfd >= 0 &&
+        range_lock(lfd, F_WRLCK, WAL_LOCK_OPEN, 1, false) != NO_ERROR) {
+        close(lfd);
+        lfd = -1;
+    }
+    return lfd;
+}
+
+static void db_handle_attach(int fd, const char *dbFile, int max_id)
+{
+    const char *engine = getenv(DB_ENGINE_ENV);
+    size_t slots = (size_t)max_id + 1;
+    struct stat st;
+    bool shared, empty;
+    db_crc_t *crc;
+    db_handle_t *h = db_handle_find(fd);
+
+    if (h != NULL)
+        return;     // already attached
+    for (int i = 0; i < DB_HANDLE_SLOTS && h == NULL; i++) {
+        if (db_handles[i].fd == -1)
+            h = &db_handles[i];
+    }
+    if (h == NULL || fstat(fd, &st) < 0)
+        return;
+
+    for (int i = 0; i < WAL_LOCK_COUNT; i++) {
+        pthread_rwlock_init(&h->wal_locks[i].rw, NULL);
+        pthread_mutex_init(&h->wal_locks[i].mutex, NULL);
+        h->wal_locks[i].readers = 0;
+    }
+    for (int i = 0; i < DB_SHARDS; i++)
+        pthread_rwlock_init(&h->shards[i], NULL);
+
+    h->fd = fd;
+    h->max_id = max_id;
+    h->shard_ids = (max_id + DB_SHARDS) / DB_SHARDS;
+    h->size = st.st_size;
+    empty = st.st_size <= STUDENT_RECORD_SIZE;
+    // Mapped before the log so recovery can store the sums of what it
+    // replays, but only rebuilt once wal_attach() says the db is ours
+    crc = sidecar_map(dbFile, DB_CRC_EXT, crc_size(slots));
+    h->crc = (crc != NULL && crc_matches(crc, slots)) ? crc : NULL;
+    shared = wal_attach(h, dbFile);
+    if (fstat(fd, &st) == 0)    // replaying the log may have grown the file
+        h->size = st.st_size;
+    h->crc = crc_attach(crc, fd, slots, empty, shared);
+    h->bmp = bitmap_attach(fd, dbFile, slots, shared);
+    h->idx = index_attach(fd, dbFile, slots, shared);
+    // The sidecars are rebuilt if need be, let other processes in
+    if (h->wal_fd >= 0)
+        range_lock(h->wal_fd, F_RDLCK, WAL_LOCK_OPEN, 1, false);
+
+    if (engine == NULL || strcmp(engine, DB_ENGINE_RW) != 0) {
+        void *base = mmap(NULL, db_map_len(h), PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0);
+        if (base != MAP_FAILED) {
+            pthread_once(&map_fault_once, map_fault_install);
+            h->base = base;
+        }
+    }
+}
+
+static void db_handle_detach(int fd)
+{
+    db_handle_t *h = db_handle_find(fd);
+
+    if (h == NULL)
+        return;
+    if (h->base != NULL) {
+        msync(h->base, db_map_len(h), MS_SYNC);
+        munmap(h->base, db_map_len(h));
+    }
+    if (h->bmp != NULL)
+        bitmap_detach(h->bmp, fd);
+    if (h->idx != NULL)
+        index_detach(h->idx, fd);
+    wal_detach(h);
+    if (h->crc != NULL)
+        sidecar_unmap(h->crc, crc_size(h->crc->slots));
+    for (int i = 0; i < WAL_LOCK_COUNT; i++) {
+        pthread_rwlock_destroy(&h->wal_locks[i].rw);
+        pthread_mutex_destroy(&h->wal_locks[i].mutex);
+    }
+    for (int i = 0; i < DB_SHARDS; i++)
+        pthread_rwlock_destroy(&h->shards[i]);
+    h->fd = -1;
+    h->max_id = 0;
+    h->base = NULL;
+    h->size = 0;
+    h->bmp = NULL;
+    h->idx = NULL;
+    h->crc = NULL;
+}
+
+static void db_header_init(db_header_t *hdr, int max_id)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->zero = DELETED_STUDENT_ID;
+    hdr->magic = DB_HEADER_MAGIC;
+    hdr->version = DB_HEADER_VERSION;
+    hdr->layout = DB_LAYOUT_DIRECT;
+    hdr->min_id = MIN_STD_ID;
+    hdr->max_id = max_id;
+    hdr->record_size = STUDENT_RECORD_SIZE;
+    hdr->fname_width = sizeof(EMPTY_STUDENT_RECORD.fname);
+    hdr->lname_width = sizeof(EMPTY_STUDENT_RECORD.lname);
+}
+
+/*
+ *  Returns true if this build can use a db with the header hdr, which
+ *  means the records have to look exactly like student_t.
+ */
+static bool db_header_supported(const db_header_t *hdr)
+{
+    return hdr->magic == DB_HEADER_MAGIC &&
+           hdr->version == DB_HEADER_VERSION &&
+           hdr->layout == DB_LAYOUT_DIRECT &&
+           hdr->min_id == MIN_STD_ID &&
+           hdr->max_id >= MIN_STD_ID && hdr->max_id <= MAX_STD_ID_LIMIT &&
+           hdr->record_size == (uint32_t)STUDENT_RECORD_SIZE &&
+           hdr->fname_width == sizeof(EMPTY_STUDENT_RECORD.fname) &&
+           hdr->lname_width == sizeof(EMPTY_STUDENT_RECORD.lname);
+}
+
+/*
+ *  db_header_load
+ *      fd:      database file open for reading and writing
+ *      max_id:  id range to record if the file is empty
+ *      *hdr:    where the header is copied
+ *
+ *  Reads the header in slot 0, writing one first if the file does not
+ *  have one yet.  An empty file gets max_id, a file from before headers
+ *  existed gets MAX_STD_ID, which is what it was made with.  A file that
+ *  compress_db() packed before headers existed has a student in slot 0,
+ *  so it keeps going without a header until it is compressed again.
+ *  Slot 0 stays write locked throughout, so processes opening a new db at
+ *  the same time agree on its header.
+ *
+ *  returns:  NO_ERROR, ERR_DB_OP if this build cannot use the file, or
+ *            ERR_DB_FILE
+ */
+static int db_header_load(int fd, int max_id, db_header_t *hdr)
+{
+    struct stat st;
+    ssize_t n;
+    int rc = NO_ERROR;
+
+    if (range_lock(fd, F_WRLCK, 0, sizeof(*hdr), true) != NO_ERROR)
+        return ERR_DB_FILE;
+
+    memset(hdr, 0, sizeof(*hdr));
+    n = pread(fd, hdr, sizeof(*hdr), 0);
+    if (n < 0 || fstat(fd, &st) < 0) {
+        rc = ERR_DB_FILE;
+    } else if (hdr->zero != DELETED_STUDENT_ID) {
+        db_header_init(hdr, MAX_STD_ID);
+    } else if (memcmp(hdr, &EMPTY_STUDENT_RECORD, sizeof(*hdr)) == 0) {
+        db_header_init(hdr, st.st_size == 0 ? max_id : MAX_STD_ID);
+        rc = write_all_at(fd, hdr, sizeof(*hdr), 0);
+    } else if (!db_header_supported(hdr)) {
+        rc = ERR_DB_OP;
+    }
+
+    range_lock(fd, F_UNLCK, 0, sizeof(*hdr), false);
+    return rc;
+}
+
+/*
+ *  Opens dbFile like open_db(), creating it with room for ids up to max_id
+ *  if it is new or truncated.  max_id is not looked at otherwise, so an
+ *  out of range one only fails the open of an empty file.
+ */
+static int db_open(char *dbFile, bool should_truncate, int max_id)
+{
+    db_header_t hdr;
+    struct stat st;
+    bool max_id_ok = max_id >= MIN_STD_ID && max_id <= MAX_STD_ID_LIMIT;
+    int lock_fd = -1;
+    int rc;
+
+    if (should_truncate && !max_id_ok) {
+        printf(M_ERR_DB_MAX_ID, MIN_STD_ID, MAX_STD_ID_LIMIT);
+        return ERR_DB_FILE;
+    }
+
+    // Emptying the file under another process's mapping would kill it
+    // with SIGBUS, so only a db nobody else has open is truncated
+    if (should_truncate && (lock_fd = wal_lock_exclusive(dbFile)) < 0) {
+        printf(M_ERR_DB_BUSY);
+        return ERR_DB_FILE;
+    }
+
+    // Set permissions: rw-rw----
+    // see sys/stat.h for constants
+    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP;
+
+    // open the file if it exists for Read and Write,
+    // create it if it does not exist
+    int flags = O_RDWR | O_CREAT;
+
+    if (should_truncate)
+        flags += O_TRUNC;
+
+    // Now open file
+    int fd = open(dbFile, flags, mode);
+
+    if (lock_fd >= 0)
+        close(lock_fd);
+    if (fd == -1)
+    {
+        // Handle the error
+        printf(M_ERR_DB_OPEN);
+        return ERR_DB_FILE;
+    }
+    if (!max_id_ok && fstat(fd, &st) == 0 && st.st_size == 0)
+    {
+        printf(M_ERR_DB_MAX_ID, MIN_STD_ID, MAX_STD_ID_LIMIT);
+        close(fd);
+        return ERR_DB_FILE;
+    }
+
+    // The header says how big the id space is, so it comes first
+    rc = db_header_load(fd, max_id, &hdr);
+    if (rc != NO_ERROR)
+    {
+        printf(rc == ERR_DB_OP ? M_ERR_DB_LAYOUT : M_ERR_DB_OPEN);
+        close(fd);
+        return ERR_DB_FILE;
+    }
+
+    db_handle_attach(fd, dbFile, hdr.max_id);
+    return fd;
+}
+
+/*
+ *  open_db
+ *      dbFile:  name of the database file
+ *      should_truncate:  indicates if opening the file also empties it
+ *
+ *  A new or truncated db holds ids up to SDB_MAX_ID, or MAX_STD_ID if that
+ *  is not set.  An existing db keeps the id range in its header, and does
+ *  not care what SDB_MAX_ID holds.
+ *
+ *  returns:  File descriptor on success, or ERR_DB_FILE on failure
+ *
+ *  console:  Does not produce any console I/O on success
+ *            M_ERR_DB_OPEN on error
+ *            M_ERR_DB_LAYOUT if the file header cannot be used
+ *            M_ERR_DB_MAX_ID if the db is new or truncated and SDB_MAX_ID
+ *            is not a number in range
+ *            M_ERR_DB_BUSY   if should_truncate is set and another process
+ *            has the db open
+ *
+ */
+int open_db(char *dbFile, bool should_truncate)
+{
+    const char *env = getenv(DB_MAX_ID_ENV);
+    char *end;
+    long max_id = MAX_STD_ID;
+
+    if (env != NULL) {
+        // anything but a whole number in range is passed on as 0, which
+        // db_open() rejects if it ever needs the value
+        errno = 0;
+        max_id = strtol(env, &end, 10);
+        if (errno != 0 || end == env || *end != '\0' ||
+            max_id < MIN_STD_ID || max_id > MAX_STD_ID_LIMIT)
+            max_id = 0;
+    }
+    return db_open(dbFile, should_truncate, (int)max_id);
+}
+
+/*
+ *  close_db
+ *      fd:  linux file descriptor returned by open_db()
+ *
+ *  Flushes the memory mapping of the database (if any) with msync(), unmaps
+ *  it, marks the sidecars clean, checkpoints the write ahead log if no other
+ *  process has the db open, and closes the file.  Use this instead of
+ *  close() on any fd returned by open_db().
+ *
+ *  returns:  NO_ERROR on success, or ERR_DB_FILE if close() fails
+ *
+ *  console:  Does not produce any console I/O
+ */
+int close_db(int fd)
+{
+    db_handle_detach(fd);
+    if (close(fd) < 0)
+        return ERR_DB_FILE;
+    return NO_ERROR;
+}
+
+/*
+ *  read_slot
+ *      fd:     linux file descriptor
+ *      slot:   record index in the file
+ *      *s:     where the record is copied
+ *
+ *  Reads the record in a slot from the mapping if there is one, otherwise
+ *  with pread().  A slot past EOF reads as an empty record.
+ *
+ *  returns:  NO_ERROR or ERR_DB_FILE
+ */
+static int read_slot(int fd, size_t slot, student_t *s)
+{
+    db_handle_t *m = db_map_find(fd);
+    ssize_t n;
+
+    if (m != NULL && slot <= (size_t)m->max_id)
+        return db_map_load(m, slot, s);
+
+    n = pread(fd, s, STUDENT_RECORD_SIZE, (off_t)slot * STUDENT_RECORD_SIZE);
+    if (n < 0)
+        return ERR_DB_FILE;
+    if (n != STUDENT_RECORD_SIZE)
+        memset(s, 0, STUDENT_RECORD_SIZE);
+    return NO_ERROR;
+}
+
+/*
+ *  Write path shared by add_student(), del_student() and batch_load(), see
+ *  "Write ahead log" at the top of the file.  db_write_begin() takes the
+ *  checkpoint lock shared, then the records' shards and their bytes of the
+ *  data file exclusive.  db_write_end() releases the records, waits for the
+ *  log to be durable up to lsn, releases the checkpoint lock and checkpoints
+ *  if the log has grown too long.  The records are released before the
+ *  commit so other writers do not queue behind the fdatasync().  Whatever
+ *  they do next is logged after our records, so it cannot become durable
+ *  before them.
+ *  Both return NO_ERROR or ERR_DB_FILE.
+ */
+static int db_write_begin(db_handle_t *h, int fd, off_t start, off_t len)
+{
+    if (wal_lock(h, WAL_LOCK_CKPT, F_RDLCK) != NO_ERROR)
+        return ERR_DB_FILE;
+    shard_lock(h, start, len, true);
+    if (range_lock(fd, F_WRLCK, start, len, true) != NO_ERROR) {
+        shard_unlock(h, start, len);
+        wal_lock(h, WAL_LOCK_CKPT, F_UNLCK);
+        return ERR_DB_FILE;
+    }
+    return NO_ERROR;
+}
+
+static int db_write_end(db_handle_t *h, int fd, off_t start, off_t len,
+                        uint64_t lsn)
+{
+    int rc;
+
+    range_lock(fd, F_UNLCK, start, len, false);
+    shard_unlock(h, start, len);
+    rc = wal_commit(h, lsn);
+    wal_lock(h, WAL_LOCK_CKPT, F_UNLCK);
+    if (rc == NO_ERROR)
+        wal_checkpoint(h, false);   // retried by the next writer if it fails
+    return rc;
+}
+
+/*
+ *  Stores the image of one slot that is already logged, in the mapping if
+ *  there is one and with pwrite() otherwise.  The caller holds the slot's
+ *  lock.  Returns NO_ERROR or ERR_DB_FILE.
+ */
+static int db_store_slot(db_handle_t *h, int fd, size_t slot,
+                         const student_t *s)
+{
+    db_handle_t *m = db_map_find(fd);
+
+    if (m != NULL && slot <= (size_t)m->max_id) {
+        // growing is serialized, or a writer reserving a lower slot could
+        // truncate the file below a record that was just stored
+        if (!db_map_has_slot(m, slot)) {
+            int rc;
+
+            wal_lock(h, WAL_LOCK_GROW, F_WRLCK);
+            rc = db_map_reserve(m, slot);
+            wal_lock(h, WAL_LOCK_GROW, F_UNLCK);
+            if (rc != NO_ERROR)
+                return ERR_DB_FILE;
+        }
+        if (!map_copy(&m->base[slot], s)) {
+            // the file shrank under the mapping, write it back the slow way
+            int rc;
+
+            wal_lock(h, WAL_LOCK_GROW, F_WRLCK);
+            db_map_refresh(m);
+            rc = write_all_at(fd, s, STUDENT_RECORD_SIZE,
+                              (off_t)slot * STUDENT_RECORD_SIZE);
+            db_map_refresh(m);
+            wal_lock(h, WAL_LOCK_GROW, F_UNLCK);
+            if (rc != NO_ERROR)
+                return ERR_DB_FILE;
+        }
+        crc_update(h, slot, s);
+        return NO_ERROR;
+    }
+    if (write_all_at(fd, s, STUDENT_RECORD_SIZE,
+                     (off_t)slot * STUDENT_RECORD_SIZE) != NO_ERROR)
+        return ERR_DB_FILE;
+    crc_update(h, slot, s);
+    return NO_ERROR;
+}
+
+/*
+ *  Logs the new image of one slot and stores it.  The caller holds the
+ *  slot's lock.  Returns NO_ERROR or ERR_DB_FILE.
+ */
+static int db_write_slot(db_handle_t *h, int fd, size_t slot,
+                         const student_t *s, uint64_t *lsn)
+{
+    db_wal_rec_t rec;
+
+    wal_rec_init(&rec, slot, s);
+    if (wal_append(h, &rec, 1, lsn) != NO_ERROR)
+        return ERR_DB_FILE;
+    return db_store_slot(h, fd, slot, s);
+}
+
+/*
+ *  get_student
+ *      fd:  linux file descriptor
+ *      id:  the student id we are looking forname of the
+ *      *s:  a pointer where the located (if found) student data will be
+ *           copied
+ *
+ *  The record is checked against its sum.  Readers do not lock out other
+ *  processes, so a mismatch is first read again under a lock on the
+ *  record, which waits for a writer that was in the middle of storing it.
+ *
+ *  returns:  NO_ERROR       student located and copied into *s
+ *            ERR_DB_FILE    database file I/O issue
+ *            ERR_DB_CORRUPT the record does not match its checksum
+ *            SRCH_NOT_FOUND student was not located in the database
+ *
+ *  console:  Does not produce any console I/O used by other functions
+ */
+int get_student(int fd, int id, student_t *s)
+{
+    off_t offset;
+    ssize_t bytes_read;
+    student_t temp_student = {0};
+    db_handle_t *h = db_handle_find(fd);
+    db_handle_t *m = db_map_find(fd);
+    bool corrupt = false;
+
+    if (id < MIN_STD_ID || id > db_id_max(h))
+        return SRCH_NOT_FOUND;
+
+    // Calculate file offset based on student ID
+    offset = (off_t)id * STUDENT_RECORD_SIZE;
+
+    for (int tries = 0; tries < 2; tries++) {
+        // Readers share the shard, so only a write to it can hold us up
+        shard_lock(h, offset, STUDENT_RECORD_SIZE, false);
+        if (tries > 0)
+            range_lock(fd, F_RDLCK, offset, STUDENT_RECORD_SIZE, true);
+        if (m != NULL) {
+            bytes_read = (db_map_load(m, id, &temp_student) == NO_ERROR) ?
+                         STUDENT_RECORD_SIZE : -1;
+        } else {
+            // pread() leaves the file offset alone, which threads share
+            bytes_read = pread(fd, &temp_student, STUDENT_RECORD_SIZE, offset);
+        }
+        corrupt = (bytes_read == STUDENT_RECORD_SIZE &&
+                   !crc_slot_ok(h, id, &temp_student));
+        if (tries > 0)
+            range_lock(fd, F_UNLCK, offset, STUDENT_RECORD_SIZE, false);
+        shard_unlock(h, offset, STUDENT_RECORD_SIZE);
+        if (!corrupt)
+            break;
+    }
+
+    if (bytes_read < 0) {
+        return ERR_DB_FILE;
+    }
+    if (corrupt) {
+        return ERR_DB_CORRUPT;
+    }
+    
+    // Check if we actually read a record
+    if (bytes_read == 0) {
+        return SRCH_NOT_FOUND;
+    }
+    
+    // Check if record exists and is not deleted
+    if (temp_student.id == 0) {
+        return SRCH_NOT_FOUND;
+    }
+    
+    // Copy found student to provided storage
+    memcpy(s, &temp_student, STUDENT_RECORD_SIZE);
+    return NO_ERROR;
+}
+
+/*
+ *  add_student
+ *      fd:     linux file descriptor
+ *      id:     student id (range is defined in db.h )
+ *      fname:  student first name
+ *      lname:  student last name
+ *      gpa:    GPA as an integer (range defined in db.h)
+ *
+ *  Adds a new student to the database.  After calculating the index for the
+ *  student, check if there is another student already at that location.  A good
+ *  way is to use something like memcmp() to ensure that the location for this
+ *  student contains all zero byes indicating the space is empty.
+ *
+ *  The slot stays locked from the check until the write, so two processes
+ *  adding the same id cannot both succeed, and the new record is logged
+ *  before it is stored.
+ *
+ *  returns:  NO_ERROR       student added to database
+ *            ERR_DB_FILE    database file I/O issue
+ *            ERR_DB_OP      database operation logically failed (aka student
+ *                           already exists)
+ *            ERR_DB_RANGE   id is outside the id range in the db header
+ *
+ *
+ *  console:  M_STD_ADDED       on success
+ *            M_ERR_DB_ADD_DUP  student already exists
+ *            M_ERR_STD_RNG     id is outside the db's id range
+ *            M_ERR_DB_READ     error reading or seeking the database file
+ *            M_ERR_DB_WRITE    error writing to db file (adding student)
+ *
+ */
+int add_student(int fd, int id, char *fname, char *lname, int gpa) {
+    student_t new_student = {0};
+    student_t temp = {0};
+    db_handle_t *h = db_handle_find(fd);
+    off_t offset = (off_t)id * STUDENT_RECORD_SIZE;
+    uint64_t lsn = 0;
+    int rc;
+
+    if (id < MIN_STD_ID || id > db_id_max(h)) {
+        printf(M_ERR_STD_RNG);
+        return ERR_DB_RANGE;
+    }
+    
+    // Initialize new student record
+    new_student.id = id;
+    new_student.gpa = gpa;
+    strncpy(new_student.fname, fname, sizeof(new_student.fname)-1);
+    strncpy(new_student.lname, lname, sizeof(new_student.lname)-1);
+
+    // Lock the slot so no other writer can fill it between the check for
+    // a duplicate and the write
+    if (db_write_begin(h, fd, offset, STUDENT_RECORD_SIZE) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    if (read_slot(fd, id, &temp) != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        rc = ERR_DB_FILE;
+    } else if (temp.id != 0) {
+        printf(M_ERR_DB_ADD_DUP, id);
+        rc = ERR_DB_OP;
+    } else if (db_write_slot(h, fd, id, &new_student, &lsn) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        rc = ERR_DB_FILE;
+    } else {
+        bitmap_update(db_bitmap_find(fd), id, true);
+        wal_lock(h, WAL_LOCK_INDEX, F_WRLCK);
+        index_insert(db_index_find(fd), id, &new_student);
+        wal_lock(h, WAL_LOCK_INDEX, F_UNLCK);
+        rc = NO_ERROR;
+    }
+
+    if (db_write_end(h, fd, offset, STUDENT_RECORD_SIZE, lsn) != NO_ERROR &&
+        rc == NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        rc = ERR_DB_FILE;
+    }
+    if (rc == NO_ERROR)
+        printf(M_STD_ADDED, id);
+    return rc;
+}
+
+/*
+ *  del_student
+ *      fd:     linux file descriptor
+ *      id:     student id to be deleted
+ *
+ *  Removes a student to the database.  Use the get_student() function to
+ *  locate the student to be deleted. If there is a student at that location
+ *  write an empty student record - see EMPTY_STUDENT_RECORD from db.h at
+ *  that location.  Like add_student(), the slot is locked and the change
+ *  logged.
+ *
+ *  returns:  NO_ERROR       student deleted from database
+ *            ERR_DB_FILE    database file I/O issue
+ *            ERR_DB_OP      database operation logically failed (aka student
+ *                           not in database)
+ *
+ *
+ *  console:  M_STD_DEL_MSG      on success
+ *            M_STD_NOT_FND_MSG  student not in database, cant be deleted
+ *            M_ERR_DB_READ      error reading or seeking the database file
+ *            M_ERR_DB_WRITE     error writing to db file (adding student)
+ *
+ */
+int del_student(int fd, int id)
+{
+    student_t student = {0};
+    db_handle_t *h = db_handle_find(fd);
+    off_t offset = (off_t)id * STUDENT_RECORD_SIZE;
+    uint64_t lsn = 0;
+    int rc;
+
+    if (id < MIN_STD_ID || id > db_id_max(h)) {
+        printf(M_STD_NOT_FND_MSG, id);
+        return ERR_DB_OP;
+    }
+
+    if (db_write_begin(h, fd, offset, STUDENT_RECORD_SIZE) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    // Check if student exists
+    if (read_slot(fd, id, &student) != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        rc = ERR_DB_FILE;
+    } else if (student.id == 0) {
+        printf(M_STD_NOT_FND_MSG, id);
+        rc = ERR_DB_OP;
+    } else if (db_write_slot(h, fd, id, &EMPTY_STUDENT_RECORD, &lsn) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        rc = ERR_DB_FILE;
+    } else {
+        bitmap_update(db_bitmap_find(fd), id, false);
+        wal_lock(h, WAL_LOCK_INDEX, F_WRLCK);
+        index_remove(db_index_find(fd), id);
+        wal_lock(h, WAL_LOCK_INDEX, F_UNLCK);
+        rc = NO_ERROR;
+    }
+
+    if (db_write_end(h, fd, offset, STUDENT_RECORD_SIZE, lsn) != NO_ERROR &&
+        rc == NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        rc = ERR_DB_FILE;
+    }
+    if (rc == NO_ERROR)
+        printf(M_STD_DEL_MSG, id);
+    return rc;
+}
+
+/*
+ *  Batched point operations
+ *
+ *  get_students() and put_students() look up or add many ids at once.  The
+ *  ids are sorted so neighbouring records are read or written together,
+ *  and the whole batch goes to ring_read() / ring_write(), which keeps up
+ *  to RING_DEPTH reads or writes in flight on an io_uring instead of the
+ *  one at a time of get_student() and add_student().  A mapped db has
+ *  nothing to wait for, so there the records are just copied.
+ */
+typedef struct batch_ref {
+    int id;
+    int i;              // position of the id in the caller's arrays
+    student_t *s;       // record buffer for the slot
+    int rc;             // NO_ERROR, SRCH_NOT_FOUND or ERR_DB_FILE
+} batch_ref_t;
+
+static int batch_ref_cmp(const void *a, const void *b)
+{
+    const batch_ref_t *x = a, *y = b;
+
+    if (x->id != y->id)
+        return (x->id < y->id) ? -1 : 1;
+    return (x->i < y->i) ? -1 : (x->i > y->i);
+}
+
+/*
+ *  Reads the slot of each of refs, which are sorted by id, into its s and
+ *  sets its rc.  The caller holds the shards.  Returns the number found,
+ *  or ERR_DB_FILE if the batch could not be issued.
+ */
+static int db_read_batch(int fd, batch_ref_t *refs, size_t n)
+{
+    db_handle_t *m = db_map_find(fd);
+    ring_op_t *ops = NULL;
+    int found = 0;
+
+    if (m == NULL) {
+        ops = malloc((n > 0 ? n : 1) * sizeof(ring_op_t));
+        if (ops == NULL)
+            return ERR_DB_FILE;
+        for (size_t j = 0; j < n; j++) {
+            ops[j].buff = refs[j].s;
+            ops[j].len = STUDENT_RECORD_SIZE;
+            ops[j].offset = (off_t)refs[j].id * STUDENT_RECORD_SIZE;
+        }
+        if (ring_read(fd, ops, n) != NO_ERROR) {
+            free(ops);
+            return ERR_DB_FILE;
+        }
+    }
+
+    for (size_t j = 0; j < n; j++) {
+        batch_ref_t *r = &refs[j];
+
+        if (m != NULL) {
+            if (db_map_load(m, r->id, r->s) != NO_ERROR) {
+                memset(r->s, 0, STUDENT_RECORD_SIZE);
+                r->rc = ERR_DB_FILE;
+                continue;
+            }
+        } else if (ops[j].res < 0) {
+            memset(r->s, 0, STUDENT_RECORD_SIZE);
+            r->rc = ERR_DB_FILE;
+            continue;
+        } else if (ops[j].res < STUDENT_RECORD_SIZE) {
+            memset(r->s, 0, STUDENT_RECORD_SIZE);   // past the end of the file
+        }
+        r->rc = (r->s->id != 0) ? NO_ERROR : SRCH_NOT_FOUND;
+        if (r->rc == NO_ERROR)
+            found++;
+    }
+    free(ops);
+    return found;
+}
+
+/*
+ *  get_students
+ *      fd:   linux file descriptor
+ *      ids:  the student ids to look up, in any order, repeats allowed
+ *      n:    number of ids
+ *      out:  n records, out[i] receives the student with ids[i]
+ *      rc:   n results, rc[i] is NO_ERROR, SRCH_NOT_FOUND, ERR_DB_CORRUPT
+ *            or ERR_DB_FILE
+ *
+ *  Looks up a batch of students with one shared lock and, on the rw
+ *  engine, one ring_read() instead of a pread() per id.  Students that are
+ *  not found or fail their checksum come back as EMPTY_STUDENT_RECORD.
+ *  Like get_student(), a record that does not match its sum is read again
+ *  under a lock on the record before it is reported corrupt.
+ *
+ *  returns:  <number>       students found
+ *            ERR_DB_FILE    out of memory, nothing was read
+ *
+ *  console:  Does not produce any console I/O
+ */
+int get_students(int fd, const int *ids, int n, student_t *out, int *rc)
+{
+    db_handle_t *h = db_handle_find(fd);
+    batch_ref_t *refs = malloc((n > 0 ? n : 1) * sizeof(batch_ref_t));
+    size_t k = 0;
+    int found;
+
+    if (refs == NULL)
+        return ERR_DB_FILE;
+    for (int i = 0; i < n; i++) {
+        memset(&out[i], 0, STUDENT_RECORD_SIZE);
+        rc[i] = SRCH_NOT_FOUND;
+        if (ids[i] >= MIN_STD_ID && ids[i] <= db_id_max(h)) {
+            refs[k].id = ids[i];
+            refs[k].i = i;
+            refs[k++].s = &out[i];
+        }
+    }
+    if (k == 0) {
+        free(refs);
+        return 0;
+    }
+    qsort(refs, k, sizeof(batch_ref_t), batch_ref_cmp);
+
+    // Readers share the shards, hold the ones between the lowest and the
+    // highest id for the whole batch
+    off_t start = (off_t)refs[0].id * STUDENT_RECORD_SIZE;
+    off_t len = (off_t)(refs[k - 1].id - refs[0].id + 1) * STUDENT_RECORD_SIZE;
+
+    shard_lock(h, start, len, false);
+    found = db_read_batch(fd, refs, k);
+    for (size_t j = 0; found >= 0 && j < k; j++) {
+        batch_ref_t *r = &refs[j];
+        off_t offset = (off_t)r->id * STUDENT_RECORD_SIZE;
+
+        if (r->rc == ERR_DB_FILE || crc_slot_ok(h, r->id, r->s))
+            continue;
+        // A writer may have been halfway through the record, wait it out
+        range_lock(fd, F_RDLCK, offset, STUDENT_RECORD_SIZE, true);
+        if (read_slot(fd, r->id, r->s) != NO_ERROR)
+            r->rc = ERR_DB_FILE;
+        else if (!crc_slot_ok(h, r->id, r->s))
+            r->rc = ERR_DB_CORRUPT;
+        else
+            r->rc = (r->s->id != 0) ? NO_ERROR : SRCH_NOT_FOUND;
+        range_lock(fd, F_UNLCK, offset, STUDENT_RECORD_SIZE, false);
+        if (r->rc != NO_ERROR)
+            memset(r->s, 0, STUDENT_RECORD_SIZE);
+    }
+    shard_unlock(h, start, len);
+
+    // Retries may have changed which records were found
+    if (found >= 0) {
+        found = 0;
+        for (size_t j = 0; j < k; j++)
+            found += (refs[j].rc == NO_ERROR);
+    }
+
+    for (size_t j = 0; found >= 0 && j < k; j++)
+        rc[refs[j].i] = refs[j].rc;
+    free(refs);
+    return found;
+}
+
+/*
+ *  put_students
+ *      fd:    linux file descriptor
+ *      recs:  the students to add, in any order
+ *      n:     number of students
+ *      rc:    n results, rc[i] is what add_student() would return for
+ *             recs[i]: NO_ERROR, ERR_DB_OP if the id is taken (also by an
+ *             earlier record of the batch), ERR_DB_RANGE or ERR_DB_FILE
+ *
+ *  Adds a batch of students.  The slots between the lowest and highest id
+ *  are locked, the current records read back with db_read_batch() to find
+ *  duplicates, the new records appended to the write ahead log in one
+ *  write and then stored with one ring_write().
+ *
+ *  returns:  <number>       students added
+ *            ERR_DB_FILE    the batch could not be locked, read or logged
+ *
+ *  console:  Does not produce any console I/O
+ */
+int put_students(int fd, const student_t *recs, int n, int *rc)
+{
+    db_handle_t *h = db_handle_find(fd);
+    batch_ref_t *refs = malloc((n > 0 ? n : 1) * sizeof(batch_ref_t));
+    student_t *current = malloc((n > 0 ? n : 1) * STUDENT_RECORD_SIZE);
+    db_wal_rec_t *wal = malloc((n > 0 ? n : 1) * sizeof(db_wal_rec_t));
+    ring_op_t *ops = malloc((n > 0 ? n : 1) * sizeof(ring_op_t));
+    size_t k = 0, a = 0;
+    uint64_t lsn = 0;
+    off_t start = 0, len = 0;
+    int stored = ERR_DB_FILE;
+
+    if (refs == NULL || current == NULL || wal == NULL || ops == NULL)
+        goto out;
+    for (int i = 0; i < n; i++) {
+        rc[i] = ERR_DB_RANGE;
+        if (validate_range(recs[i].id, recs[i].gpa) == NO_ERROR &&
+            recs[i].id <= db_id_max(h)) {
+            refs[k].id = recs[i].id;
+            refs[k].i = i;
+            refs[k].s = &current[k];
+            k++;
+        }
+    }
+    stored = 0;
+    if (k == 0)
+        goto out;
+    qsort(refs, k, sizeof(batch_ref_t), batch_ref_cmp);
+    for (size_t j = 0; j < k; j++)
+        refs[j].s = &current[j];
+
+    start = (off_t)refs[0].id * STUDENT_RECORD_SIZE;
+    len = (off_t)(refs[k - 1].id - refs[0].id + 1) * STUDENT_RECORD_SIZE;
+    if (db_write_begin(h, fd, start, len) != NO_ERROR) {
+        stored = ERR_DB_FILE;
+        goto out;
+    }
+    if (db_read_batch(fd, refs, k) < 0) {
+        for (size_t j = 0; j < k; j++)
+            rc[refs[j].i] = ERR_DB_FILE;
+        stored = ERR_DB_FILE;
+        goto unlock;
+    }
+
+    // Keep the ids that are free, the first of a repeated id wins
+    for (size_t j = 0; j < k; j++) {
+        batch_ref_t *r = &refs[j];
+
+        if (r->rc == SRCH_NOT_FOUND && (j == 0 || r->id != refs[j - 1].id)) {
+            wal_rec_init(&wal[a], r->id, &recs[r->i]);
+            refs[a++] = *r;
+        } else {
+            rc[r->i] = (r->rc == ERR_DB_FILE) ? ERR_DB_FILE : ERR_DB_OP;
+        }
+    }
+    if (a == 0)
+        goto unlock;
+    if (wal_append(h, wal, a, &lsn) != NO_ERROR) {
+        for (size_t j = 0; j < a; j++)
+            rc[refs[j].i] = ERR_DB_FILE;
+        stored = ERR_DB_FILE;
+        goto unlock;
+    }
+
+    // Grow a mapped file once for the highest id, not once per record
+    db_handle_t *m = db_map_find(fd);
+    if (m != NULL && !db_map_has_slot(m, refs[a - 1].id)) {
+        wal_lock(h, WAL_LOCK_GROW, F_WRLCK);
+        db_map_reserve(m, refs[a - 1].id);
+        wal_lock(h, WAL_LOCK_GROW, F_UNLCK);
+    }
+    if (m == NULL) {
+        for (size_t j = 0; j < a; j++) {
+            ops[j].buff = (void *)&recs[refs[j].i];
+            ops[j].len = STUDENT_RECORD_SIZE;
+            ops[j].offset = (off_t)refs[j].id * STUDENT_RECORD_SIZE;
+        }
+        if (ring_write(fd, ops, a) != NO_ERROR) {
+            for (size_t j = 0; j < a; j++)
+                ops[j].res = -ENOMEM;
+        }
+    }
+    for (size_t j = 0; j < a; j++) {
+        const student_t *s = &recs[refs[j].i];
+        bool ok = (m == NULL)
+                  ? ops[j].res == STUDENT_RECORD_SIZE
+                  : db_store_slot(h, fd, refs[j].id, s) == NO_ERROR;
+
+        rc[refs[j].i] = ok ? NO_ERROR : ERR_DB_FILE;
+        if (!ok)
+            continue;
+        if (m == NULL)
+            crc_update(h, refs[j].id, s);
+        bitmap_update(db_bitmap_find(fd), refs[j].id, true);
+        stored++;
+    }
+
+    wal_lock(h, WAL_LOCK_INDEX, F_WRLCK);
+    for (size_t j = 0; j < a; j++) {
+        if (rc[refs[j].i] == NO_ERROR)
+            index_insert(db_index_find(fd), refs[j].id, &recs[refs[j].i]);
+    }
+    wal_lock(h, WAL_LOCK_INDEX, F_UNLCK);
+
+unlock:
+    if (db_write_end(h, fd, start, len, lsn) != NO_ERROR)
+        stored = ERR_DB_FILE;
+out:
+    free(refs);
+    free(current);
+    free(wal);
+    free(ops);
+    return stored;
+}
+
+/*
+ *  find_students
+ *      fd:  linux file descriptor
+ *      in:  stream of ids, one per line (a file or stdin)
+ *
+ *  Batched form of sdbsc -f: looks up every id with one get_students()
+ *  call and prints the students found as one table, in input order,
+ *  followed by a line for each id that was not found.
+ *
+ *  returns:  NO_ERROR       every student was found
+ *            SRCH_NOT_FOUND at least one id was not found
+ *            ERR_DB_CORRUPT at least one record failed its checksum
+ *            ERR_DB_FILE    database file I/O issue or input read error
+ *
+ *  console:  <table>            the students found
+ *            M_STD_NOT_FND_MSG  for each id not found
+ *            M_ERR_STD_CORRUPT  for each id whose record failed its checksum
+ *            M_ERR_BATCH_LINE   a line is not an id, it is skipped
+ *            M_ERR_DB_READ      error reading the database file
+ *            M_ERR_BATCH_INPUT  error reading the input stream
+ */
+int find_students(int fd, FILE *in)
+{
+    int *ids = NULL, *rc = NULL;
+    student_t *out = NULL;
+    print_buf_t *pb;
+    size_t n = 0, cap = 0;
+    char line[64];
+    int line_no = 0;
+    int result = ERR_DB_FILE;
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char *end;
+        long id;
+
+        line_no++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+        id = strtol(line, &end, 10);
+        if (*end != '\0' || id < INT32_MIN || id > INT32_MAX) {
+            printf(M_ERR_BATCH_LINE, line_no);
+            continue;
+        }
+        if (n == cap) {
+            int *grown = realloc(ids, (cap = cap ? cap * 2 : 1024) * sizeof(int));
+
+            if (grown == NULL) {
+                printf(M_ERR_DB_READ);
+                goto out;
+            }
+            ids = grown;
+        }
+        ids[n++] = (int)id;
+    }
+    if (ferror(in)) {
+        printf(M_ERR_BATCH_INPUT);
+        goto out;
+    }
+
+    out = malloc((n > 0 ? n : 1) * STUDENT_RECORD_SIZE);
+    rc = malloc((n > 0 ? n : 1) * sizeof(int));
+    if (out == NULL || rc == NULL || get_students(fd, ids, n, out, rc) < 0) {
+        printf(M_ERR_DB_READ);
+        goto out;
+    }
+
+    pb = print_buf_open(STDOUT_FILENO);
+    if (pb == NULL) {
+        printf(M_ERR_DB_READ);
+        goto out;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (rc[i] == NO_ERROR)
+            print_buf_row(pb, &out[i]);
+    }
+    if (print_buf_close(pb) < 0)
+        goto out;
+
+    result = NO_ERROR;
+    for (size_t i = 0; i < n; i++) {
+        if (rc[i] == ERR_DB_FILE) {
+            printf(M_ERR_DB_READ);
+            result = ERR_DB_FILE;
+            break;
+        }
+        if (rc[i] == SRCH_NOT_FOUND) {
+            printf(M_STD_NOT_FND_MSG, ids[i]);
+            if (result == NO_ERROR)
+                result = SRCH_NOT_FOUND;
+        }
+        if (rc[i] == ERR_DB_CORRUPT) {
+            printf(M_ERR_STD_CORRUPT, ids[i]);
+            result = ERR_DB_CORRUPT;
+        }
+    }
+
+out:
+    free(ids);
+    free(out);
+    free(rc);
+    return result;
+}
+
+/*
+ *  count_db_records
+ *      fd:     linux file descriptor
+ *
+ *  Counts the number of records in the database.  Start by reading the
+ *  database at the beginning, and continue reading individual records
+ *  until you it EOF.  EOF is when the read() syscall returns 0. Check
+ *  if a slot is empty or previously deleted by investigating if all of
+ *  the bytes in the record read are zeros - I would suggest using memory
+ *  compare memcmp() for this. Create a counter variable and initialize it
+ *  to zero, every time a non-zero record is read increment the counter.
+ *
+ *  returns:  <number>       returns the number of records in db on success
+ *            ERR_DB_FILE    database file I/O issue
+ *            ERR_DB_OP      database operation logically failed (aka student
+ *                           not in database)
+ *
+ *
+ *  console:  M_DB_RECORD_CNT  on success, to report the number of students in db
+ *            M_DB_EMPTY       on success if the record count in db is zero
+ *            M_ERR_DB_READ    error reading or seeking the database file
+ *            M_ERR_DB_WRITE   error writing to db file (adding student)
+ *
+ */
+int count_db_records(int fd)
+{
+    int count = 0;
+    ssize_t live;
+    scan_t sc;
+    int threads = scan_threads();
+    db_bitmap_t *bmp = db_bitmap_find(fd);
+
+    // With an occupancy bitmap the count is just a popcount
+    if (bmp != NULL) {
+        count = bitmap_count(bmp);
+        if (count == 0) {
+            printf(M_DB_EMPTY);
+        } else {
+            printf(M_DB_RECORD_CNT, count);
+        }
+        return count;
+    }
+    
+    if (threads > 1) {
+        count = scan_parallel(fd, threads, NULL, NULL, NULL);
+        if (count < 0) {
+            printf(M_ERR_DB_READ);
+            return ERR_DB_FILE;
+        }
+    } else {
+        // Read the allocated extents a block at a time, skipping the holes
+        if (scan_open(&sc, fd) != NO_ERROR) {
+            printf(M_ERR_DB_READ);
+            return ERR_DB_FILE;
+        }
+        while ((live = scan_next_block(&sc)) >= 0) {
+            count += live;
+        }
+        scan_close(&sc);
+        if (sc.err != NO_ERROR) {
+            printf(M_ERR_DB_READ);
+            return ERR_DB_FILE;
+        }
+    }
+    
+    if (count == 0) {
+        printf(M_DB_EMPTY);
+    } else {
+        printf(M_DB_RECORD_CNT, count);
+    }
+    
+    return count;
+}
+
+typedef struct each_walk {
+    student_fn_t fn;
+    void *arg;
+    int count;          // students passed to fn
+} each_walk_t;
+
+//scan_parallel() block_fn of for_each_student()
+static int each_block(scan_t *sc, void *arg)
+{
+    each_walk_t *walk = arg;
+    const student_t *s;
+    size_t slot;
+
+    while ((s = scan_next(sc, &slot)) != NULL) {
+        walk->count++;
+        if (walk->fn(s, walk->arg) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ *  for_each_student
+ *      fd:     linux file descriptor
+ *      fn:     called with every student in the database, in id order
+ *      arg:    passed through to fn
+ *
+ *  Walks the database the cheapest way available: a parallel scan when
+ *  SDB_SCAN_THREADS asks for one, only the used slots when there is an
+ *  occupancy bitmap, otherwise the allocated extents a block at a time.  fn
+ *  is always called on the calling thread.  The walk stops early if fn
+ *  returns non-zero.
+ *
+ *  returns:  <number>       students passed to fn
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *  console:  Does not produce any console I/O
+ */
+int for_each_student(int fd, student_fn_t fn, void *arg)
+{
+    student_t student = {0};
+    const student_t *s;
+    size_t slot;
+    scan_t sc;
+    int count = 0;
+    int threads = scan_threads();
+    db_handle_t *h = db_handle_find(fd);
+    db_bitmap_t *bmp = db_bitmap_find(fd);
+
+    // A parallel scan reads whole blocks, which beats the bitmap's record
+    // at a time walk once there are several readers
+    if (threads > 1) {
+        each_walk_t walk = {fn, arg, 0};
+
+        if (scan_parallel(fd, threads, NULL, each_block, &walk) < 0)
+            return ERR_DB_FILE;
+        return walk.count;
+    }
+
+    // With an occupancy bitmap only the used slots are visited
+    if (bmp != NULL) {
+        for (size_t w = 0; w < DB_BITMAP_WORDS(bmp->slots); w++) {
+            uint64_t word = bmp->bits[w];
+
+            while (word != 0) {
+                size_t slot = w * 64 + __builtin_ctzll(word);
+
+                off_t offset = (off_t)slot * STUDENT_RECORD_SIZE;
+                int rc;
+
+                word &= word - 1;
+                shard_lock(h, offset, STUDENT_RECORD_SIZE, false);
+                rc = read_slot(fd, slot, &student);
+                shard_unlock(h, offset, STUDENT_RECORD_SIZE);
+                if (rc != NO_ERROR)
+                    return ERR_DB_FILE;
+                if (student.id == 0)
+                    continue;
+                count++;
+                if (fn(&student, arg) != 0)
+                    return count;
+            }
+        }
+        return count;
+    }
+
+    // Read the allocated extents a block at a time, skipping the holes
+    if (scan_open(&sc, fd) != NO_ERROR)
+        return ERR_DB_FILE;
+    while ((s = scan_next(&sc, &slot)) != NULL) {
+        count++;
+        if (fn(s, arg) != 0)
+            break;
+    }
+    scan_close(&sc);
+    return (sc.err != NO_ERROR) ? ERR_DB_FILE : count;
+}
+
+/*
+ *  Table output
+ *
+ *  Dumping a big db with printf() spends most of its time parsing the
+ *  format and converting gpa / 100.0 to text.  print_buf_row() formats a
+ *  row by hand instead: the id and the gpa are integers, gpa in hundredths,
+ *  so the digits come from integer division and no float is involved.  The
+ *  text is byte for byte what STUDENT_PRINT_FMT_STRING produces, including
+ *  the %.2f rounding for every gpa up to PRINT_GPA_EXACT, and anything odd
+ *  falls back to snprintf().  Rows are appended to PRINT_BUF_CHUNKS chunks
+ *  of PRINT_BUF_CHUNK bytes, which go out with one writev() when they are
+ *  all full, so a large dump costs a system call per megabyte.
+ */
+#define PRINT_BUF_CHUNK     (64 * 1024)
+#define PRINT_BUF_CHUNKS    16
+#define PRINT_ROW_MAX       128     // longest row print_buf_row() formats
+#define PRINT_GPA_EXACT     999999  // %.2f of gpa / 100.0 matches up to here
+
+struct print_buf {
+    int fd;
+    int rows;               // rows printed, the header comes before the first
+    int err;                // NO_ERROR or ERR_DB_FILE once a write failed
+    int chunk;              // chunk being filled
+    size_t len[PRINT_BUF_CHUNKS];
+    char data[PRINT_BUF_CHUNKS][PRINT_BUF_CHUNK];
+};
+
+static void print_buf_flush(print_buf_t *pb)
+{
+    struct iovec iov[PRINT_BUF_CHUNKS];
+    struct iovec *v = iov;
+    int n = 0;
+
+    for (int i = 0; i <= pb->chunk; i++) {
+        if (pb->len[i] > 0) {
+            iov[n].iov_base = pb->data[i];
+            iov[n++].iov_len = pb->len[i];
+        }
+        pb->len[i] = 0;
+    }
+    pb->chunk = 0;
+
+    while (n > 0 && pb->err == NO_ERROR) {
+        ssize_t done = writev(pb->fd, v, n);
+
+        if (done < 0) {
+            if (errno != EINTR)
+                pb->err = ERR_DB_FILE;
+            continue;
+        }
+        while (n > 0 && (size_t)done >= v->iov_len) {
+            done -= v->iov_len;
+            v++;
+            n--;
+        }
+        if (n > 0) {
+            v->iov_base = (char *)v->iov_base + done;
+            v->iov_len -= done;
+        }
+    }
+}
+
+//Returns room for PRINT_ROW_MAX more bytes, flushing if every chunk is full
+static char *print_buf_reserve(print_buf_t *pb)
+{
+    if (pb->len[pb->chunk] + PRINT_ROW_MAX > PRINT_BUF_CHUNK) {
+        if (pb->chunk + 1 == PRINT_BUF_CHUNKS)
+            print_buf_flush(pb);
+        else
+            pb->chunk++;
+    }
+    return pb->data[pb->chunk] + pb->len[pb->chunk];
+}
+
+//%-<width>.<width>s
+static char *print_name(char *p, const char *name, size_t width)
+{
+    size_t len = strnlen(name, width);
+
+    memcpy(p, name, len);
+    memset(p + len, ' ', width - len);
+    return p + width;
+}
+
+//writes the decimal digits of v, which is not negative
+static char *print_uint(char *p, unsigned v)
+{
+    char digits[10];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+    while (n > 0)
+        *p++ = digits[--n];
+    return p;
+}
+
+/*
+ *  Opens a table on fd.  Anything already printed with printf() is flushed
+ *  first, so it stays ahead of the table.  Returns NULL if out of memory.
+ */
+print_buf_t *print_buf_open(int fd)
+{
+    print_buf_t *pb = malloc(sizeof(print_buf_t));
+
+    if (pb == NULL)
+        return NULL;
+    fflush(stdout);
+    pb->fd = fd;
+    pb->rows = 0;
+    pb->err = NO_ERROR;
+    pb->chunk = 0;
+    memset(pb->len, 0, sizeof(pb->len));
+    return pb;
+}
+
+/*
+ *  Appends s as a row of the table, printing the header before the first
+ *  row.  Returns NO_ERROR, or ERR_DB_FILE once a write has failed.
+ */
+int print_buf_row(print_buf_t *pb, const student_t *s)
+{
+    char *start, *p;
+
+    if (pb->rows++ == 0) {
+        p = print_buf_reserve(pb);
+        pb->len[pb->chunk] += snprintf(p, PRINT_ROW_MAX, STUDENT_PRINT_HDR_STRING,
+                                       "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+    }
+
+    start = p = print_buf_reserve(pb);
+    if (s->id < 0 || s->gpa < 0 || s->gpa > PRINT_GPA_EXACT) {
+        float gpa = s->gpa / 100.0;
+
+        pb->len[pb->chunk] += snprintf(p, PRINT_ROW_MAX, STUDENT_PRINT_FMT_STRING,
+                                       s->id, s->fname, s->lname, gpa);
+        return pb->err;
+    }
+
+    p = print_uint(p, s->id);
+    while (p - start < 6)
+        *p++ = ' ';
+    *p++ = ' ';
+    p = print_name(p, s->fname, sizeof(s->fname));
+    *p++ = ' ';
+    p = print_name(p, s->lname, sizeof(s->lname));
+    *p++ = ' ';
+    p = print_uint(p, s->gpa / 100);
+    *p++ = '.';
+    *p++ = '0' + s->gpa % 100 / 10;
+    *p++ = '0' + s->gpa % 10;
+    *p++ = '\n';
+    pb->len[pb->chunk] += p - start;
+    return pb->err;
+}
+
+/*
+ *  Writes out what is left of the table and frees pb.  Returns the number
+ *  of rows printed, or ERR_DB_FILE if a write failed.
+ */
+int print_buf_close(print_buf_t *pb)
+{
+    int rc;
+
+    print_buf_flush(pb);
+    rc = (pb->err == NO_ERROR) ? pb->rows : ERR_DB_FILE;
+    free(pb);
+    return rc;
+}
+
+static int print_row(const student_t *s, void *arg)
+{
+    return print_buf_row(arg, s) != NO_ERROR;
+}
+
+/*
+ *  print_db
+ *      fd:     linux file descriptor
+ *
+ *  Prints all records in the database.  Start by reading the
+ *  database at the beginning, and continue reading individual records
+ *  until you it EOF.  EOF is when the read() syscall returns 0. Check
+ *  if a slot is empty or previously deleted by investigating if all of
+ *  the bytes in the record read are zeros - I would suggest using memory
+ *  compare memcmp() for this. Be careful as the database might be empty.
+ *  on the first real row encountered print the header for the required output:
+ *
+ *     printf(STUDENT_PRINT_HDR_STRING, "ID",
+ *                  "FIRST_NAME", "LAST_NAME", "GPA");
+ *
+ *  then for each valid record encountered print the required output:
+ *
+ *     printf(STUDENT_PRINT_FMT_STRING, student.id, student.fname,
+ *                    student.lname, calculated_gpa_from_student);
+ *
+ *  The code above assumes you are reading student records into a local
+ *  variable named student that is of type student_t. Also dont forget that
+ *  the GPA in the student structure is an int, to convert it into a real
+ *  gpa divide by 100.0 and store in a float variable.
+ *
+ *  returns:  NO_ERROR       on success
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *
+ *  console:  <see above>      on success, print table or database empty
+ *            M_ERR_DB_READ    error reading or seeking the database file
+ *
+ */
+int print_db(int fd)
+{
+    print_buf_t *pb = print_buf_open(STDOUT_FILENO);
+    int rows;
+
+    if (pb == NULL) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    if (for_each_student(fd, print_row, pb) < 0) {
+        print_buf_close(pb);
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    rows = print_buf_close(pb);
+    if (rows < 0)
+        return ERR_DB_FILE;
+    if (rows == 0) {
+        printf(M_DB_EMPTY);
+    }
+    
+    return NO_ERROR;
+}
+
+/*
+ *  print_student
+ *      *s:   a pointer to a student_t structure that should
+ *            contain a valid student to be printed
+ *
+ *  Start by ensuring that provided student pointer is valid.  To do this
+ *  make sure it is not NULL and that s->id is not zero.  After ensuring
+ *  that the student is valid, print it the exact way that is described
+ *  in the print_db() function by first printing the header then the
+ *  student data:
+ *
+ *     printf(STUDENT_PRINT_HDR_STRING, "ID",
+ *                  "FIRST NAME", "LAST_NAME", "GPA");
+ *
+ *     printf(STUDENT_PRINT_FMT_STRING, s->id, s->fname,
+ *                    student.lname, calculated_gpa_from_s);
+ *
+ *  Dont forget that  the GPA in the student structure is an int, to convert
+ *  it into a real gpa divide by 100.0 and store in a float variable.
+ *
+ *  returns:  nothing, this is a void function
+ *
+ *
+ *  console:  <see above>      on success, print table or database empty
+ *            M_ERR_STD_PRINT  if the function argument s is NULL or if
+ *                             s->id is zero
+ *
+ */
+void print_student(student_t *s)
+{
+    if (s == NULL || s->id == 0) {
+        printf(M_ERR_STD_PRINT);
+        return;
+    }
+    
+    printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+    float gpa = s->gpa / 100.0;
+    printf(STUDENT_PRINT_FMT_STRING, s->id, s->fname, s->lname, gpa);
+}
+
+/*
+ *  NOTE IMPLEMENTING THIS FUNCTION IS EXTRA CREDIT
+ *
+ *  compress_db
+ *      fd:     linux file descriptor
+ *
+ *  This assignment takes advantage of the way Linux handles sparse files
+ *  on disk. Thus if there is a large hole between student records, Linux
+ *  will not use any physical storage.  However, when a database record is
+ *  deleted storage is used to write a blank - see EMPTY_STUDENT_RECORD from
+ *  db.h - record.
+ *
+ *  Since Linux provides no way to delete data in the middle of a file, and
+ *  deleted records take up physical storage, this function will compress the
+ *  database by rewriting a new database file that only includes valid student
+ *  records. There are a number of ways to do this, but since this is extra credit
+ *  you need to figure this out on your own.
+ *
+ *  At a high level create a temporary database file then copy all valid students from
+ *  the active database (passed in via fd) to the temporary file. When this is done
+ *  rename the temporary database file to the name of the real database file. See
+ *  the constants in db.h for required file names:
+ *
+ *         #define DB_FILE     "student.db"        //name of database file
+ *         #define TMP_DB_FILE ".tmp_student.db"   //for extra credit
+ *
+ *  Note that you are passed in the fd of the database file to be compressed,
+ *  it is very likely you will need to close it to overwrite it with the
+ *  compressed version of the file.  To ensure the caller can work with the
+ *  compressed file after you create it, it is a good design to return the fd
+ *  of the new compressed file from this function
+ *
+ *  returns:  <number>       returns the fd of the compressed database file
+ *            ERR_DB_FILE    database file I/O issue
+ *
+ *
+ *  console:  M_DB_COMPRESSED_OK  on success, the db was successfully compressed.
+ *            M_ERR_DB_OPEN    error when opening/creating temporary database file.
+ *                             this error should also be returned after you
+ *                             compressed the database file and if you are unable
+ *                             to open it to pass the fd back to the caller
+ *            M_ERR_DB_CREATE  error creating the db file. For instance the
+ *                             inability to copy the temporary file back as
+ *                             the primary database file.
+ *            M_ERR_DB_BUSY    another process has the db open
+ *            M_ERR_DB_READ    error reading or seeking the the db or tempdb file
+ *            M_ERR_DB_WRITE   error writing to db or tempdb file (adding student)
+ *
+ */
+//scan_parallel() part_fn of compress_db(), arg is the temporary file's fd
+static int compress_part(scan_t *sc, size_t rank, void *arg)
+{
+    int tmp_fd = *(int *)arg;
+    const student_t *s;
+    size_t slot;
+    size_t n = 0;
+
+    // Pack the live records at the front of the buffer, they only move down
+    while ((s = scan_next(sc, &slot)) != NULL)
+        sc->buff[n++] = *s;
+    if (n == 0)
+        return NO_ERROR;
+    // rank records are ahead of these, after the header in slot 0
+    if (write_all_at(tmp_fd, sc->buff, n * STUDENT_RECORD_SIZE,
+                     (off_t)(rank + 1) * STUDENT_RECORD_SIZE) != NO_ERROR)
+        return ERR_DB_OP;
+    return NO_ERROR;
+}
+
+int compress_db(int fd)
+{
+    const student_t *s;
+    size_t slot;
+    scan_t sc;
+    int tmp_fd;
+    int threads = scan_threads();
+    off_t curr_pos = STUDENT_RECORD_SIZE;  // after the header
+    const char *sidecars[] = {DB_BITMAP_EXT, DB_INDEX_EXT, DB_CRC_EXT};
+    char side_file[512], tmp_side_file[512];
+    db_handle_t *h = db_handle_find(fd);
+
+    // The packed file replaces the db, other processes would carry on
+    // with the old one through their descriptors and mappings
+    if (h != NULL && h->wal_fd >= 0 &&
+        range_lock(h->wal_fd, F_WRLCK, WAL_LOCK_OPEN, 1, false) != NO_ERROR) {
+        printf(M_ERR_DB_BUSY);
+        return ERR_DB_FILE;
+    }
+
+    // Records move, so nothing may be left in the log that names a slot
+    if (wal_checkpoint(h, true) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    // Create temporary database file with the same id range
+    tmp_fd = db_open(TMP_DB_FILE, true, db_id_max(db_handle_find(fd)));
+    if (tmp_fd < 0) {
+        printf(M_ERR_DB_OPEN);
+        return ERR_DB_FILE;
+    }
+    
+    if (threads > 1) {
+        // Each part is written straight to its place in the packed file,
+        // the bitmap is filled in afterwards
+        int packed = scan_parallel(fd, threads, compress_part, NULL, &tmp_fd);
+
+        if (packed < 0) {
+            printf(packed == ERR_DB_OP ? M_ERR_DB_WRITE : M_ERR_DB_READ);
+            close_db(tmp_fd);
+            return ERR_DB_FILE;
+        }
+        for (int i = 1; i <= packed; i++)
+            bitmap_update(db_bitmap_find(tmp_fd), i, true);
+    } else {
+        // Copy non-deleted records to temporary file, reading only the
+        // allocated extents of the original
+        if (scan_open(&sc, fd) != NO_ERROR) {
+            printf(M_ERR_DB_READ);
+            close_db(tmp_fd);
+            return ERR_DB_FILE;
+        }
+        while ((s = scan_next(&sc, &slot)) != NULL) {
+            if (write_all_at(tmp_fd, s, STUDENT_RECORD_SIZE, curr_pos) != NO_ERROR) {
+                printf(M_ERR_DB_WRITE);
+                scan_close(&sc);
+                close_db(tmp_fd);
+                return ERR_DB_FILE;
+            }
+            bitmap_update(db_bitmap_find(tmp_fd),
+                          curr_pos / STUDENT_RECORD_SIZE, true);
+            curr_pos += STUDENT_RECORD_SIZE;
+        }
+        scan_close(&sc);
+        if (sc.err != NO_ERROR) {
+            printf(M_ERR_DB_READ);
+            close_db(tmp_fd);
+            return ERR_DB_FILE;
+        }
+    }
+
+    // Every record moved, so index and sum the compressed file's slots
+    db_index_t *tmp_ix = db_index_find(tmp_fd);
+    if (tmp_ix != NULL)
+        index_rebuild(tmp_ix, tmp_ix->capacity, tmp_fd);
+    db_crc_t *tmp_crc = db_crc_find(tmp_fd);
+    if (tmp_crc != NULL)
+        crc_rebuild(tmp_crc, tmp_crc->slots, tmp_fd);
+    
+    // Close both files, the temporary file's log was emptied on close
+    close_db(fd);
+    close_db(tmp_fd);
+    sidecar_path(tmp_side_file, sizeof(tmp_side_file), TMP_DB_FILE, DB_WAL_EXT);
+    unlink(tmp_side_file);
+    
+    // Replace original with compressed version
+    if (rename(TMP_DB_FILE, DB_FILE) < 0) {
+        printf(M_ERR_DB_CREATE);
+        return ERR_DB_FILE;
+    }
+
+    // The temporary file's sidecars now describe the db.  If a rename
+    // fails the stale sidecar is rebuilt when the db is reopened below.
+    for (size_t i = 0; i < sizeof(sidecars) / sizeof(sidecars[0]); i++) {
+        sidecar_path(side_file, sizeof(side_file), DB_FILE, sidecars[i]);
+        sidecar_path(tmp_side_file, sizeof(tmp_side_file), TMP_DB_FILE, sidecars[i]);
+        rename(tmp_side_file, side_file);
+    }
+    
+    // Reopen compressed database
+    fd = open_db(DB_FILE, false);
+    if (fd < 0) {
+        printf(M_ERR_DB_OPEN);
+        return ERR_DB_FILE;
+    }
+    
+    printf(M_DB_COMPRESSED_OK);
+    return fd;
+}
+
+/*
+ *  compact_db
+ *      fd:          linux file descriptor
+ *      max_blocks:  number of filesystem blocks to examine in this run, or 0
+ *                   to go through the whole file
+ *
+ *  Incremental, in place alternative to compress_db().  Deleted records are
+ *  zero filled, and once a whole filesystem block of the file is zeros its
+ *  storage is handed back with fallocate(FALLOC_FL_PUNCH_HOLE).  Reading a
+ *  hole returns zeros, so the contents of the file do not change at all and
+ *  every record stays at id * STUDENT_RECORD_SIZE.
+ *
+ *  The file is processed in batches of COMPACT_BATCH_BLOCKS.  Each batch is
+ *  write locked with an OFD lock, so writers that lock their record see
+ *  either the old block or the hole, never a block that is punched after
+ *  they wrote to it.  Blocks with a live bit in the occupancy bitmap are
+ *  skipped without being read, every other block is checked to be all zeros
+ *  before it is punched.  Since punching a zero block changes nothing,
+ *  stopping at any point is safe.  After each batch the position is saved
+ *  in the bitmap sidecar, and a later run resumes there.
+ *
+ *  returns:  <number>       blocks reclaimed by this run
+ *            ERR_DB_FILE    database file I/O issue, or no hole punching
+ *
+ *  console:  M_DB_COMPACT_OK    the whole file has been compacted
+ *            M_DB_COMPACT_PART  stopped after max_blocks, will resume
+ *            M_ERR_DB_COMPACT   the filesystem cannot punch holes
+ *            M_ERR_DB_READ      error reading the database file
+ */
+#define COMPACT_BATCH_BLOCKS 256
+
+int compact_db(int fd, int max_blocks)
+{
+    db_bitmap_t *bmp = db_bitmap_find(fd);
+    db_index_t *ix = db_index_find(fd);
+    struct stat st;
+    char *block = NULL;
+    char *zeros = NULL;
+    off_t blk, start, end;
+    off_t next_block;
+    int reclaimed = 0;
+    int examined = 0;
+    int rc = NO_ERROR;
+
+    if (fstat(fd, &st) < 0) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    blk = st.st_blksize;
+    if (blk <= 0 || blk % STUDENT_RECORD_SIZE != 0)
+        blk = 4096;
+    block = malloc(blk);
+    zeros = calloc(1, blk);
+    if (block == NULL || zeros == NULL) {
+        free(block);
+        free(zeros);
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    next_block = (bmp != NULL) ? bmp->compact_cursor : 0;
+    if (next_block * blk >= st.st_size)
+        next_block = 0;
+
+    while (rc == NO_ERROR &&
+           next_extent(fd, next_block * blk, st.st_size, &start, &end)) {
+        off_t first = (start + blk - 1) / blk;   // whole blocks only
+        off_t last = end / blk;
+
+        if (first < next_block)
+            first = next_block;
+        next_block = first;
+
+        while (next_block < last) {
+            off_t batch_end = next_block + COMPACT_BATCH_BLOCKS;
+
+            if (batch_end > last)
+                batch_end = last;
+            if (max_blocks > 0 && batch_end - next_block > max_blocks - examined)
+                batch_end = next_block + (max_blocks - examined);
+
+            if (range_lock(fd, F_WRLCK, next_block * blk,
+                           (batch_end - next_block) * blk, true) != NO_ERROR) {
+                rc = ERR_DB_FILE;
+                break;
+            }
+
+            for (off_t b = next_block; b < batch_end; b++) {
+                size_t slot = b * blk / STUDENT_RECORD_SIZE;
+                size_t per_block = blk / STUDENT_RECORD_SIZE;
+                bool live = false;
+
+                // the bitmap answers for most blocks without any I/O
+                for (size_t i = 0; bmp != NULL && i < per_block && !live; i++) {
+                    size_t bit = slot + i;
+                    live = bit < bmp->slots &&
+                           ((bmp->bits[bit / 64] >> (bit % 64)) & 1);
+                }
+                if (live)
+                    continue;
+                if (pread(fd, block, blk, b * blk) != blk) {
+                    rc = ERR_DB_FILE;
+                    break;
+                }
+                if (memcmp(block, zeros, blk) != 0)
+                    continue;
+                if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                              b * blk, blk) < 0) {
+                    rc = (errno == EOPNOTSUPP) ? ERR_DB_OP : ERR_DB_FILE;
+                    break;
+                }
+                reclaimed++;
+            }
+
+            range_lock(fd, F_UNLCK, next_block * blk,
+                       (batch_end - next_block) * blk, false);
+            if (rc != NO_ERROR)
+                break;
+
+            examined += batch_end - next_block;
+            next_block = batch_end;
+            if (bmp != NULL)
+                bmp->compact_cursor = next_block;
+            if (max_blocks > 0 && examined >= max_blocks)
+                break;
+        }
+        if (max_blocks > 0 && examined >= max_blocks)
+            break;
+
+        // a partial block at the end of the extent cannot be punched
+        if (next_block < (end + blk - 1) / blk)
+            next_block = (end + blk - 1) / blk;
+    }
+
+    free(block);
+    free(zeros);
+
+    // Punching holes bumps the mtime, restamp the sidecars on close
+    if (reclaimed > 0) {
+        if (bmp != NULL)
+            stamp_dirty(&bmp->stamp);
+        if (ix != NULL)
+            stamp_dirty(&ix->stamp);
+    }
+
+    if (rc == ERR_DB_OP) {
+        printf(M_ERR_DB_COMPACT);
+        return ERR_DB_FILE;
+    }
+    if (rc != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    if (max_blocks > 0 && examined >= max_blocks && next_block * blk < st.st_size) {
+        printf(M_DB_COMPACT_PART, reclaimed,
+               (int)(next_block * blk / STUDENT_RECORD_SIZE));
+    } else {
+        if (bmp != NULL)
+            bmp->compact_cursor = 0;
+        printf(M_DB_COMPACT_OK, reclaimed);
+    }
+    return reclaimed;
+}
+
+/*
+ *  parse_batch_line
+ *      line:   one line of text input
+ *      *s:     student record to fill in
+ *
+ *  Parses "id,first_name,last_name,gpa".  Commas, spaces and tabs are all
+ *  accepted as separators so the same arguments used with -a work as well.
+ *
+ *  returns:  1 if a student was parsed, 0 for blank and comment (#) lines,
+ *            -1 if the line is malformed
+ */
+static int parse_batch_line(char *line, student_t *s)
+{
+    const char *seps = ", \t\r\n";
+    char *fields[4];
+    char *saveptr;
+    char *end;
+    long id, gpa;
+    int n = 0;
+
+    for (char *tok = strtok_r(line, seps, &saveptr); tok != NULL;
+         tok = strtok_r(NULL, seps, &saveptr)) {
+        if (n == 0 && *tok == '#')
+            return 0;
+        if (n == 4)
+            return -1;
+        fields[n++] = tok;
+    }
+
+    if (n == 0)
+        return 0;
+    if (n != 4)
+        return -1;
+
+    // range checked as a long, a cast first could wrap into a valid id
+    id = strtol(fields[0], &end, 10);
+    if (*end != '\0' || id < INT32_MIN || id > INT32_MAX)
+        return -1;
+    gpa = strtol(fields[3], &end, 10);
+    if (*end != '\0' || gpa < INT32_MIN || gpa > INT32_MAX)
+        return -1;
+
+    memset(s, 0, STUDENT_RECORD_SIZE);
+    s->id = (int)id;
+    s->gpa = (int)gpa;
+    strncpy(s->fname, fields[1], sizeof(s->fname) - 1);
+    strncpy(s->lname, fields[2], sizeof(s->lname) - 1);
+    return 1;
+}
+
+/*
+ *  What batch_load() does with each input row, kept until the duplicates
+ *  are known so the messages come out in input order
+ */
+#define BATCH_ROW_NEW       0   // free id, loaded
+#define BATCH_ROW_MALFORMED 1   // text line that does not parse
+#define BATCH_ROW_LONG      2   // text line longer than the line buffer
+#define BATCH_ROW_RANGE     3   // id or gpa out of range
+#define BATCH_ROW_DUP       4   // id already in the db or earlier in the input
+
+typedef struct batch_row {
+    student_t s;
+    int line;           // input line, 0 for binary input
+    int state;          // BATCH_ROW_*
+} batch_row_t;
+
+/*
+ *  batch_load
+ *      fd:      linux file descriptor
+ *      in:      stream the students are read from (a file or stdin)
+ *      binary:  true if the input is raw student_t records, false if it is
+ *               text with one "id,first_name,last_name,gpa" per line
+ *
+ *  Loads many students in one process.  The whole input is read and every
+ *  record validated with validate_range() first.  The valid ids are then
+ *  sorted like a put_students() batch, the slots between the lowest and
+ *  the highest of them are write locked and only the slots the input names
+ *  are read back with db_read_batch() to find duplicates.  Each run of
+ *  adjacent new slots is written with one pwrite(), so a dense load of
+ *  every id is a single large write instead of one process and four
+ *  syscalls per student, and a small load of a large db only touches the
+ *  records it adds.
+ *
+ *  The slots stay locked from the duplicate check until the writes, so
+ *  concurrent loaders and add_student() calls take turns rather than both
+ *  passing the check.  The new records are appended to the write ahead log
+ *  in one write and committed with one fdatasync().
+ *
+ *  returns:  NO_ERROR       all students were loaded
+ *            ERR_DB_FILE    database file I/O issue or input read error
+ *            ERR_DB_OP      at least one student was rejected, the valid
+ *                           students are still loaded
+ *
+ *  console:  M_BATCH_LOADED    summary on completion
+ *            M_ERR_BATCH_LINE  a text line could not be parsed
+ *            M_ERR_BATCH_LONG  a text line is longer than the line buffer
+ *            M_ERR_BATCH_RNG   ID or GPA out of allowable range
+ *            M_ERR_DB_ADD_DUP  student already exists
+ *            M_ERR_DB_READ     error reading the database file
+ *            M_ERR_DB_WRITE    error writing to db file
+ *            M_ERR_BATCH_INPUT error reading the input stream
+ */
+int batch_load(int fd, FILE *in, bool binary)
+{
+    db_handle_t *h = db_handle_find(fd);
+    batch_row_t *rows = NULL;
+    batch_ref_t *refs = NULL;
+    student_t *current = NULL;
+    student_t *image = NULL;
+    db_wal_rec_t *recs = NULL;
+    size_t nrows = 0, cap = 0, k = 0, a = 0;
+    uint64_t lsn = 0;
+    off_t start = 0, len = 0;
+    bool locked = false;
+    char line[256];
+    int line_no = 0;
+    int loaded = 0;
+    int rejected = 0;
+    int rc = NO_ERROR;
+
+    while (true) {
+        batch_row_t *r;
+        int parsed = 1;
+
+        if (nrows == cap) {
+            batch_row_t *grown = realloc(rows, (cap = cap ? cap * 2 : 1024) * sizeof(*rows));
+
+            if (grown == NULL) {
+                printf(M_ERR_DB_READ);
+                rc = ERR_DB_FILE;
+                goto out;
+            }
+            rows = grown;
+        }
+        r = &rows[nrows];
+        r->line = 0;
+        r->state = BATCH_ROW_NEW;
+
+        if (binary) {
+            if (fread(&r->s, STUDENT_RECORD_SIZE, 1, in) != 1)
+                break;
+            // the names are C strings everywhere else, whatever the input
+            r->s.fname[sizeof(r->s.fname) - 1] = '\0';
+            r->s.lname[sizeof(r->s.lname) - 1] = '\0';
+        } else {
+            if (fgets(line, sizeof(line), in) == NULL)
+                break;
+            r->line = ++line_no;
+            if (strchr(line, '\n') == NULL && !feof(in)) {
+                // too long for the buffer, skip the rest of it rather than
+                // read it as another line
+                int c;
+
+                while ((c = getc(in)) != EOF && c != '\n')
+                    ;
+                r->state = BATCH_ROW_LONG;
+                nrows++;
+                continue;
+            }
+            parsed = parse_batch_line(line, &r->s);
+        }
+
+        if (parsed == 0)
+            continue;
+        if (parsed < 0)
+            r->state = BATCH_ROW_MALFORMED;
+        else if (validate_range(r->s.id, r->s.gpa) != NO_ERROR ||
+                 r->s.id > db_id_max(h))
+            r->state = BATCH_ROW_RANGE;
+        nrows++;
+    }
+
+    if (ferror(in)) {
+        printf(M_ERR_BATCH_INPUT);
+        rc = ERR_DB_FILE;
+        goto out;
+    }
+
+    for (size_t i = 0; i < nrows; i++)
+        k += (rows[i].state == BATCH_ROW_NEW);
+    refs = malloc((k > 0 ? k : 1) * sizeof(batch_ref_t));
+    current = malloc((k > 0 ? k : 1) * STUDENT_RECORD_SIZE);
+    image = malloc((k > 0 ? k : 1) * STUDENT_RECORD_SIZE);
+    recs = malloc((k > 0 ? k : 1) * sizeof(db_wal_rec_t));
+    if (refs == NULL || current == NULL || image == NULL || recs == NULL) {
+        printf(M_ERR_DB_READ);
+        rc = ERR_DB_FILE;
+        goto out;
+    }
+    k = 0;
+    for (size_t i = 0; i < nrows; i++) {
+        if (rows[i].state == BATCH_ROW_NEW) {
+            refs[k].id = rows[i].s.id;
+            refs[k++].i = (int)i;
+        }
+    }
+
+    if (k > 0) {
+        qsort(refs, k, sizeof(batch_ref_t), batch_ref_cmp);
+        for (size_t j = 0; j < k; j++)
+            refs[j].s = &current[j];
+
+        start = (off_t)refs[0].id * STUDENT_RECORD_SIZE;
+        len = (off_t)(refs[k - 1].id - refs[0].id + 1) * STUDENT_RECORD_SIZE;
+        if (db_write_begin(h, fd, start, len) != NO_ERROR) {
+            printf(M_ERR_DB_WRITE);
+            rc = ERR_DB_FILE;
+            goto out;
+        }
+        locked = true;
+        if (db_read_batch(fd, refs, k) < 0) {
+            printf(M_ERR_DB_READ);
+            rc = ERR_DB_FILE;
+            goto out;
+        }
+    }
+
+    // Keep the ids that are free, the first of a repeated id wins
+    for (size_t j = 0; j < k; j++) {
+        batch_ref_t *r = &refs[j];
+
+        if (r->rc == ERR_DB_FILE) {
+            printf(M_ERR_DB_READ);
+            rc = ERR_DB_FILE;
+            goto out;
+        }
+        if (r->rc != SRCH_NOT_FOUND || (j > 0 && r->id == refs[j - 1].id)) {
+            rows[r->i].state = BATCH_ROW_DUP;
+        } else {
+            image[a] = rows[r->i].s;
+            wal_rec_init(&recs[a], r->id, &image[a]);
+            refs[a++] = *r;
+        }
+    }
+
+    for (size_t i = 0; i < nrows; i++) {
+        switch (rows[i].state) {
+        case BATCH_ROW_NEW:
+            loaded++;
+            continue;
+        case BATCH_ROW_MALFORMED:
+            printf(M_ERR_BATCH_LINE, rows[i].line);
+            break;
+        case BATCH_ROW_LONG:
+            printf(M_ERR_BATCH_LONG, rows[i].line, (int)sizeof(line) - 2);
+            break;
+        case BATCH_ROW_RANGE:
+            printf(M_ERR_BATCH_RNG, rows[i].s.id);
+            break;
+        default:
+            printf(M_ERR_DB_ADD_DUP, rows[i].s.id);
+            break;
+        }
+        rejected++;
+    }
+
+    // Log every new record with a single append before storing any of them
+    if (a > 0 && wal_append(h, recs, a, &lsn) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        rc = ERR_DB_FILE;
+        goto out;
+    }
+
+    // Coalesce adjacent new slots so each contiguous run is one write
+    for (size_t j = 0, run_end; j < a; j = run_end) {
+        for (run_end = j + 1;
+             run_end < a && refs[run_end].id == refs[run_end - 1].id + 1;
+             run_end++)
+            ;
+        if (write_all_at(fd, &image[j], (run_end - j) * STUDENT_RECORD_SIZE,
+                         (off_t)refs[j].id * STUDENT_RECORD_SIZE) != NO_ERROR) {
+            printf(M_ERR_DB_WRITE);
+            rc = ERR_DB_FILE;
+            goto out;
+        }
+        for (size_t t = j; t < run_end; t++) {
+            bitmap_update(db_bitmap_find(fd), refs[t].id, true);
+            crc_update(h, refs[t].id, &image[t]);
+        }
+    }
+
+    // Link the new names into the index under one hold of its lock
+    db_index_t *ix = db_index_find(fd);
+    wal_lock(h, WAL_LOCK_INDEX, F_WRLCK);
+    if (ix != NULL) {
+        for (size_t j = 0; j < a; j++)
+            index_insert(ix, refs[j].id, &image[j]);
+    }
+    wal_lock(h, WAL_LOCK_INDEX, F_UNLCK);
+
+    printf(M_BATCH_LOADED, loaded, rejected);
+    if (rejected > 0)
+        rc = ERR_DB_OP;
+
+out:
+    if (locked && db_write_end(h, fd, start, len, lsn) != NO_ERROR &&
+        rc != ERR_DB_FILE) {
+        printf(M_ERR_DB_WRITE);
+        rc = ERR_DB_FILE;
+    }
+    free(rows);
+    free(refs);
+    free(current);
+    free(image);
+    free(recs);
+    return rc;
+}
+
+/*
+ *  Checksums
+ *
+ *  verify_db() checks every slot against the checksum sidecar in two
+ *  passes.  The first reads the file with the block scan, or the parallel
+ *  scan with SDB_SCAN_THREADS, sums whole blocks with record_sums() and
+ *  compares them with the stored sums without taking any record locks, so
+ *  it runs at the speed of the scan.  Slots in holes and past EOF read as
+ *  empty and must have a sum of 0.  A slot that fails may only have been
+ *  caught in the middle of a write, so the second pass looks at each one
+ *  again under its lock before reporting it.
+ *
+ *  A repair clears the slot through the normal write path, so the change
+ *  is logged and the bitmap, index and sum follow it.  The record is lost,
+ *  but the db no longer hands out a half written student.
+ */
+typedef struct crc_check {
+    const db_crc_t *crc;
+    int32_t *suspects;      // slots that failed the first pass
+    size_t count;
+    size_t cap;
+    bool failed;            // out of memory
+    pthread_mutex_t lock;
+} crc_check_t;
+
+static void crc_suspect(crc_check_t *cc, size_t slot)
+{
+    pthread_mutex_lock(&cc->lock);
+    if (cc->count == cc->cap) {
+        size_t cap = (cc->cap > 0) ? cc->cap * 2 : 64;
+        int32_t *grown = realloc(cc->suspects, cap * sizeof(int32_t));
+
+        if (grown == NULL) {
+            cc->failed = true;
+            pthread_mutex_unlock(&cc->lock);
+            return;
+        }
+        cc->suspects = grown;
+        cc->cap = cap;
+    }
+    cc->suspects[cc->count++] = slot;
+    pthread_mutex_unlock(&cc->lock);
+}
+
+static void crc_check_block(crc_check_t *cc, const student_t *r, size_t n,
+                            size_t first)
+{
+    uint32_t sums[SCAN_BLOCK_RECORDS];
+    size_t slots = cc->crc->slots;
+
+    if (first >= slots)
+        return;
+    if (n > slots - first)
+        n = slots - first;
+    record_sums(r, n, sums);
+    for (size_t i = 0; i < n; i++) {
+        if (sums[i] != __atomic_load_n(&cc->crc->sums[first + i],
+                                       __ATOMIC_RELAXED) &&
+            first + i >= MIN_STD_ID)
+            crc_suspect(cc, first + i);
+    }
+}
+
+//scan_parallel() callback, checks a part on the worker that read it
+static int crc_check_part(scan_t *sc, size_t rank, void *arg)
+{
+    (void)rank;
+    crc_check_block(arg, sc->buff, sc->count, sc->first_slot);
+    return NO_ERROR;
+}
+
+//slots [lo, hi) hold no data, so their sums must be 0
+static void crc_check_empty(crc_check_t *cc, size_t lo, size_t hi)
+{
+    if (lo < MIN_STD_ID)
+        lo = MIN_STD_ID;
+    if (hi > cc->crc->slots)
+        hi = cc->crc->slots;
+    for (size_t slot = lo; slot < hi; slot++) {
+        if (__atomic_load_n(&cc->crc->sums[slot], __ATOMIC_RELAXED) != 0)
+            crc_suspect(cc, slot);
+    }
+}
+
+static int crc_check_holes(crc_check_t *cc, int fd)
+{
+    off_t pos = 0, start, end;
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+        return ERR_DB_FILE;
+    while (next_extent(fd, pos, st.st_size, &start, &end)) {
+        if (start > pos)
+            crc_check_empty(cc, pos / STUDENT_RECORD_SIZE,
+                            start / STUDENT_RECORD_SIZE);
+        pos = end;
+    }
+    crc_check_empty(cc, (pos + STUDENT_RECORD_SIZE - 1) / STUDENT_RECORD_SIZE,
+                    cc->crc->slots);
+    return NO_ERROR;
+}
+
+static int crc_slot_cmp(const void *a, const void *b)
+{
+    int32_t x = *(const int32_t *)a;
+    int32_t y = *(const int32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ *  Second pass for one slot: reads it again under its lock.  With repair
+ *  the lock is the write lock and a corrupt slot is cleared, along with its
+ *  index entry, which is found by slot since the names read back are not
+ *  to be trusted.  Returns 1 if the slot is corrupt, 0 if it turned out
+ *  fine, or ERR_DB_FILE.
+ */
+static int crc_confirm(int fd, size_t slot, bool repair)
+{
+    db_handle_t *h = db_handle_find(fd);
+    off_t offset = (off_t)slot * STUDENT_RECORD_SIZE;
+    student_t student;
+    uint64_t lsn = 0;
+    int rc;
+
+    if (repair) {
+        if (db_write_begin(h, fd, offset, STUDENT_RECORD_SIZE) != NO_ERROR)
+            return ERR_DB_FILE;
+    } else {
+        shard_lock(h, offset, STUDENT_RECORD_SIZE, false);
+        range_lock(fd, F_RDLCK, offset, STUDENT_RECORD_SIZE, true);
+    }
+
+    rc = read_slot(fd, slot, &student);
+    if (rc == NO_ERROR)
+        rc = crc_slot_ok(h, slot, &student) ? 0 : 1;
+    if (rc == 1 && repair) {
+        if (db_write_slot(h, fd, slot, &EMPTY_STUDENT_RECORD, &lsn) != NO_ERROR) {
+            rc = ERR_DB_FILE;
+        } else {
+            bitmap_update(db_bitmap_find(fd), slot, false);
+            wal_lock(h, WAL_LOCK_INDEX, F_WRLCK);
+            index_remove(db_index_find(fd), slot);
+            wal_lock(h, WAL_LOCK_INDEX, F_UNLCK);
+        }
+    }
+
+    if (repair) {
+        if (db_write_end(h, fd, offset, STUDENT_RECORD_SIZE, lsn) != NO_ERROR)
+            rc = ERR_DB_FILE;
+    } else {
+        range_lock(fd, F_UNLCK, offset, STUDENT_RECORD_SIZE, false);
+        shard_unlock(h, offset, STUDENT_RECORD_SIZE);
+    }
+    return rc;
+}
+
+/*
+ *  verify_db
+ *      fd:      linux file descriptor
+ *      repair:  clear the slots that fail their checksum
  *
+ *  Checks every slot of the db against its checksum, see "Checksums"
+ *  above, and reports each one that fails.
  *
- *  console:  M_STD_ADDED       on success
- *            M_ERR_DB_ADD_DUP  student already exists
- *            M_ERR_DB_READ     error reading or seeking the database file
- *            M_ERR_DB_WRITE    error writing to db file (adding student)
+ *  returns:  <number>       slots that failed their checksum, repaired or
+ *                           not
+ *            ERR_DB_FILE    database file I/O issue, or the db has no
+ *                           checksums
  *
+ *  console:  M_CRC_BAD or M_CRC_CLEARED for every slot that fails
+ *            M_CRC_VERIFIED when done
+ *            M_ERR_CRC_NONE if the checksum sidecar could not be opened
+ *            M_ERR_DB_READ / M_ERR_DB_WRITE on error
  */
-int add_student(int fd, int id, char *fname, char *lname, int gpa) {
-    student_t new_student = {0};
-    off_t offset;
-    ssize_t bytes_written;
-    student_t temp = {0};
-    
-    // Calculate offset for this student
-    offset = (off_t)id * STUDENT_RECORD_SIZE;
-    
-    // Seek to the position
-    if (lseek(fd, offset, SEEK_SET) < 0) {
-        printf(M_ERR_DB_READ);
+int verify_db(int fd, bool repair)
+{
+    crc_check_t cc = {.crc = db_crc_find(fd)};
+    int threads = scan_threads();
+    int bad = 0, rc = NO_ERROR;
+    scan_t sc;
+
+    if (cc.crc == NULL) {
+        printf(M_ERR_CRC_NONE);
         return ERR_DB_FILE;
     }
-    
-    // Read to check if student exists
-    if (read(fd, &temp, STUDENT_RECORD_SIZE) > 0 && temp.id != 0) {
-        printf(M_ERR_DB_ADD_DUP, id);
-        return ERR_DB_OP;
+    pthread_mutex_init(&cc.lock, NULL);
+
+    if (threads > 1) {
+        if (scan_parallel(fd, threads, crc_check_part, NULL, &cc) < 0)
+            rc = ERR_DB_FILE;
+    } else if (scan_open(&sc, fd) != NO_ERROR) {
+        rc = ERR_DB_FILE;
+    } else {
+        while (scan_next_block(&sc) >= 0)
+            crc_check_block(&cc, sc.buff, sc.count, sc.first_slot);
+        scan_close(&sc);
+        rc = sc.err;
     }
-    
-    // Initialize new student record
-    new_student.id = id;
-    new_student.gpa = gpa;
-    strncpy(new_student.fname, fname, sizeof(new_student.fname)-1);
-    strncpy(new_student.lname, lname, sizeof(new_student.lname)-1);
-    
-    // Go back to write position
-    if (lseek(fd, offset, SEEK_SET) < 0) {
+    if (rc == NO_ERROR)
+        rc = crc_check_holes(&cc, fd);
+    if (rc != NO_ERROR || cc.failed) {
         printf(M_ERR_DB_READ);
+        pthread_mutex_destroy(&cc.lock);
+        free(cc.suspects);
         return ERR_DB_FILE;
     }
-    
-    // Write new student record
-    bytes_written = write(fd, &new_student, STUDENT_RECORD_SIZE);
-    if (bytes_written != STUDENT_RECORD_SIZE) {
-        printf(M_ERR_DB_WRITE);
-        return ERR_DB_FILE;
+
+    qsort(cc.suspects, cc.count, sizeof(int32_t), crc_slot_cmp);
+    for (size_t i = 0; i < cc.count && rc == NO_ERROR; i++) {
+        int corrupt = crc_confirm(fd, cc.suspects[i], repair);
+
+        if (corrupt < 0) {
+            printf(repair ? M_ERR_DB_WRITE : M_ERR_DB_READ);
+            rc = ERR_DB_FILE;
+        } else if (corrupt > 0) {
+            printf(repair ? M_CRC_CLEARED : M_CRC_BAD, cc.suspects[i]);
+            bad++;
+        }
     }
-    
-    printf(M_STD_ADDED, id);
-    return NO_ERROR;
+    pthread_mutex_destroy(&cc.lock);
+    free(cc.suspects);
+    if (rc != NO_ERROR)
+        return rc;
+
+    printf(M_CRC_VERIFIED, (int)cc.crc->slots - MIN_STD_ID, bad);
+    return bad;
 }
 
 /*
- *  del_student
- *      fd:     linux file descriptor
- *      id:     student id to be deleted
- *
- *  Removes a student to the database.  Use the get_student() function to
- *  locate the student to be deleted. If there is a student at that location
- *  write an empty student record - see EMPTY_STUDENT_RECORD from db.h at
- *  that location.
+ *  Snapshots
  *
- *  returns:  NO_ERROR       student deleted from database
- *            ERR_DB_FILE    database file I/O issue
- *            ERR_DB_OP      database operation logically failed (aka student
- *                           not in database)
+ *  snapshot_full() and snapshot_changes() give sdbsnap.c a consistent image
+ *  of the db without stopping writers for longer than it takes to redo a
+ *  few records.  Both finish under the same barrier: db_write_begin() over
+ *  every slot, which waits for the writers in the middle of a change and
+ *  holds new ones off.  At that point the data file holds every change that
+ *  was made, and the changed bits are cleared and tied to the new
+ *  snapshot's id, so the next snapshot can be incremental.
+ */
+static void snapshot_track(db_bitmap_t *b, uint64_t snap_id)
+{
+    if (b == NULL)
+        return;
+    memset(bitmap_changed(b), 0, DB_BITMAP_WORDS(b->slots) * sizeof(uint64_t));
+    b->snap_id = snap_id;
+}
+
+/*
+ *  snapshot_full
+ *      fd:       linux file descriptor
+ *      dst_fd:   empty file the image is written to
+ *      snap_id:  id of the new snapshot, not 0
  *
+ *  Copies the data file to dst_fd with copy_db_file(), a reflink where the
+ *  filesystem can do it, while writers carry on.  The checkpoint lock is
+ *  held shared meanwhile, so every change made during the copy is still in
+ *  the write ahead log, and once the barrier is up the log is replayed onto
+ *  the copy.  That repairs any record the copy caught half written and
+ *  brings in the changes it missed.  Without a log the copy itself has to
+ *  run under the barrier.
  *
- *  console:  M_STD_DEL_MSG      on success
- *            M_STD_NOT_FND_MSG  student not in database, cant be deleted
- *            M_ERR_DB_READ      error reading or seeking the database file
- *            M_ERR_DB_WRITE     error writing to db file (adding student)
+ *  returns:  NO_ERROR       dst_fd holds the image
+ *            ERR_DB_FILE    database or destination file I/O issue
  *
+ *  console:  Does not produce any console I/O
  */
-int del_student(int fd, int id)
+int snapshot_full(int fd, int dst_fd, uint64_t snap_id)
 {
-    student_t student = {0};
-    off_t offset;
-    ssize_t bytes_written;
-    
-    // Check if student exists
-    if (get_student(fd, id, &student) != NO_ERROR) {
-        printf(M_STD_NOT_FND_MSG, id);
-        return ERR_DB_OP;
-    }
-    
-    // Calculate offset and seek
-    offset = (off_t)id * STUDENT_RECORD_SIZE;
-    if (lseek(fd, offset, SEEK_SET) < 0) {
-        printf(M_ERR_DB_READ);
-        return ERR_DB_FILE;
+    db_handle_t *h = db_handle_find(fd);
+    off_t len = (off_t)(db_id_max(h) + 1) * STUDENT_RECORD_SIZE;
+    bool logged = (h != NULL && h->wal != NULL);
+    int rc = NO_ERROR;
+
+    if (logged) {
+        // Keeps a checkpoint from emptying the log under the copy
+        if (wal_lock(h, WAL_LOCK_CKPT, F_RDLCK) != NO_ERROR)
+            return ERR_DB_FILE;
+        rc = copy_db_file(fd, dst_fd);
     }
-    
-    // Write empty record
-    bytes_written = write(fd, &EMPTY_STUDENT_RECORD, STUDENT_RECORD_SIZE);
-    if (bytes_written != STUDENT_RECORD_SIZE) {
-        printf(M_ERR_DB_WRITE);
+    if (db_write_begin(h, fd, 0, len) != NO_ERROR) {
+        if (logged)
+            wal_lock(h, WAL_LOCK_CKPT, F_UNLCK);
         return ERR_DB_FILE;
     }
-    
-    printf(M_STD_DEL_MSG, id);
-    return NO_ERROR;
+    if (logged)
+        wal_lock(h, WAL_LOCK_CKPT, F_UNLCK);    // the barrier holds it too
+    if (rc == NO_ERROR)
+        rc = logged ? wal_replay(h, dst_fd) : copy_db_file(fd, dst_fd);
+    if (rc == NO_ERROR)
+        snapshot_track(db_bitmap_find(fd), snap_id);
+    if (db_write_end(h, fd, 0, len, 0) != NO_ERROR)
+        rc = ERR_DB_FILE;
+    return rc;
 }
 
 /*
- *  count_db_records
- *      fd:     linux file descriptor
+ *  snapshot_changes
+ *      fd:         linux file descriptor
+ *      parent_id:  id of the last snapshot
+ *      snap_id:    id of the new snapshot, not 0
+ *      slots:      set to a malloc()ed array of the changed slot numbers
+ *      recs:       set to a malloc()ed array of their records
  *
- *  Counts the number of records in the database.  Start by reading the
- *  database at the beginning, and continue reading individual records
- *  until you it EOF.  EOF is when the read() syscall returns 0. Check
- *  if a slot is empty or previously deleted by investigating if all of
- *  the bytes in the record read are zeros - I would suggest using memory
- *  compare memcmp() for this. Create a counter variable and initialize it
- *  to zero, every time a non-zero record is read increment the counter.
+ *  Collects the slots written since snapshot parent_id and their current
+ *  records, zeros for a deleted student, under the barrier.  The caller
+ *  frees both arrays.
  *
- *  returns:  <number>       returns the number of records in db on success
+ *  returns:  <number>       changed slots
+ *            ERR_DB_OP      the changes since parent_id are not known (no
+ *                           bitmap, rebuilt or compressed since), a full
+ *                           snapshot is needed
  *            ERR_DB_FILE    database file I/O issue
- *            ERR_DB_OP      database operation logically failed (aka student
- *                           not in database)
- *
- *
- *  console:  M_DB_RECORD_CNT  on success, to report the number of students in db
- *            M_DB_EMPTY       on success if the record count in db is zero
- *            M_ERR_DB_READ    error reading or seeking the database file
- *            M_ERR_DB_WRITE   error writing to db file (adding student)
  *
+ *  console:  Does not produce any console I/O
  */
-int count_db_records(int fd)
+int snapshot_changes(int fd, uint64_t parent_id, uint64_t snap_id,
+                     int32_t **slots, student_t **recs)
 {
-    student_t student = {0};
-    int count = 0;
-    ssize_t bytes_read;
-    
-    // Seek to beginning of file
-    if (lseek(fd, 0, SEEK_SET) < 0) {
-        printf(M_ERR_DB_READ);
+    db_handle_t *h = db_handle_find(fd);
+    db_bitmap_t *b = db_bitmap_find(fd);
+    off_t len = (off_t)(db_id_max(h) + 1) * STUDENT_RECORD_SIZE;
+    const uint64_t *changed;
+    size_t count = 0, k = 0;
+    int rc = NO_ERROR;
+
+    *slots = NULL;
+    *recs = NULL;
+    if (b == NULL || parent_id == 0)
+        return ERR_DB_OP;
+    if (db_write_begin(h, fd, 0, len) != NO_ERROR)
         return ERR_DB_FILE;
+    if (b->snap_id != parent_id) {
+        db_write_end(h, fd, 0, len, 0);
+        return ERR_DB_OP;
     }
-    
-    // Read records until EOF
-    while ((bytes_read = read(fd, &student, STUDENT_RECORD_SIZE)) == STUDENT_RECORD_SIZE) {
-        if (student.id != 0) {
-            count++;
+
+    changed = bitmap_changed(b);
+    for (size_t w = 0; w < DB_BITMAP_WORDS(b->slots); w++)
+        count += __builtin_popcountll(changed[w]);
+    *slots = malloc((count > 0 ? count : 1) * sizeof(int32_t));
+    *recs = malloc((count > 0 ? count : 1) * STUDENT_RECORD_SIZE);
+    if (*slots == NULL || *recs == NULL)
+        rc = ERR_DB_FILE;
+
+    for (size_t w = 0; rc == NO_ERROR && w < DB_BITMAP_WORDS(b->slots); w++) {
+        uint64_t word = changed[w];
+
+        while (word != 0 && rc == NO_ERROR) {
+            size_t slot = w * 64 + __builtin_ctzll(word);
+
+            word &= word - 1;
+            (*slots)[k] = slot;
+            rc = read_slot(fd, slot, &(*recs)[k++]);
         }
     }
-    
-    if (bytes_read < 0) {
-        printf(M_ERR_DB_READ);
-        return ERR_DB_FILE;
-    }
-    
-    if (count == 0) {
-        printf(M_DB_EMPTY);
-    } else {
-        printf(M_DB_RECORD_CNT, count);
+    if (rc == NO_ERROR)
+        snapshot_track(b, snap_id);
+    if (db_write_end(h, fd, 0, len, 0) != NO_ERROR)
+        rc = ERR_DB_FILE;
+
+    if (rc != NO_ERROR) {
+        free(*slots);
+        free(*recs);
+        *slots = NULL;
+        *recs = NULL;
+        return rc;
     }
-    
     return count;
 }
 
 /*
- *  print_db
- *      fd:     linux file descriptor
- *
- *  Prints all records in the database.  Start by reading the
- *  database at the beginning, and continue reading individual records
- *  until you it EOF.  EOF is when the read() syscall returns 0. Check
- *  if a slot is empty or previously deleted by investigating if all of
- *  the bytes in the record read are zeros - I would suggest using memory
- *  compare memcmp() for this. Be careful as the database might be empty.
- *  on the first real row encountered print the header for the required output:
- *
- *     printf(STUDENT_PRINT_HDR_STRING, "ID",
- *                  "FIRST_NAME", "LAST_NAME", "GPA");
- *
- *  then for each valid record encountered print the required output:
- *
- *     printf(STUDENT_PRINT_FMT_STRING, student.id, student.fname,
- *                    student.lname, calculated_gpa_from_student);
- *
- *  The code above assumes you are reading student records into a local
- *  variable named student that is of type student_t. Also dont forget that
- *  the GPA in the student structure is an int, to convert it into a real
- *  gpa divide by 100.0 and store in a float variable.
- *
- *  returns:  NO_ERROR       on success
- *            ERR_DB_FILE    database file I/O issue
+ *  snapshot_forget
+ *      fd:  linux file descriptor
  *
+ *  Unties the changed bits from the last snapshot, so the next one is a
+ *  full snapshot.  Used when a snapshot could not be saved after
+ *  snapshot_changes() or snapshot_full() already moved the bits on to it.
  *
- *  console:  <see above>      on success, print table or database empty
- *            M_ERR_DB_READ    error reading or seeking the database file
+ *  returns:  nothing
  *
+ *  console:  Does not produce any console I/O
  */
-int print_db(int fd)
+void snapshot_forget(int fd)
 {
-    student_t student = {0};
-    ssize_t bytes_read;
-    bool header_printed = false;
-    
-    // Seek to beginning of file
-    if (lseek(fd, 0, SEEK_SET) < 0) {
-        printf(M_ERR_DB_READ);
-        return ERR_DB_FILE;
+    db_bitmap_t *b = db_bitmap_find(fd);
+
+    if (b != NULL)
+        __atomic_store_n(&b->snap_id, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ *  Sets up a name predicate from a query value.  With wildcard set "Sm*"
+ *  matches names that start with Sm, anything else, or any value without
+ *  wildcard, must match exactly.  Names are stored the
+ *  way add_student() stores them, truncated to leave a NUL in the field, so
+ *  the pattern is truncated the same way.
+ */
+static void query_name_init(query_name_t *qn, const char *value,
+                            size_t field_size, bool wildcard)
+{
+    unsigned char pattern[32] = {0};
+    unsigned char mask[32] = {0};
+    size_t len = strlen(value);
+    bool prefix = false;
+
+    if (wildcard && len > 0 && value[len - 1] == '*') {
+        prefix = true;
+        len--;
     }
-    
-    // Read and print records until EOF
-    while ((bytes_read = read(fd, &student, STUDENT_RECORD_SIZE)) == STUDENT_RECORD_SIZE) {
-        if (student.id != 0) {
-            if (!header_printed) {
-                printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
-                header_printed = true;
-            }
-            float gpa = student.gpa / 100.0;
-            printf(STUDENT_PRINT_FMT_STRING, student.id, student.fname, 
-                   student.lname, gpa);
-        }
+    if (len > field_size - 1)
+        len = field_size - 1;
+
+    memcpy(pattern, value, len);
+    // an exact match also has to see the terminating NUL
+    memset(mask, 0xff, prefix ? len : len + 1);
+    memcpy(qn->pattern, pattern, sizeof(qn->pattern));
+    memcpy(qn->mask, mask, sizeof(qn->mask));
+}
+
+/*
+ *  parse_range
+ *      value:  "lo:hi", "lo:", ":hi" or a single number
+ *
+ *  Updates *lo and *hi, leaving a missing side unchanged.  Returns 0 on
+ *  success or -1 if the value is not a valid range.
+ */
+static int parse_range(const char *value, int *lo, int *hi)
+{
+    const char *colon = strchr(value, ':');
+    char *end;
+    long v;
+
+    if (colon == NULL) {
+        v = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || v < INT32_MIN || v > INT32_MAX)
+            return -1;
+        *lo = *hi = (int)v;
+        return 0;
     }
-    
-    if (bytes_read < 0) {
-        printf(M_ERR_DB_READ);
-        return ERR_DB_FILE;
+    if (colon != value) {
+        v = strtol(value, &end, 10);
+        if (end != colon || v < INT32_MIN || v > INT32_MAX)
+            return -1;
+        *lo = (int)v;
     }
-    
-    if (!header_printed) {
-        printf(M_DB_EMPTY);
+    if (colon[1] != '\0') {
+        v = strtol(colon + 1, &end, 10);
+        if (*end != '\0' || v < INT32_MIN || v > INT32_MAX)
+            return -1;
+        *hi = (int)v;
     }
-    
-    return NO_ERROR;
+    return 0;
 }
 
 /*
- *  print_student
- *      *s:   a pointer to a student_t structure that should
- *            contain a valid student to be printed
- *
- *  Start by ensuring that provided student pointer is valid.  To do this
- *  make sure it is not NULL and that s->id is not zero.  After ensuring
- *  that the student is valid, print it the exact way that is described
- *  in the print_db() function by first printing the header then the
- *  student data:
- *
- *     printf(STUDENT_PRINT_HDR_STRING, "ID",
- *                  "FIRST NAME", "LAST_NAME", "GPA");
- *
- *     printf(STUDENT_PRINT_FMT_STRING, s->id, s->fname,
- *                    student.lname, calculated_gpa_from_s);
+ *  parse_query
+ *      argc, argv:  the query terms, all of the form key=value
+ *      *q:          query to fill in
  *
- *  Dont forget that  the GPA in the student structure is an int, to convert
- *  it into a real gpa divide by 100.0 and store in a float variable.
- *
- *  returns:  nothing, this is a void function
+ *  Terms:
+ *      id=lo:hi            id range, either side may be left out
+ *      gpa=lo:hi           gpa range as 3 digit ints, e.g. gpa=300:400
+ *      fname=name          exact first name, or fname=prefix* for a prefix
+ *      lname=name          exact last name, or lname=prefix* for a prefix
+ *      out=rows|ids|count  what to print, rows is the default
  *
+ *  returns:  NO_ERROR on success, EXIT_FAIL_ARGS on an invalid term
  *
- *  console:  <see above>      on success, print table or database empty
- *            M_ERR_STD_PRINT  if the function argument s is NULL or if
- *                             s->id is zero
- *
+ *  console:  M_ERR_QUERY_TERM  for the first invalid term
  */
-void print_student(student_t *s)
+int parse_query(int argc, char *argv[], query_t *q)
 {
-    if (s == NULL || s->id == 0) {
-        printf(M_ERR_STD_PRINT);
-        return;
+    memset(q, 0, sizeof(*q));
+    q->id_lo = MIN_STD_ID;
+    q->id_hi = MAX_STD_ID_LIMIT;
+    q->gpa_lo = MIN_STD_GPA;
+    q->gpa_hi = MAX_STD_GPA;
+    q->out = QUERY_OUT_ROWS;
+
+    for (int i = 0; i < argc; i++) {
+        char *value = strchr(argv[i], '=');
+        int rc = 0;
+
+        if (value == NULL) {
+            printf(M_ERR_QUERY_TERM, argv[i]);
+            return EXIT_FAIL_ARGS;
+        }
+        value++;
+
+        if (strncmp(argv[i], "id=", 3) == 0)
+            rc = parse_range(value, &q->id_lo, &q->id_hi);
+        else if (strncmp(argv[i], "gpa=", 4) == 0)
+            rc = parse_range(value, &q->gpa_lo, &q->gpa_hi);
+        else if (strncmp(argv[i], "fname=", 6) == 0)
+            query_name_init(&q->fname, value, sizeof(((student_t *)0)->fname), true);
+        else if (strncmp(argv[i], "lname=", 6) == 0)
+            query_name_init(&q->lname, value, sizeof(((student_t *)0)->lname), true);
+        else if (strcmp(argv[i], "out=rows") == 0)
+            q->out = QUERY_OUT_ROWS;
+        else if (strcmp(argv[i], "out=ids") == 0)
+            q->out = QUERY_OUT_IDS;
+        else if (strcmp(argv[i], "out=count") == 0)
+            q->out = QUERY_OUT_COUNT;
+        else
+            rc = -1;
+
+        if (rc != 0) {
+            printf(M_ERR_QUERY_TERM, argv[i]);
+            return EXIT_FAIL_ARGS;
+        }
+    }
+    return NO_ERROR;
+}
+
+/*
+ *  Branch free name predicate: xor the field with the pattern a word at a
+ *  time, keep only the bytes that must match, and test the result for zero.
+ *  The compiler turns the fixed trip count loop into a few vector ops.
+ */
+static inline unsigned query_name_match(const query_name_t *qn,
+                                        const char *field, size_t words)
+{
+    uint64_t diff = 0;
+
+    for (size_t w = 0; w < words; w++) {
+        uint64_t v;
+
+        memcpy(&v, field + w * 8, 8);
+        diff |= (v ^ qn->pattern[w]) & qn->mask[w];
+    }
+    return diff == 0;
+}
+
+/*
+ *  Evaluates every term without branching.  Each comparison is a 0 or 1
+ *  combined with &, not &&, so the compiler emits set-on-compare
+ *  instructions rather than jumps.  Subtracting the bounds instead would
+ *  overflow for ranges wider than half the int range.
+ */
+static inline unsigned query_match(const query_t *q, const student_t *s)
+{
+    return (s->id >= q->id_lo) & (s->id <= q->id_hi) &
+           (s->gpa >= q->gpa_lo) & (s->gpa <= q->gpa_hi) &
+           query_name_match(&q->fname, s->fname, sizeof(s->fname) / 8) &
+           query_name_match(&q->lname, s->lname, sizeof(s->lname) / 8);
+}
+
+/*
+ *  Runs the query and prints the matching rows or ids, but not the count or
+ *  "no match" messages.  Returns the number of matches, or ERR_DB_FILE.
+ */
+static int query_scan(int fd, query_t *q)
+{
+    const student_t *s;
+    size_t slot;
+    scan_t sc;
+    print_buf_t *pb = NULL;
+    int count = 0;
+
+    if (scan_open(&sc, fd) != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    if (q->out == QUERY_OUT_ROWS && (pb = print_buf_open(STDOUT_FILENO)) == NULL) {
+        scan_close(&sc);
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    // An inverted range cannot match anything, and would wrap around in the
+    // unsigned compare, so skip the scan entirely
+    bool empty = q->id_lo > q->id_hi || q->gpa_lo > q->gpa_hi;
+    while (!empty && (s = scan_next(&sc, &slot)) != NULL) {
+        if (!query_match(q, s))
+            continue;
+        if (q->out == QUERY_OUT_ROWS) {
+            if (print_buf_row(pb, s) != NO_ERROR)
+                break;
+        } else if (q->out == QUERY_OUT_IDS) {
+            printf("%d\n", s->id);
+        }
+        count++;
+    }
+    scan_close(&sc);
+    if (pb != NULL && print_buf_close(pb) < 0)
+        return ERR_DB_FILE;
+    if (sc.err != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
     }
-    
-    printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
-    float gpa = s->gpa / 100.0;
-    printf(STUDENT_PRINT_FMT_STRING, s->id, s->fname, s->lname, gpa);
+    return count;
 }
 
 /*
- *  NOTE IMPLEMENTING THIS FUNCTION IS EXTRA CREDIT
- *
- *  compress_db
+ *  query_db
  *      fd:     linux file descriptor
+ *      *q:     query built by parse_query()
  *
- *  This assignment takes advantage of the way Linux handles sparse files
- *  on disk. Thus if there is a large hole between student records, Linux
- *  will not use any physical storage.  However, when a database record is
- *  deleted storage is used to write a blank - see EMPTY_STUDENT_RECORD from
- *  db.h - record.
- *
- *  Since Linux provides no way to delete data in the middle of a file, and
- *  deleted records take up physical storage, this function will compress the
- *  database by rewriting a new database file that only includes valid student
- *  records. There are a number of ways to do this, but since this is extra credit
- *  you need to figure this out on your own.
+ *  Scans the whole record array with the block scan iterator and evaluates
+ *  the query against every live record.  Records come out in id order.
  *
- *  At a high level create a temporary database file then copy all valid students from
- *  the active database (passed in via fd) to the temporary file. When this is done
- *  rename the temporary database file to the name of the real database file. See
- *  the constants in db.h for required file names:
+ *  returns:  <number>       the number of matching records
+ *            ERR_DB_FILE    database file I/O issue
  *
- *         #define DB_FILE     "student.db"        //name of database file
- *         #define TMP_DB_FILE ".tmp_student.db"   //for extra credit
+ *  console:  QUERY_OUT_ROWS   header and one row per match, or M_QUERY_NONE
+ *            QUERY_OUT_IDS    one id per line
+ *            QUERY_OUT_COUNT  M_QUERY_CNT
+ *            M_ERR_DB_READ    error reading the database file
+ */
+int query_db(int fd, query_t *q)
+{
+    int count = query_scan(fd, q);
+
+    if (count < 0)
+        return count;
+    if (q->out == QUERY_OUT_COUNT)
+        printf(M_QUERY_CNT, count);
+    else if (q->out == QUERY_OUT_ROWS && count == 0)
+        printf(M_QUERY_NONE);
+    return count;
+}
+
+typedef struct index_hit {
+    char fname[24];
+    int32_t id;
+    uint32_t slot;
+} index_hit_t;
+
+static int index_hit_cmp(const void *a, const void *b)
+{
+    const index_hit_t *x = a;
+    const index_hit_t *y = b;
+    int rc = memcmp(x->fname, y->fname, sizeof(x->fname));
+
+    if (rc != 0)
+        return rc;
+    return (x->id > y->id) - (x->id < y->id);
+}
+
+static void index_key(db_index_entry_t *e, const char *lname, const char *fname)
+{
+    memset(e, 0, sizeof(*e));
+    strncpy(e->lname, lname, sizeof(e->lname) - 1);
+    if (fname != NULL)
+        strncpy(e->fname, fname, sizeof(e->fname) - 1);
+}
+
+/*
+ *  find_by_name
+ *      fd:     linux file descriptor
+ *      lname:  last name to look for
+ *      fname:  first name to look for, or NULL to match any first name
  *
- *  Note that you are passed in the fd of the database file to be compressed,
- *  it is very likely you will need to close it to overwrite it with the
- *  compressed version of the file.  To ensure the caller can work with the
- *  compressed file after you create it, it is a good design to return the fd
- *  of the new compressed file from this function
+ *  Walks the name index chain of the last name and prints the matching
+ *  students, ordered by first name and then id.  If the index is not
+ *  available the record array is scanned instead.
  *
- *  returns:  <number>       returns the fd of the compressed database file
+ *  returns:  <number>       the number of students found
+ *            SRCH_NOT_FOUND no student has that name
  *            ERR_DB_FILE    database file I/O issue
  *
- *
- *  console:  M_DB_COMPRESSED_OK  on success, the db was successfully compressed.
- *            M_ERR_DB_OPEN    error when opening/creating temporary database file.
- *                             this error should also be returned after you
- *                             compressed the database file and if you are unable
- *                             to open it to pass the fd back to the caller
- *            M_ERR_DB_CREATE  error creating the db file. For instance the
- *                             inability to copy the temporary file back as
- *                             the primary database file.
- *            M_ERR_DB_READ    error reading or seeking the the db or tempdb file
- *            M_ERR_DB_WRITE   error writing to db or tempdb file (adding student)
- *
+ *  console:  header and one row per student found
+ *            M_STD_NAME_NOT_FND  no student has that name
+ *            M_ERR_DB_READ       error reading the database file
  */
-int compress_db(int fd)
+int find_by_name(int fd, char *lname, char *fname)
 {
-    student_t student = {0};
-    int tmp_fd;
-    off_t curr_pos = 0;
-    ssize_t bytes_read, bytes_written;
-    
-    // Create temporary database file
-    tmp_fd = open_db(TMP_DB_FILE, true);
-    if (tmp_fd < 0) {
-        printf(M_ERR_DB_OPEN);
-        return ERR_DB_FILE;
-    }
-    
-    // Seek to beginning of original file
-    if (lseek(fd, 0, SEEK_SET) < 0) {
-        printf(M_ERR_DB_READ);
-        close(tmp_fd);
-        return ERR_DB_FILE;
+    db_handle_t *h = db_handle_find(fd);
+    db_index_t *ix = db_index_find(fd);
+    db_index_entry_t key;
+    student_t student;
+    int count = 0;
+    int rc = NO_ERROR;
+
+    if (ix == NULL) {
+        query_t q;
+
+        // Names are taken literally, a '*' here is part of the name
+        parse_query(0, NULL, &q);
+        query_name_init(&q.lname, lname, sizeof(student.lname), false);
+        if (fname != NULL)
+            query_name_init(&q.fname, fname, sizeof(student.fname), false);
+        count = query_scan(fd, &q);
+        if (count == 0) {
+            printf(M_STD_NAME_NOT_FND, lname);
+            return SRCH_NOT_FOUND;
+        }
+        return count;
     }
-    
-    // Copy non-deleted records to temporary file
-    while ((bytes_read = read(fd, &student, STUDENT_RECORD_SIZE)) == STUDENT_RECORD_SIZE) {
-        if (student.id != 0) {
-            bytes_written = write(tmp_fd, &student, STUDENT_RECORD_SIZE);
-            if (bytes_written != STUDENT_RECORD_SIZE) {
-                printf(M_ERR_DB_WRITE);
-                close(tmp_fd);
-                return ERR_DB_FILE;
+
+    // Collect the matches under the lock, writers relink entries
+    index_hit_t *hits = NULL;
+    size_t n = 0, cap = 0;
+
+    index_key(&key, lname, fname);
+    wal_lock(h, WAL_LOCK_INDEX, F_RDLCK);
+    for (uint32_t slot = index_heads(ix)[index_hash(ix, key.lname)];
+         slot != 0; slot = ix->entries[slot].next) {
+        const db_index_entry_t *e = &ix->entries[slot];
+
+        if (memcmp(e->lname, key.lname, sizeof(key.lname)) != 0 ||
+            (fname != NULL && memcmp(e->fname, key.fname, sizeof(key.fname)) != 0))
+            continue;
+        if (n == cap) {
+            index_hit_t *grown = realloc(hits, (cap = cap ? cap * 2 : 16) * sizeof(*hits));
+
+            if (grown == NULL) {
+                rc = ERR_DB_FILE;
+                break;
             }
-            curr_pos += STUDENT_RECORD_SIZE;
+            hits = grown;
         }
+        memcpy(hits[n].fname, e->fname, sizeof(hits[n].fname));
+        hits[n].id = e->id;
+        hits[n].slot = slot;
+        n++;
     }
-    
-    if (bytes_read < 0) {
+    wal_lock(h, WAL_LOCK_INDEX, F_UNLCK);
+    if (rc != NO_ERROR) {
+        free(hits);
         printf(M_ERR_DB_READ);
-        close(tmp_fd);
-        return ERR_DB_FILE;
+        return rc;
     }
-    
-    // Close both files
-    close(fd);
-    close(tmp_fd);
-    
-    // Replace original with compressed version
-    if (rename(TMP_DB_FILE, DB_FILE) < 0) {
-        printf(M_ERR_DB_CREATE);
-        return ERR_DB_FILE;
+
+    qsort(hits, n, sizeof(*hits), index_hit_cmp);
+    for (size_t i = 0; i < n; i++) {
+        if (read_slot(fd, hits[i].slot, &student) != NO_ERROR) {
+            printf(M_ERR_DB_READ);
+            rc = ERR_DB_FILE;
+            break;
+        }
+        if (student.id != hits[i].id)
+            continue;   // changed under us, the index is fixed up on reopen
+        if (count++ == 0)
+            printf(STUDENT_PRINT_HDR_STRING, "ID", "FIRST_NAME", "LAST_NAME", "GPA");
+        float gpa = student.gpa / 100.0;
+        printf(STUDENT_PRINT_FMT_STRING, student.id, student.fname,
+               student.lname, gpa);
     }
-    
-    // Reopen compressed database
-    fd = open_db(DB_FILE, false);
-    if (fd < 0) {
-        printf(M_ERR_DB_OPEN);
-        return ERR_DB_FILE;
+    free(hits);
+
+    if (rc != NO_ERROR)
+        return rc;
+    if (count == 0) {
+        printf(M_STD_NAME_NOT_FND, lname);
+        return SRCH_NOT_FOUND;
     }
-    
-    printf(M_DB_COMPRESSED_OK);
-    return fd;
+    return count;
 }
 
 /*
@@ -501,6 +4799,9 @@ int compress_db(int fd)
  *  as per the specifications.  It checks if the values are within the
  *  inclusive range using constents in db.h
  *
+ *  The id is only checked against MAX_STD_ID_LIMIT, since the id range of
+ *  a db is in its header.  add_student() checks it against that.
+ *
  *  returns:    NO_ERROR       on success, both ID and GPA are in range
  *              EXIT_FAIL_ARGS if either ID or GPA is out of range
  *
@@ -510,7 +4811,7 @@ int compress_db(int fd)
 int validate_range(int id, int gpa)
 {
 
-    if ((id < MIN_STD_ID) || (id > MAX_STD_ID))
+    if ((id < MIN_STD_ID) || (id > MAX_STD_ID_LIMIT))
         return EXIT_FAIL_ARGS;
 
     if ((gpa < MIN_STD_GPA) || (gpa > MAX_STD_GPA))
@@ -532,14 +4833,30 @@ int validate_range(int id, int gpa)
  */
 void usage(char *exename)
 {
-    printf("usage: %s -[h|a|c|d|f|p|z] options.  Where:\n", exename);
+    printf("usage: %s -[h|a|b|B|c|d|e|f|F|i|L|n|p|q|R|s|S|T|V|x|X|z] options.  Where:\n", exename);
     printf("\t-h:  prints help\n");
     printf("\t-a id first_name last_name gpa(as 3 digit int):  adds a student\n");
+    printf("\t-b [file]:  bulk loads id,first_name,last_name,gpa lines (stdin if no file)\n");
+    printf("\t-B [file]:  bulk loads raw binary student records (stdin if no file)\n");
     printf("\t-c:  counts the records in the database\n");
     printf("\t-d id:  deletes a student\n");
+    printf("\t-e file [dict]:  exports the records as columns, optionally with name dictionaries\n");
     printf("\t-f id:  finds and prints a student in the database\n");
+    printf("\t-F [file]:  finds the ids listed one per line in one batch (stdin if no file)\n");
+    printf("\t-i file:  imports the records of a columnar file made with -e\n");
+    printf("\t-L [threads] [requests] [write_pct]:  load tests a running sdbsc -S\n");
+    printf("\t-n last_name [first_name]:  finds students by name using the name index\n");
     printf("\t-p:  prints all records in the student database\n");
+    printf("\t-q term...:  prints records matching all terms:\n");
+    printf("\t\tid=lo:hi gpa=lo:hi fname=name lname=name (name* for a prefix)\n");
+    printf("\t\tout=rows|ids|count (default rows)\n");
+    printf("\t-R seq file [dir]:  restores snapshot seq into a new db file\n");
+    printf("\t-s [dir]:  saves a snapshot, incremental after the first (dir student.db.snap)\n");
+    printf("\t-S [threads]:  serves -a -c -d -f -p to other sdbsc processes until killed\n");
+    printf("\t-T [max_id] [density] [csv|json]:  benchmarks the db operations\n");
+    printf("\t-V [repair]:  verifies every record against its checksum, optionally clearing bad ones\n");
     printf("\t-x:  compress the database file [EXTRA CREDIT]\n");
+    printf("\t-X [blocks]:  reclaims deleted records in place, optionally a few blocks per run\n");
     printf("\t-z:  zero db file (remove all records)\n");
 }
 
@@ -547,11 +4864,13 @@ void usage(char *exename)
 int main(int argc, char *argv[])
 {
     char opt;      // user selected option
-    int fd;        // file descriptor of database files
+    int fd = -1;   // file descriptor of database files
     int rc;        // return code from various operations
     int exit_code; // exit code to shell
     int id;        // userid from argv[2]
     int gpa;       // gpa from argv[5]
+    bool remote = false;   // fd is a connection to sdbsc -S
+    bool no_db;            // option does not use student.db here
 
     // space for a student structure which we will get back from
     // some of the functions we will be writing such as get_student(),
@@ -577,11 +4896,38 @@ int main(int argc, char *argv[])
         exit(EXIT_OK);
     }
 
+    // if sdbsc -S is running, the options it serves are forwarded to it
+    // and the db is not opened here at all
+    if (opt != '\0' && strchr(SRV_OPS, opt) != NULL)
+    {
+        fd = srv_connect(DB_FILE DB_SOCKET_EXT);
+        remote = (fd >= 0);
+    }
+
+    // options that rewrite the db run locally, and would pull it out
+    // from under the server
+    if (opt != '\0' && strchr(SRV_LOCAL_OPS, opt) != NULL)
+    {
+        fd = srv_connect(DB_FILE DB_SOCKET_EXT);
+        if (fd >= 0)
+        {
+            printf(M_ERR_SRV_RUNNING, DB_FILE, opt);
+            close(fd);
+            exit(EXIT_FAIL_DB);
+        }
+    }
+
+    // the load generator, restore and the benchmark never open student.db
+    // here
+    no_db = (opt == 'L' || opt == 'R' || opt == 'T');
+
     // now lets open the file and continue if there is no error
     // note we are not truncating the file using the second
-    // parameter
-    fd = open_db(DB_FILE, false);
-    if (fd < 0)
+    // parameter, except for -z, which can then start over even from a
+    // file whose header this build cannot read
+    if (!remote && !no_db)
+        fd = open_db(DB_FILE, opt == 'z');
+    if (fd < 0 && !no_db)
     {
         exit(EXIT_FAIL_DB);
     }
@@ -617,18 +4963,54 @@ int main(int argc, char *argv[])
             break;
         }
 
-        rc = add_student(fd, id, argv[3], argv[4], gpa);
-        if (rc < 0)
+        if (remote)
+            rc = srv_add_student(fd, id, argv[3], argv[4], gpa);
+        else
+            rc = add_student(fd, id, argv[3], argv[4], gpa);
+        if (rc == ERR_DB_RANGE)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
             exit_code = EXIT_FAIL_DB;
 
         break;
 
+    case 'b':
+    case 'B':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -b  [file]
+        //-------------------------
+        // example:  prog_name -b students.csv
+        //           generate_students | prog_name -b
+        if (argc > 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        FILE *in = stdin;
+        if (argc == 3 && strcmp(argv[2], "-") != 0)
+        {
+            in = fopen(argv[2], opt == 'B' ? "rb" : "r");
+            if (in == NULL)
+            {
+                printf(M_ERR_BATCH_INPUT);
+                exit_code = EXIT_FAIL_ARGS;
+                break;
+            }
+        }
+        rc = batch_load(fd, in, opt == 'B');
+        if (in != stdin)
+            fclose(in);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'c':
         //    arv[0] arv[1]
         // prog_name     -c
         //-----------------
         // example:  prog_name -c
-        rc = count_db_records(fd);
+        rc = remote ? srv_count_db_records(fd) : count_db_records(fd);
         if (rc < 0)
             exit_code = EXIT_FAIL_DB;
         break;
@@ -645,12 +5027,29 @@ int main(int argc, char *argv[])
             break;
         }
         id = atoi(argv[2]);
-        rc = del_student(fd, id);
+        rc = remote ? srv_del_student(fd, id) : del_student(fd, id);
         if (rc < 0)
             exit_code = EXIT_FAIL_DB;
 
         break;
 
+    case 'e':
+        //    arv[0] arv[1]  arv[2]  arv[3]
+        // prog_name     -e    file  [dict]
+        //---------------------------------
+        // example:  prog_name -e students.col dict
+        if (argc < 3 || argc > 4 ||
+            (argc == 4 && strcmp(argv[3], COL_OPT_DICT) != 0))
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = export_columns(fd, argv[2], argc == 4);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'f':
         //    arv[0] arv[1]  arv[2]
         // prog_name     -f      id
@@ -663,7 +5062,10 @@ int main(int argc, char *argv[])
             break;
         }
         id = atoi(argv[2]);
-        rc = get_student(fd, id, &student);
+        if (remote)
+            rc = srv_get_student(fd, id, &student);
+        else
+            rc = get_student(fd, id, &student);
 
         switch (rc)
         {
@@ -674,6 +5076,10 @@ int main(int argc, char *argv[])
             printf(M_STD_NOT_FND_MSG, id);
             exit_code = EXIT_FAIL_DB;
             break;
+        case ERR_DB_CORRUPT:
+            printf(M_ERR_STD_CORRUPT, id);
+            exit_code = EXIT_FAIL_DB;
+            break;
         default:
             printf(M_ERR_DB_READ);
             exit_code = EXIT_FAIL_DB;
@@ -681,16 +5087,204 @@ int main(int argc, char *argv[])
         }
         break;
 
+    case 'F':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -F  [file]
+        //-------------------------
+        // example:  prog_name -F ids.txt
+        //           seq 1 10000 | prog_name -F
+        if (argc > 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        FILE *id_in = stdin;
+        if (argc == 3 && strcmp(argv[2], "-") != 0)
+        {
+            id_in = fopen(argv[2], "r");
+            if (id_in == NULL)
+            {
+                printf(M_ERR_BATCH_INPUT);
+                exit_code = EXIT_FAIL_ARGS;
+                break;
+            }
+        }
+        rc = find_students(fd, id_in);
+        if (id_in != stdin)
+            fclose(id_in);
+        if (rc != NO_ERROR)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'i':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -i    file
+        //-------------------------
+        // example:  prog_name -i students.col
+        if (argc != 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = import_columns(fd, argv[2]);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'n':
+        //    arv[0] arv[1]     arv[2]        arv[3]
+        // prog_name     -n  last_name  [first_name]
+        //------------------------------------------
+        // example:  prog_name -n Doe John
+        if (argc != 3 && argc != 4)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = find_by_name(fd, argv[2], argc == 4 ? argv[3] : NULL);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'p':
         //    arv[0] arv[1]
         // prog_name     -p
         //-----------------
         // example:  prog_name -p
-        rc = print_db(fd);
+        rc = remote ? srv_print_db(fd) : print_db(fd);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'q':
+        //    arv[0] arv[1]  arv[2...]
+        // prog_name     -q  term...
+        //--------------------------
+        // example:  prog_name -q gpa=300:400 lname=Sm* out=ids
+        {
+            query_t query;
+
+            if (parse_query(argc - 2, argv + 2, &query) != NO_ERROR)
+            {
+                exit_code = EXIT_FAIL_ARGS;
+                break;
+            }
+            rc = query_db(fd, &query);
+            if (rc < 0)
+                exit_code = EXIT_FAIL_DB;
+        }
+        break;
+
+    case 'R':
+        //    arv[0] arv[1]  arv[2]  arv[3]  arv[4]
+        // prog_name     -R     seq    file   [dir]
+        //-----------------------------------------
+        // example:  prog_name -R 3 restored.db
+        if (argc != 4 && argc != 5)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = restore_snapshot(argc == 5 ? argv[4] : DB_FILE SNAP_DIR_EXT,
+                              atoi(argv[2]), argv[3]);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 's':
+        //    arv[0] arv[1]  arv[2]
+        // prog_name     -s   [dir]
+        //-------------------------
+        // example:  prog_name -s backups
+        if (argc > 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = snapshot_db(fd, argc == 3 ? argv[2] : DB_FILE SNAP_DIR_EXT);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'L':
+        //    arv[0] arv[1]     arv[2]      arv[3]       arv[4]
+        // prog_name     -L  [threads]  [requests]  [write_pct]
+        //-----------------------------------------------------
+        // example:  prog_name -L 16 20000 10
+        if (argc > 5)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = load_db(DB_FILE DB_SOCKET_EXT,
+                     argc > 2 ? atoi(argv[2]) : 8,
+                     argc > 3 ? atoi(argv[3]) : 10000,
+                     argc > 4 ? atoi(argv[4]) : 10);
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'S':
+        //    arv[0] arv[1]     arv[2]
+        // prog_name     -S  [threads]
+        //----------------------------
+        // example:  prog_name -S 8 &
+        if (argc > 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = serve_db(fd, DB_FILE DB_SOCKET_EXT,
+                      argc == 3 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN));
         if (rc < 0)
             exit_code = EXIT_FAIL_DB;
         break;
 
+    case 'T':
+        //    arv[0] arv[1]    arv[2]     arv[3]      arv[4]
+        // prog_name     -T  [max_id]  [density]  [csv|json]
+        //--------------------------------------------------
+        // example:  prog_name -T 100000 50 json > bench.json
+        if (argc > 5)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = bench_db(argc > 2 ? atoi(argv[2]) : MAX_STD_ID,
+                      argc > 3 ? atoi(argv[3]) : 50,
+                      argc > 4 ? argv[4] : BENCH_FMT_CSV);
+        if (rc == ERR_DB_OP)
+            exit_code = EXIT_FAIL_ARGS;
+        else if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
+    case 'V':
+        //    arv[0] arv[1]    arv[2]
+        // prog_name     -V  [repair]
+        //---------------------------
+        // example:  prog_name -V repair
+        if (argc > 3 || (argc == 3 && strcmp(argv[2], CRC_OPT_REPAIR) != 0))
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = verify_db(fd, argc == 3);
+        if (rc < 0 || (rc > 0 && argc != 3))
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'x':
         //    arv[0] arv[1]
         // prog_name     -x
@@ -704,6 +5298,22 @@ int main(int argc, char *argv[])
             exit_code = EXIT_FAIL_DB;
         break;
 
+    case 'X':
+        //    arv[0] arv[1]    arv[2]
+        // prog_name     -X  [blocks]
+        //---------------------------
+        // example:  prog_name -X 1000
+        if (argc > 3)
+        {
+            usage(argv[0]);
+            exit_code = EXIT_FAIL_ARGS;
+            break;
+        }
+        rc = compact_db(fd, argc == 3 ? atoi(argv[2]) : 0);
+        if (rc < 0)
+            exit_code = EXIT_FAIL_DB;
+        break;
+
     case 'z':
         //    arv[0] arv[1]
         // prog_name     -x
@@ -711,7 +5321,7 @@ int main(int argc, char *argv[])
         // example:  prog_name -x
         // HINT:  close the db file, we already have fd
         //       and reopen db indicating truncate=true
-        close(fd);
+        close_db(fd);
         fd = open_db(DB_FILE, true);
         if (fd < 0)
         {
@@ -728,6 +5338,9 @@ int main(int argc, char *argv[])
 
     // dont forget to close the file before exiting, and setting the
     // proper exit code - see the header file for expected values
-    close(fd);
+    if (remote)
+        close(fd);
+    else if (!no_db)
+        close_db(fd);
     exit(exit_code);
 }
@@ -1,28 +1,100 @@
 #ifndef __SDB_H__
 
+#include <stdint.h>
 #include "db.h" //get student record type
 
+//query over the record array, see parse_query() for the term syntax
+typedef enum {
+    QUERY_OUT_ROWS,     // print matching records like print_db()
+    QUERY_OUT_IDS,      // print one matching id per line
+    QUERY_OUT_COUNT,    // only print the number of matches
+} query_out_t;
+
+typedef struct query_name {
+    uint64_t pattern[4];    // name padded with zeros to the field width
+    uint64_t mask[4];       // 0xff for every byte that has to match
+} query_name_t;
+
+typedef struct query {
+    int id_lo, id_hi;       // inclusive ranges
+    int gpa_lo, gpa_hi;
+    query_name_t fname;     // an all zero mask matches any name
+    query_name_t lname;
+    query_out_t out;
+} query_t;
+
+//callback for for_each_student(), return non-zero to stop the walk
+typedef int (*student_fn_t)(const student_t *s, void *arg);
+
+//buffered table writer behind print_db(), see print_buf_open()
+typedef struct print_buf print_buf_t;
+
 //prototypes for functions go below for this assignment
 int open_db(char *dbFile, bool should_truncate);
+int close_db(int fd);
 int add_student(int fd, int id, char *fname, char *lname, int gpa);
 int get_student(int fd, int id, student_t *s);
+int get_students(int fd, const int *ids, int n, student_t *out, int *rc);
+int put_students(int fd, const student_t *recs, int n, int *rc);
+int find_students(int fd, FILE *in);
 int del_student(int fd, int id);
 int compress_db(int fd);
+int compact_db(int fd, int max_blocks);
+int snapshot_full(int fd, int dst_fd, uint64_t snap_id);
+int snapshot_changes(int fd, uint64_t parent_id, uint64_t snap_id,
+                     int32_t **slots, student_t **recs);
+void snapshot_forget(int fd);
+int verify_db(int fd, bool repair);
 void print_student(student_t *s);
 int validate_range(int id, int gpa);
 int count_db_records(int fd);
 int print_db(int fd);
+print_buf_t *print_buf_open(int fd);
+int print_buf_row(print_buf_t *pb, const student_t *s);
+int print_buf_close(print_buf_t *pb);
+int for_each_student(int fd, student_fn_t fn, void *arg);
+int batch_load(int fd, FILE *in, bool binary);
+int parse_query(int argc, char *argv[], query_t *q);
+int query_db(int fd, query_t *q);
+int find_by_name(int fd, char *lname, char *fname);
 void usage(char *);
 
+//storage engine selection.  The db is memory mapped by default, setting the
+//environment variable SDB_ENGINE=rw selects the lseek/read/write engine.
+#define DB_ENGINE_ENV   "SDB_ENGINE"
+#define DB_ENGINE_RW    "rw"
+
+//full scans read through O_DIRECT when SDB_DIRECT=1 is set
+#define DB_DIRECT_ENV   "SDB_DIRECT"
+
+//full scans (count, print, compress) read the file with this many threads,
+//e.g. SDB_SCAN_THREADS=8.  The default of 1 is the single threaded scan.
+#define DB_SCAN_THREADS_ENV "SDB_SCAN_THREADS"
+
+//record classification kernel override: scalar, sse2 or avx2.  scalar also
+//makes the record checksums use the CRC32C table instead of SSE4.2.
+#define DB_SIMD_ENV     "SDB_SIMD"
+
+//sdbsc -V argument that clears the slots failing their checksum
+#define CRC_OPT_REPAIR  "repair"
+
+//highest id a db holds, recorded in its header when it is created or
+//zeroed, e.g. SDB_MAX_ID=5000000 sdbsc -z.  Defaults to MAX_STD_ID.
+#define DB_MAX_ID_ENV   "SDB_MAX_ID"
+
 //error codes to be returned from individual functions
 // NO_ERROR is returned if there are no errors
 // ERR_DB_FILE is returned if there is are any issues with the database file itself
 // ERR_DB_OP is returned if an operation did not work aka add or delete a student
 // SRCH_NOT_FOUND is returned if the student is not found (get_student, and del_student)
+// ERR_DB_RANGE is returned if the id is outside the db's id range (add_student)
+// ERR_DB_CORRUPT is returned if a record does not match its checksum (get_student)
 #define NO_ERROR        0
 #define ERR_DB_FILE     -1
 #define ERR_DB_OP       -2
 #define SRCH_NOT_FOUND  -3
+#define ERR_DB_RANGE    -4
+#define ERR_DB_CORRUPT  -5
 #define NOT_IMPLEMENTED_YET 0
 
 
@@ -40,6 +112,9 @@ void usage(char *);
 #define M_ERR_STD_RNG     "Cant add student, either ID or GPA out of allowable range!\n"
 #define M_ERR_DB_CREATE   "Error creating DB file, exiting!\n"
 #define M_ERR_DB_OPEN     "Error opening DB file, exiting!\n"
+#define M_ERR_DB_LAYOUT   "DB file header is not supported by this build, exiting!\n"
+#define M_ERR_DB_MAX_ID   "SDB_MAX_ID must be a number from %d to %d, exiting!\n"
+#define M_ERR_DB_BUSY     "DB file is open in another process, exiting!\n"
 #define M_ERR_DB_READ     "Error reading DB file, exiting!\n"
 #define M_ERR_DB_WRITE    "Error writing DB file, exiting!\n"
 #define M_ERR_DB_ADD_DUP  "Cant add student with ID=%d, already exists in db.\n"
@@ -49,10 +124,27 @@ void usage(char *);
 #define M_STD_DEL_MSG     "Student %d was deleted from database.\n"
 #define M_STD_NOT_FND_MSG "Student %d was not found in database.\n"
 #define M_DB_COMPRESSED_OK "Database successfully compressed!\n"
+#define M_DB_COMPACT_OK   "Compaction complete, reclaimed %d block(s).\n"
+#define M_DB_COMPACT_PART "Compaction reclaimed %d block(s), will resume at slot %d.\n"
+#define M_ERR_DB_COMPACT  "Error compacting DB file, hole punching is not supported!\n"
 #define M_DB_ZERO_OK      "All database records removed!\n"
 #define M_DB_EMPTY        "Database contains no student records.\n"
 #define M_DB_RECORD_CNT   "Database contains %d student record(s).\n"
 #define M_NOT_IMPL        "The requested operation is not implemented yet!\n"
+#define M_ERR_BATCH_LINE  "Skipping malformed input on line %d.\n"
+#define M_ERR_BATCH_LONG  "Skipping line %d, it is longer than %d characters.\n"
+#define M_ERR_BATCH_RNG   "Skipping student with ID=%d, either ID or GPA out of allowable range!\n"
+#define M_ERR_BATCH_INPUT "Error reading batch input, exiting!\n"
+#define M_BATCH_LOADED    "Batch loaded %d student(s), %d rejected.\n"
+#define M_ERR_QUERY_TERM  "Invalid query term: %s\n"
+#define M_QUERY_CNT       "Query matched %d student record(s).\n"
+#define M_QUERY_NONE      "No student records matched the query.\n"
+#define M_ERR_STD_CORRUPT "Student %d failed its checksum, run sdbsc -V to check the db.\n"
+#define M_ERR_CRC_NONE    "No checksums are available for this DB file!\n"
+#define M_CRC_BAD         "Slot %d failed its checksum.\n"
+#define M_CRC_CLEARED     "Slot %d failed its checksum and was cleared.\n"
+#define M_CRC_VERIFIED    "Verified %d slot(s), %d failed their checksum.\n"
+#define M_STD_NAME_NOT_FND "No student named %s was found in database.\n"
 
 //useful format strings for print students
 //For example to print the header in the required output:
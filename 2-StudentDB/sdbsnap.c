@@ -0,0 +1,460 @@
+#define _GNU_SOURCE     // SEEK_DATA, copy_file_range()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+#include "sdbring.h"
+#include "sdbsnap.h"
+
+/*
+ *  Snapshots
+ *
+ *  sdbsc -s saves a consistent image of the db while other processes keep
+ *  writing to it, see sdbsnap.h for the layout of the snapshot directory.
+ *  The first snapshot, and any snapshot after the db was compressed,
+ *  zeroed or its bitmap rebuilt, is full: snapshot_full() copies the data
+ *  file, with a reflink (FICLONE) where the filesystem can share the
+ *  blocks, and brings the copy up to date from the write ahead log.  After
+ *  that the bitmap sidecar keeps a bit for every slot written since the
+ *  last snapshot, so the next one only saves those records.
+ *
+ *  sdbsc -R rebuilds the db as it was at one snapshot into a new file: it
+ *  copies the nearest full snapshot before it and applies the incremental
+ *  ones in between, checking that each one names the previous one as its
+ *  parent.
+ */
+
+typedef struct snap_entry {
+    int seq;
+    bool full;
+    uint64_t id;
+    uint64_t parent;        // 0 for a full snapshot
+} snap_entry_t;
+
+static void snap_file(char *path, size_t size, const char *dir,
+                      const snap_entry_t *e)
+{
+    snprintf(path, size, "%s/%06d%s", dir, e->seq, e->full ? ".db" : ".inc");
+}
+
+//a new snapshot id, never 0, and different for two runs in the same ns
+static uint64_t snap_new_id(void)
+{
+    struct timespec ts;
+    uint64_t id;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    id = ((uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec) ^
+         ((uint64_t)getpid() << 40);
+    return (id != 0) ? id : 1;
+}
+
+/*
+ *  Reads every line of the manifest in dir into a malloc()ed array, which
+ *  the caller frees.  A missing manifest has no entries.  Returns the
+ *  number of entries, or ERR_DB_FILE if the manifest cannot be read.
+ */
+static int snap_manifest_load(const char *dir, snap_entry_t **entries)
+{
+    char path[512], line[128], kind[8];
+    snap_entry_t *list = NULL, e;
+    int n = 0, cap = 0;
+    FILE *f;
+
+    *entries = NULL;
+    snprintf(path, sizeof(path), "%s/%s", dir, SNAP_MANIFEST);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return (errno == ENOENT) ? 0 : ERR_DB_FILE;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%d %7s %" SCNx64 " %" SCNx64,
+                   &e.seq, kind, &e.id, &e.parent) != 4)
+            continue;       // a line torn by a crash, never committed
+        e.full = (strcmp(kind, SNAP_KIND_FULL) == 0);
+        if (n == cap) {
+            snap_entry_t *grown;
+
+            cap = (cap > 0) ? cap * 2 : 16;
+            grown = realloc(list, cap * sizeof(snap_entry_t));
+            if (grown == NULL) {
+                free(list);
+                fclose(f);
+                return ERR_DB_FILE;
+            }
+            list = grown;
+        }
+        list[n++] = e;
+    }
+    fclose(f);
+    *entries = list;
+    return n;
+}
+
+/*
+ *  copy_db_file
+ *      src_fd:  file to copy
+ *      dst_fd:  empty file, open for writing
+ *
+ *  Makes dst_fd a copy of src_fd.  A reflink is tried first, it shares the
+ *  blocks until either file writes to them and takes no time at all.
+ *  Otherwise only the allocated extents of src_fd are copied, with
+ *  copy_file_range() or pread()/pwrite() if that is not supported, so the
+ *  holes of a sparse db stay holes.
+ *
+ *  returns:  NO_ERROR       dst_fd is a copy of src_fd
+ *            ERR_DB_FILE    I/O error on either file
+ *
+ *  console:  Does not produce any console I/O
+ */
+int copy_db_file(int src_fd, int dst_fd)
+{
+    static char buff[1 << 20];
+    bool ranged = true;
+    struct stat st;
+    off_t pos = 0;
+
+    if (fstat(src_fd, &st) < 0)
+        return ERR_DB_FILE;
+#ifdef FICLONE
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0)
+        return NO_ERROR;
+#endif
+
+    while (pos < st.st_size) {
+        off_t start = lseek(src_fd, pos, SEEK_DATA);
+        off_t end;
+
+        if (start < 0 && errno == ENXIO)
+            break;          // only a hole is left
+        if (start < 0) {
+            start = pos;    // no SEEK_DATA, copy everything
+            end = st.st_size;
+        } else {
+            end = lseek(src_fd, start, SEEK_HOLE);
+            if (end < 0 || end > st.st_size)
+                end = st.st_size;
+        }
+
+        while (start < end) {
+            ssize_t n = -1;
+
+            if (ranged) {
+                loff_t in = start, out = start;
+
+                n = copy_file_range(src_fd, &in, dst_fd, &out, end - start, 0);
+                if (n < 0 && errno != EINTR)
+                    ranged = false;     // redone below, and from now on
+            }
+            if (!ranged) {
+                size_t want = (end - start < (off_t)sizeof(buff)) ?
+                              (size_t)(end - start) : sizeof(buff);
+
+                n = pread(src_fd, buff, want, start);
+                if (n > 0 && pwrite(dst_fd, buff, n, start) != n)
+                    return ERR_DB_FILE;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return ERR_DB_FILE;
+            if (n == 0)
+                break;      // the file shrank under us
+            start += n;
+        }
+        pos = end;
+    }
+    return (ftruncate(dst_fd, st.st_size) < 0) ? ERR_DB_FILE : NO_ERROR;
+}
+
+/*
+ *  Writes an incremental snapshot: the header and slot numbers, then the
+ *  records at the next SNAP_ALIGN boundary.  Returns NO_ERROR or
+ *  ERR_DB_FILE.
+ */
+static int snap_write_inc(int dst_fd, uint64_t id, uint64_t parent,
+                          const int32_t *slots, const student_t *recs,
+                          int count)
+{
+    size_t head_len = sizeof(snap_inc_t) + (size_t)count * sizeof(int32_t);
+    size_t recs_offset = (head_len + SNAP_ALIGN - 1) & ~(size_t)(SNAP_ALIGN - 1);
+    char *head = calloc(1, recs_offset);
+    ring_op_t ops[2];
+    snap_inc_t *h = (snap_inc_t *)head;
+    int rc = NO_ERROR;
+
+    if (head == NULL)
+        return ERR_DB_FILE;
+    h->magic = SNAP_INC_MAGIC;
+    h->version = SNAP_INC_VERSION;
+    h->id = id;
+    h->parent = parent;
+    h->count = count;
+    h->recs_offset = recs_offset;
+    memcpy(head + sizeof(snap_inc_t), slots, (size_t)count * sizeof(int32_t));
+
+    ops[0] = (ring_op_t){head, recs_offset, 0, 0};
+    ops[1] = (ring_op_t){(void *)recs, (size_t)count * STUDENT_RECORD_SIZE,
+                         recs_offset, 0};
+    if (ring_write(dst_fd, ops, count > 0 ? 2 : 1) != NO_ERROR ||
+        ops[0].res != (ssize_t)ops[0].len ||
+        (count > 0 && ops[1].res != (ssize_t)ops[1].len))
+        rc = ERR_DB_FILE;
+    free(head);
+    return rc;
+}
+
+/*
+ *  snapshot_db
+ *      fd:   linux file descriptor
+ *      dir:  snapshot directory, created if it does not exist
+ *
+ *  Saves a snapshot of the db, see "Snapshots" above.  The manifest is
+ *  locked while the snapshot is taken, so two sdbsc -s runs take their
+ *  turns.  The snapshot file is synced before its manifest line is
+ *  written, and a line is only trusted if it was written whole, so a crash
+ *  leaves either the old or the new set of snapshots.
+ *
+ *  returns:  <number>       seq of the new snapshot
+ *            ERR_DB_FILE    database or snapshot I/O issue
+ *
+ *  console:  M_SNAP_FULL or M_SNAP_INC on success
+ *            M_ERR_SNAP_WRITE on error
+ */
+int snapshot_db(int fd, const char *dir)
+{
+    char path[512], line[128];
+    snap_entry_t *entries, e = {0};
+    int32_t *slots = NULL;
+    student_t *recs = NULL;
+    int n, changed = ERR_DB_OP, mfd, dst_fd = -1, rc = ERR_DB_FILE;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        printf(M_ERR_SNAP_WRITE, dir);
+        return ERR_DB_FILE;
+    }
+    snprintf(path, sizeof(path), "%s/%s", dir, SNAP_MANIFEST);
+    mfd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (mfd < 0 || flock(mfd, LOCK_EX) < 0) {
+        printf(M_ERR_SNAP_WRITE, dir);
+        if (mfd >= 0)
+            close(mfd);
+        return ERR_DB_FILE;
+    }
+
+    n = snap_manifest_load(dir, &entries);
+    if (n < 0)
+        goto out;
+    e.seq = (n > 0) ? entries[n - 1].seq + 1 : 1;
+    e.id = snap_new_id();
+    if (n > 0)
+        changed = snapshot_changes(fd, entries[n - 1].id, e.id, &slots, &recs);
+    if (changed == ERR_DB_FILE)
+        goto out;
+    e.full = (changed == ERR_DB_OP);
+    e.parent = e.full ? 0 : entries[n - 1].id;
+
+    snap_file(path, sizeof(path), dir, &e);
+    dst_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dst_fd < 0)
+        goto out;
+    if (e.full)
+        rc = snapshot_full(fd, dst_fd, e.id);
+    else
+        rc = snap_write_inc(dst_fd, e.id, e.parent, slots, recs, changed);
+    if (rc == NO_ERROR && fdatasync(dst_fd) < 0)
+        rc = ERR_DB_FILE;
+
+    if (rc == NO_ERROR) {
+        int len = snprintf(line, sizeof(line), "%d %s %016" PRIx64 " %016" PRIx64 "\n",
+                           e.seq, e.full ? SNAP_KIND_FULL : SNAP_KIND_INC,
+                           e.id, e.parent);
+
+        if (write(mfd, line, len) != len || fdatasync(mfd) < 0)
+            rc = ERR_DB_FILE;
+    }
+
+out:
+    if (dst_fd >= 0) {
+        close(dst_fd);
+        if (rc != NO_ERROR)
+            unlink(path);
+    }
+    if (rc != NO_ERROR) {
+        // the changed bits may have moved on to a snapshot that was not
+        // saved, so the next one has to be full
+        snapshot_forget(fd);
+        printf(M_ERR_SNAP_WRITE, dir);
+    } else if (e.full) {
+        printf(M_SNAP_FULL, e.seq, path);
+    } else {
+        printf(M_SNAP_INC, e.seq, path, changed);
+    }
+    free(entries);
+    free(slots);
+    free(recs);
+    close(mfd);     // drops the lock
+    return (rc == NO_ERROR) ? e.seq : ERR_DB_FILE;
+}
+
+/*
+ *  Applies the incremental snapshot in path, which must be snapshot e, to
+ *  dst_fd.  Returns NO_ERROR, or ERR_DB_FILE if the file cannot be read or
+ *  does not match the manifest.
+ */
+static int snap_apply_inc(int dst_fd, const char *path, const snap_entry_t *e)
+{
+    int32_t *slots = NULL;
+    student_t *recs = NULL;
+    ring_op_t *ops = NULL;
+    snap_inc_t h;
+    struct stat st;
+    int rc = ERR_DB_FILE;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return ERR_DB_FILE;
+    if (fstat(fd, &st) < 0 || pread(fd, &h, sizeof(h), 0) != sizeof(h) ||
+        h.magic != SNAP_INC_MAGIC || h.version != SNAP_INC_VERSION ||
+        h.id != e->id || h.parent != e->parent ||
+        h.recs_offset < sizeof(h) + (uint64_t)h.count * sizeof(int32_t) ||
+        h.recs_offset + (uint64_t)h.count * STUDENT_RECORD_SIZE >
+            (uint64_t)st.st_size)
+        goto out;
+
+    slots = malloc((h.count > 0 ? h.count : 1) * sizeof(int32_t));
+    recs = malloc((h.count > 0 ? h.count : 1) * STUDENT_RECORD_SIZE);
+    ops = malloc((h.count > 0 ? h.count : 1) * sizeof(ring_op_t));
+    if (slots == NULL || recs == NULL || ops == NULL)
+        goto out;
+    if (pread(fd, slots, h.count * sizeof(int32_t), sizeof(h)) !=
+            (ssize_t)(h.count * sizeof(int32_t)) ||
+        pread(fd, recs, (size_t)h.count * STUDENT_RECORD_SIZE, h.recs_offset) !=
+            (ssize_t)((size_t)h.count * STUDENT_RECORD_SIZE))
+        goto out;
+
+    // The slots are in order, so neighbouring records go out as one write
+    for (uint32_t i = 0; i < h.count; i++) {
+        if (slots[i] < MIN_STD_ID)
+            goto out;
+        ops[i] = (ring_op_t){&recs[i], STUDENT_RECORD_SIZE,
+                             (off_t)slots[i] * STUDENT_RECORD_SIZE, 0};
+    }
+    if (ring_write(dst_fd, ops, h.count) != NO_ERROR)
+        goto out;
+    rc = NO_ERROR;
+    for (uint32_t i = 0; i < h.count; i++) {
+        if (ops[i].res != STUDENT_RECORD_SIZE)
+            rc = ERR_DB_FILE;
+    }
+
+out:
+    free(slots);
+    free(recs);
+    free(ops);
+    close(fd);
+    return rc;
+}
+
+/*
+ *  restore_snapshot
+ *      dir:   snapshot directory
+ *      seq:   snapshot to restore
+ *      path:  db file to create, it must not exist
+ *
+ *  Rebuilds the db as it was at snapshot seq, see "Snapshots" above.  The
+ *  new file has no sidecars yet, they are rebuilt when it is first opened.
+ *  To use it in place of the live db, stop the writers and rename it to
+ *  student.db after removing student.db and its sidecars.
+ *
+ *  returns:  NO_ERROR       path holds the db
+ *            ERR_DB_FILE    the snapshot is missing or damaged, or path
+ *                           could not be created
+ *
+ *  console:  M_SNAP_RESTORED on success
+ *            M_ERR_SNAP_READ or M_ERR_SNAP_DEST on error
+ */
+int restore_snapshot(const char *dir, int seq, const char *path)
+{
+    char file[512];
+    snap_entry_t *entries;
+    int *chain = NULL;
+    int n, len = 0, k = -1, src_fd, dst_fd, rc = ERR_DB_FILE;
+
+    n = snap_manifest_load(dir, &entries);
+    for (int i = 0; i < n; i++) {
+        if (entries[i].seq == seq)
+            k = i;
+    }
+    chain = malloc((n > 0 ? n : 1) * sizeof(int));
+    if (k < 0 || chain == NULL) {
+        printf(M_ERR_SNAP_READ, seq, dir);
+        free(entries);
+        free(chain);
+        return ERR_DB_FILE;
+    }
+
+    // Walk back to the full snapshot the requested one is built on
+    chain[len++] = k;
+    while (!entries[k].full) {
+        int parent = -1;
+
+        for (int i = k - 1; i >= 0 && parent < 0; i--) {
+            if (entries[i].id == entries[k].parent)
+                parent = i;
+        }
+        if (parent < 0) {
+            printf(M_ERR_SNAP_READ, seq, dir);
+            free(entries);
+            free(chain);
+            return ERR_DB_FILE;
+        }
+        chain[len++] = k = parent;
+    }
+
+    dst_fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (dst_fd < 0) {
+        printf(M_ERR_SNAP_DEST, path);
+        free(entries);
+        free(chain);
+        return ERR_DB_FILE;
+    }
+
+    snap_file(file, sizeof(file), dir, &entries[k]);
+    src_fd = open(file, O_RDONLY);
+    if (src_fd >= 0) {
+        rc = copy_db_file(src_fd, dst_fd);
+        close(src_fd);
+    }
+    for (int i = len - 2; i >= 0 && rc == NO_ERROR; i--) {
+        snap_file(file, sizeof(file), dir, &entries[chain[i]]);
+        rc = snap_apply_inc(dst_fd, file, &entries[chain[i]]);
+    }
+    if (rc == NO_ERROR && fdatasync(dst_fd) < 0)
+        rc = ERR_DB_FILE;
+    close(dst_fd);
+
+    if (rc == NO_ERROR) {
+        printf(M_SNAP_RESTORED, seq, path);
+    } else {
+        unlink(path);
+        printf(M_ERR_SNAP_READ, seq, dir);
+    }
+    free(entries);
+    free(chain);
+    return rc;
+}
@@ -0,0 +1,49 @@
+#ifndef __SDBSNAP_H__
+    #define __SDBSNAP_H__
+
+#include <stdint.h>
+
+//Snapshots of a student db, taken by sdbsc -s and restored by sdbsc -R.
+//A snapshot directory holds a text MANIFEST with one line per snapshot,
+//
+//    seq full|inc id parent
+//
+//oldest first, and one file per snapshot named after its seq.  A full
+//snapshot, NNNNNN.db, is a copy of the data file.  An incremental one,
+//NNNNNN.inc, holds the records of the slots written since snapshot parent:
+//a snap_inc_t header, count int32 slot numbers, then count records
+//starting on a SNAP_ALIGN boundary.  A deleted slot is saved as an empty
+//record.  Integers are in the byte order of the host that wrote the file.
+typedef struct snap_inc {
+    uint32_t magic;         // SNAP_INC_MAGIC
+    uint32_t version;       // SNAP_INC_VERSION
+    uint64_t id;            // this snapshot
+    uint64_t parent;        // the snapshot the records are applied on top of
+    uint32_t count;         // slots and records that follow
+    uint32_t reserved;
+    uint64_t recs_offset;   // first record, from the start of the file
+} snap_inc_t;
+
+#define SNAP_INC_MAGIC      0x53424453      // "SDBS"
+#define SNAP_INC_VERSION    1
+#define SNAP_ALIGN          64
+
+#define SNAP_DIR_EXT        ".snap"         //default directory, student.db.snap
+#define SNAP_MANIFEST       "MANIFEST"
+#define SNAP_KIND_FULL      "full"
+#define SNAP_KIND_INC       "inc"
+
+//prototypes
+int copy_db_file(int src_fd, int dst_fd);
+int snapshot_db(int fd, const char *dir);
+int restore_snapshot(const char *dir, int seq, const char *path);
+
+//Output messages
+#define M_SNAP_FULL       "Full snapshot %d saved to %s.\n"
+#define M_SNAP_INC        "Incremental snapshot %d saved to %s, %d changed record(s).\n"
+#define M_SNAP_RESTORED   "Restored snapshot %d to %s.\n"
+#define M_ERR_SNAP_WRITE  "Error writing snapshot to %s, exiting!\n"
+#define M_ERR_SNAP_READ   "Error reading snapshot %d from %s, it is missing or damaged!\n"
+#define M_ERR_SNAP_DEST   "Cant restore to %s, it already exists or cannot be created!\n"
+
+#endif
@@ -0,0 +1,694 @@
+#define _GNU_SOURCE     // accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// database include files
+#include "db.h"
+#include "sdbsc.h"
+#include "sdbsrv.h"
+
+/*
+ *  sdbsc server
+ *
+ *  Every sdbsc command used to be a fresh process that opened the db, mapped
+ *  it and its sidecars, did one operation and flushed everything on close.
+ *  sdbsc -S instead keeps the db open and serves add, get, delete, count and
+ *  print over a Unix domain socket, so a request costs a round trip and the
+ *  operation itself, against mappings that stay hot.  The other options
+ *  open the db locally, except those in SRV_LOCAL_OPS, which empty, pack or
+ *  bulk load the file and are refused while a server is running.
+ *
+ *  The server runs the same sdbsc.c functions as the local path and sends
+ *  back their return codes and any records, and the client prints the same
+ *  messages the local functions would.  A connection may carry any number of
+ *  requests.
+ *
+ *  The server runs a pool of worker threads that all block in accept() on
+ *  the listening socket, and each serves the connection it accepted until
+ *  the client closes it.  The threads share one db handle, sdbsc.c orders
+ *  them with sharded record locks, see "Threads" there.  sdbsc -L is a
+ *  load generator that measures the server as the client count grows.
+ */
+
+static volatile sig_atomic_t server_stop = 0;
+static volatile sig_atomic_t server_failed = 0;  // accept() gave up
+
+//back off between failed accept() calls, doubling up to the max
+#define SRV_ACCEPT_BACKOFF_NS       1000000L
+#define SRV_ACCEPT_BACKOFF_MAX_NS   256000000L
+
+/*
+ *  Reads exactly len bytes.  Returns 1 on success, 0 on EOF before the
+ *  first byte, and -1 on an error or a short read.
+ */
+static int read_full(int fd, void *buff, size_t len)
+{
+    char *p = buff;
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = read(fd, p + done, len - done);
+        if (n < 0 && errno == EINTR && !server_stop)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            return (done == 0) ? 0 : -1;
+        done += n;
+    }
+    return 1;
+}
+
+static int write_full(int fd, const void *buff, size_t len)
+{
+    const char *p = buff;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return ERR_DB_FILE;
+        p += n;
+        len -= n;
+    }
+    return NO_ERROR;
+}
+
+static int send_reply(int cfd, int rc, const student_t *recs, uint32_t count)
+{
+    sdb_reply_t reply = {rc, count};
+
+    if (write_full(cfd, &reply, sizeof(reply)) != NO_ERROR)
+        return ERR_DB_FILE;
+    if (count > 0)
+        return write_full(cfd, recs, count * sizeof(student_t));
+    return NO_ERROR;
+}
+
+typedef struct print_batch {
+    int cfd;
+    uint32_t count;
+    int err;
+    student_t recs[SRV_PRINT_BATCH];
+} print_batch_t;
+
+static int print_batch_add(const student_t *s, void *arg)
+{
+    print_batch_t *pb = arg;
+
+    pb->recs[pb->count++] = *s;
+    if (pb->count == SRV_PRINT_BATCH) {
+        pb->err = send_reply(pb->cfd, NO_ERROR, pb->recs, pb->count);
+        pb->count = 0;
+    }
+    return pb->err;
+}
+
+/*
+ *  Runs one request against the db open on fd and sends the reply.
+ *  Returns NO_ERROR, or ERR_DB_FILE if the client has gone away.
+ */
+static int serve_request(int fd, int cfd, sdb_request_t *req)
+{
+    student_t *s = &req->student;
+    print_batch_t *pb;
+    int rc;
+
+    switch (req->op) {
+    case SDB_OP_ADD:
+        // the same check sdbsc -a makes before it gets here, a client
+        // speaking the protocol directly may have skipped it
+        if (validate_range(s->id, s->gpa) != NO_ERROR)
+            return send_reply(cfd, ERR_DB_RANGE, NULL, 0);
+        s->fname[sizeof(s->fname) - 1] = '\0';
+        s->lname[sizeof(s->lname) - 1] = '\0';
+        rc = add_student(fd, s->id, s->fname, s->lname, s->gpa);
+        return send_reply(cfd, rc, NULL, 0);
+    case SDB_OP_GET:
+        rc = get_student(fd, s->id, s);
+        return send_reply(cfd, rc, s, rc == NO_ERROR ? 1 : 0);
+    case SDB_OP_DEL:
+        rc = del_student(fd, s->id);
+        return send_reply(cfd, rc, NULL, 0);
+    case SDB_OP_COUNT:
+        rc = count_db_records(fd);
+        return send_reply(cfd, rc, NULL, 0);
+    case SDB_OP_PRINT:
+        pb = malloc(sizeof(*pb));
+        if (pb == NULL)
+            return send_reply(cfd, ERR_DB_FILE, NULL, 0);
+        pb->cfd = cfd;
+        pb->count = 0;
+        pb->err = NO_ERROR;
+        rc = for_each_student(fd, print_batch_add, pb);
+        if (pb->err == NO_ERROR && pb->count > 0)
+            pb->err = send_reply(cfd, NO_ERROR, pb->recs, pb->count);
+        if (pb->err == NO_ERROR)
+            pb->err = send_reply(cfd, rc < 0 ? rc : NO_ERROR, NULL, 0);
+        rc = pb->err;
+        free(pb);
+        return rc;
+    default:
+        return send_reply(cfd, ERR_DB_OP, NULL, 0);
+    }
+}
+
+typedef struct srv_worker {
+    pthread_t tid;
+    int fd;                 // the db
+    int lfd;                // listening socket
+    int cfd;                // connection being served, or -1
+} srv_worker_t;
+
+// guards the cfd of every worker, so they can be shut down
+static pthread_mutex_t srv_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *  Decides what a worker does after accept() failed.  Returns true to try
+ *  again, after sleeping *backoff if the process or system is out of
+ *  descriptors or memory, which a retry right away would not fix.  Any
+ *  other error means the listening socket is unusable, so the whole
+ *  server is stopped the same way a SIGTERM would.
+ */
+static bool srv_accept_retry(long *backoff)
+{
+    struct timespec ts;
+
+    switch (errno) {
+    case EINTR:
+    case ECONNABORTED:
+    case EPROTO:
+        return true;
+    case EMFILE:
+    case ENFILE:
+    case ENOBUFS:
+    case ENOMEM:
+        ts.tv_sec = *backoff / 1000000000L;
+        ts.tv_nsec = *backoff % 1000000000L;
+        nanosleep(&ts, NULL);
+        if (*backoff < SRV_ACCEPT_BACKOFF_MAX_NS)
+            *backoff *= 2;
+        return true;
+    default:
+        if (!server_stop) {
+            server_failed = 1;
+            kill(getpid(), SIGTERM);
+        }
+        return false;
+    }
+}
+
+static void *srv_worker(void *arg)
+{
+    srv_worker_t *w = arg;
+    sdb_request_t req;
+    long backoff = SRV_ACCEPT_BACKOFF_NS;
+    int cfd;
+
+    while (!server_stop) {
+        cfd = accept4(w->lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (!srv_accept_retry(&backoff))
+                break;
+            continue;
+        }
+        backoff = SRV_ACCEPT_BACKOFF_NS;
+        pthread_mutex_lock(&srv_mutex);
+        w->cfd = cfd;
+        pthread_mutex_unlock(&srv_mutex);
+
+        while (!server_stop && read_full(cfd, &req, sizeof(req)) == 1) {
+            if (serve_request(w->fd, cfd, &req) != NO_ERROR)
+                break;
+        }
+
+        pthread_mutex_lock(&srv_mutex);
+        w->cfd = -1;
+        pthread_mutex_unlock(&srv_mutex);
+        close(cfd);
+    }
+    return NULL;
+}
+
+/*
+ *  serve_db
+ *      fd:        linux file descriptor of the open db
+ *      sockPath:  path of the Unix domain socket to listen on
+ *      threads:   number of worker threads, each serving one client at a
+ *                 time
+ *
+ *  Serves requests until SIGINT or SIGTERM.  The signals are blocked in
+ *  every thread and picked up with sigwait() here, which then shuts down
+ *  the listening socket and every open connection to wake the workers.  The
+ *  functions behind the requests print their usual messages, which nobody
+ *  would read, so stdout is pointed at /dev/null once the server is ready.
+ *
+ *  returns:  NO_ERROR       server stopped by a signal
+ *            ERR_DB_FILE    the socket could not be set up, or accept()
+ *                           failed for good and stopped the server
+ *
+ *  console:  M_SRV_READY       once the socket is listening
+ *            M_ERR_SRV_SOCKET  error creating the socket or the threads
+ */
+int serve_db(int fd, const char *sockPath, int threads)
+{
+    struct sockaddr_un addr = {0};
+    srv_worker_t *workers;
+    sigset_t stop_sigs;
+    int lfd, sig;
+    int started = 0;
+
+    addr.sun_family = AF_UNIX;
+    if (strlen(sockPath) >= sizeof(addr.sun_path)) {
+        printf(M_ERR_SRV_SOCKET, sockPath);
+        return ERR_DB_FILE;
+    }
+    strcpy(addr.sun_path, sockPath);
+
+    lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0) {
+        printf(M_ERR_SRV_SOCKET, sockPath);
+        return ERR_DB_FILE;
+    }
+    unlink(sockPath);   // left behind by a server that was killed
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(lfd, SOMAXCONN) < 0) {
+        printf(M_ERR_SRV_SOCKET, sockPath);
+        close(lfd);
+        return ERR_DB_FILE;
+    }
+
+    // Block the stop signals before starting threads, they inherit the mask
+    sigemptyset(&stop_sigs);
+    sigaddset(&stop_sigs, SIGINT);
+    sigaddset(&stop_sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_sigs, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (threads < 1)
+        threads = 1;
+    workers = calloc(threads, sizeof(srv_worker_t));
+    for (int i = 0; workers != NULL && i < threads; i++) {
+        workers[i].fd = fd;
+        workers[i].lfd = lfd;
+        workers[i].cfd = -1;
+        if (pthread_create(&workers[i].tid, NULL, srv_worker, &workers[i]) != 0)
+            break;
+        started++;
+    }
+    if (started == 0) {
+        printf(M_ERR_SRV_SOCKET, sockPath);
+        free(workers);
+        close(lfd);
+        unlink(sockPath);
+        return ERR_DB_FILE;
+    }
+
+    printf(M_SRV_READY, sockPath);
+    fflush(stdout);
+    freopen("/dev/null", "w", stdout);
+
+    while (sigwait(&stop_sigs, &sig) != 0)
+        ;
+
+    // Workers check server_stop after publishing their connection, so any
+    // connection accepted from here on is dropped without being read
+    server_stop = 1;
+    shutdown(lfd, SHUT_RDWR);
+    pthread_mutex_lock(&srv_mutex);
+    for (int i = 0; i < started; i++) {
+        if (workers[i].cfd >= 0)
+            shutdown(workers[i].cfd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&srv_mutex);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i].tid, NULL);
+
+    free(workers);
+    close(lfd);
+    unlink(sockPath);
+    return server_failed ? ERR_DB_FILE : NO_ERROR;
+}
+
+/*
+ *  srv_connect
+ *      sockPath:  path of the server's Unix domain socket
+ *
+ *  returns:  a connected socket, or -1 if no server is listening
+ *
+ *  console:  Does not produce any console I/O
+ */
+int srv_connect(const char *sockPath)
+{
+    struct sockaddr_un addr = {0};
+    int sfd;
+
+    if (strlen(sockPath) >= sizeof(addr.sun_path) || access(sockPath, F_OK) < 0)
+        return -1;
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockPath);
+
+    sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sfd < 0)
+        return -1;
+    if (connect(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sfd);
+        return -1;
+    }
+    return sfd;
+}
+
+/*
+ *  Sends a request and reads the first reply, plus its record if there is
+ *  one and s is not NULL.  Returns NO_ERROR or ERR_DB_FILE.
+ */
+static int srv_call(int sfd, sdb_op_t op, const student_t *in,
+                    sdb_reply_t *reply, student_t *s)
+{
+    sdb_request_t req = {0};
+
+    req.op = op;
+    if (in != NULL)
+        req.student = *in;
+    if (write_full(sfd, &req, sizeof(req)) != NO_ERROR ||
+        read_full(sfd, reply, sizeof(*reply)) != 1)
+        return ERR_DB_FILE;
+    if (reply->count == 1 && s != NULL)
+        return read_full(sfd, s, sizeof(*s)) == 1 ? NO_ERROR : ERR_DB_FILE;
+    return (reply->count == 0) ? NO_ERROR : ERR_DB_FILE;
+}
+
+/*
+ *  The client side stand-ins for the sdbsc.c functions below print what
+ *  the local functions would, based on the return code sent back.
+ */
+int srv_add_student(int sfd, int id, char *fname, char *lname, int gpa)
+{
+    student_t s = {0};
+    sdb_reply_t reply;
+
+    s.id = id;
+    s.gpa = gpa;
+    strncpy(s.fname, fname, sizeof(s.fname) - 1);
+    strncpy(s.lname, lname, sizeof(s.lname) - 1);
+    if (srv_call(sfd, SDB_OP_ADD, &s, &reply, NULL) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    switch (reply.rc) {
+    case NO_ERROR:
+        printf(M_STD_ADDED, id);
+        break;
+    case ERR_DB_OP:
+        printf(M_ERR_DB_ADD_DUP, id);
+        break;
+    case ERR_DB_RANGE:
+        printf(M_ERR_STD_RNG);
+        break;
+    default:
+        printf(M_ERR_DB_WRITE);
+        break;
+    }
+    return reply.rc;
+}
+
+int srv_get_student(int sfd, int id, student_t *s)
+{
+    student_t key = {0};
+    sdb_reply_t reply;
+
+    key.id = id;
+    if (srv_call(sfd, SDB_OP_GET, &key, &reply, s) != NO_ERROR)
+        return ERR_DB_FILE;
+    return reply.rc;
+}
+
+int srv_del_student(int sfd, int id)
+{
+    student_t key = {0};
+    sdb_reply_t reply;
+
+    key.id = id;
+    if (srv_call(sfd, SDB_OP_DEL, &key, &reply, NULL) != NO_ERROR) {
+        printf(M_ERR_DB_WRITE);
+        return ERR_DB_FILE;
+    }
+
+    switch (reply.rc) {
+    case NO_ERROR:
+        printf(M_STD_DEL_MSG, id);
+        break;
+    case ERR_DB_OP:
+        printf(M_STD_NOT_FND_MSG, id);
+        break;
+    default:
+        printf(M_ERR_DB_WRITE);
+        break;
+    }
+    return reply.rc;
+}
+
+int srv_count_db_records(int sfd)
+{
+    sdb_reply_t reply;
+
+    if (srv_call(sfd, SDB_OP_COUNT, NULL, &reply, NULL) != NO_ERROR ||
+        reply.rc < 0) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    if (reply.rc == 0)
+        printf(M_DB_EMPTY);
+    else
+        printf(M_DB_RECORD_CNT, reply.rc);
+    return reply.rc;
+}
+
+int srv_print_db(int sfd)
+{
+    student_t recs[SRV_PRINT_BATCH];
+    sdb_request_t req = {0};
+    sdb_reply_t reply;
+    print_buf_t *pb;
+    int rows;
+
+    req.op = SDB_OP_PRINT;
+    if (write_full(sfd, &req, sizeof(req)) != NO_ERROR) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    if ((pb = print_buf_open(STDOUT_FILENO)) == NULL) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+
+    // every reply but the last carries a batch of records
+    while (true) {
+        if (read_full(sfd, &reply, sizeof(reply)) != 1 ||
+            reply.count > SRV_PRINT_BATCH ||
+            (reply.count > 0 &&
+             read_full(sfd, recs, reply.count * sizeof(student_t)) != 1)) {
+            print_buf_close(pb);
+            printf(M_ERR_DB_READ);
+            return ERR_DB_FILE;
+        }
+        if (reply.count == 0)
+            break;
+        for (uint32_t i = 0; i < reply.count; i++)
+            print_buf_row(pb, &recs[i]);
+    }
+
+    rows = print_buf_close(pb);
+    if (reply.rc < 0 || rows < 0) {
+        printf(M_ERR_DB_READ);
+        return ERR_DB_FILE;
+    }
+    if (rows == 0)
+        printf(M_DB_EMPTY);
+    return NO_ERROR;
+}
+
+typedef struct load_worker {
+    pthread_t tid;
+    const char *sockPath;
+    int requests;
+    int write_pct;
+    unsigned int seed;
+    double *latency;        // microseconds per request
+    int err;
+} load_worker_t;
+
+static double elapsed_us(const struct timespec *t0, const struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) * 1e6 + (t1->tv_nsec - t0->tv_nsec) / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ *  One simulated client: its own connection, random ids over the whole id
+ *  space, and write_pct percent adds and deletes mixed into the gets.
+ */
+static void *load_worker(void *arg)
+{
+    load_worker_t *w = arg;
+    struct timespec t0, t1;
+    sdb_reply_t reply;
+    student_t s, found;
+    int sfd = srv_connect(w->sockPath);
+
+    if (sfd < 0) {
+        w->err = ERR_DB_FILE;
+        return NULL;
+    }
+
+    for (int i = 0; i < w->requests; i++) {
+        int pick = rand_r(&w->seed) % 100;
+        sdb_op_t op = SDB_OP_GET;
+
+        memset(&s, 0, sizeof(s));
+        s.id = rand_r(&w->seed) % MAX_STD_ID + MIN_STD_ID;
+        if (pick < w->write_pct) {
+            op = (pick % 2 == 0) ? SDB_OP_ADD : SDB_OP_DEL;
+            snprintf(s.fname, sizeof(s.fname), "load%d", s.id);
+            snprintf(s.lname, sizeof(s.lname), "gen%d", s.id % 97);
+            s.gpa = s.id % (MAX_STD_GPA + 1);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (srv_call(sfd, op, &s, &reply, &found) != NO_ERROR) {
+            w->err = ERR_DB_FILE;
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        w->latency[i] = elapsed_us(&t0, &t1);
+    }
+
+    close(sfd);
+    return NULL;
+}
+
+/*
+ *  Runs threads clients against the server at once, each making requests
+ *  requests, and prints one result row.
+ */
+static int load_round(const char *sockPath, int threads, int requests,
+                      int write_pct)
+{
+    load_worker_t *workers = calloc(threads, sizeof(load_worker_t));
+    double *latency = malloc((size_t)threads * requests * sizeof(double));
+    size_t n = (size_t)threads * requests;
+    struct timespec t0, t1;
+    int started = 0;
+    int rc = NO_ERROR;
+
+    if (workers == NULL || latency == NULL) {
+        free(workers);
+        free(latency);
+        return ERR_DB_FILE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < threads; i++) {
+        workers[i].sockPath = sockPath;
+        workers[i].requests = requests;
+        workers[i].write_pct = write_pct;
+        workers[i].seed = (unsigned int)(t0.tv_nsec + i * 7919);
+        workers[i].latency = latency + (size_t)i * requests;
+        if (pthread_create(&workers[i].tid, NULL, load_worker, &workers[i]) != 0)
+            break;
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].tid, NULL);
+        if (workers[i].err != NO_ERROR)
+            rc = ERR_DB_FILE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (started < threads)
+        rc = ERR_DB_FILE;
+    if (rc == NO_ERROR) {
+        double secs = elapsed_us(&t0, &t1) / 1e6;
+
+        qsort(latency, n, sizeof(double), cmp_double);
+        printf(M_LOAD_ROW, threads, n / secs, latency[n / 2],
+               latency[n * 99 / 100]);
+    }
+
+    free(workers);
+    free(latency);
+    return rc;
+}
+
+/*
+ *  load_db
+ *      sockPath:     path of the server's Unix domain socket
+ *      max_threads:  the largest number of concurrent clients to try
+ *      requests:     requests made by each client per round
+ *      write_pct:    percentage of requests that add or delete a student
+ *
+ *  Load generator for sdbsc -S.  Runs rounds with 1, 2, 4, ... clients up
+ *  to max_threads, each client a thread with its own connection, and
+ *  reports the throughput and the median and 99th percentile latency of
+ *  every round.  Writes go to random ids, so the db is changed.
+ *
+ *  returns:  NO_ERROR       all rounds completed
+ *            ERR_DB_OP      bad arguments
+ *            ERR_DB_FILE    no server, or a request failed
+ *
+ *  console:  M_LOAD_HDR, then M_LOAD_ROW for every round
+ *            M_ERR_LOAD_ARGS   bad arguments
+ *            M_ERR_LOAD_CONN   no server is listening on sockPath
+ */
+int load_db(const char *sockPath, int max_threads, int requests, int write_pct)
+{
+    int sfd;
+
+    if (max_threads < 1 || requests < 1 || write_pct < 0 || write_pct > 100) {
+        printf(M_ERR_LOAD_ARGS);
+        return ERR_DB_OP;
+    }
+
+    sfd = srv_connect(sockPath);
+    if (sfd < 0) {
+        printf(M_ERR_LOAD_CONN, sockPath);
+        return ERR_DB_FILE;
+    }
+    close(sfd);
+
+    printf(M_LOAD_HDR, "THREADS", "OPS/SEC", "P50(us)", "P99(us)");
+    for (int threads = 1; ; ) {
+        if (load_round(sockPath, threads, requests, write_pct) != NO_ERROR) {
+            printf(M_ERR_LOAD_CONN, sockPath);
+            return ERR_DB_FILE;
+        }
+        fflush(stdout);
+        if (threads == max_threads)
+            break;
+        // always finish with the requested count
+        threads = (threads > max_threads / 2) ? max_threads : threads * 2;
+    }
+    return NO_ERROR;
+}
@@ -0,0 +1,64 @@
+#ifndef __SDBSRV_H__
+    #define __SDBSRV_H__
+
+#include <stdint.h>
+#include "db.h" //get student record type
+
+//Wire protocol between sdbsc -S and the sdbsc client.  Every request is one
+//fixed size sdb_request_t, answered by one sdb_reply_t followed by count
+//student records.  print answers with several replies, the last one has a
+//count of zero and carries the final return code.  Both ends run on the
+//same host, so the structs are sent in native byte order.
+typedef enum {
+    SDB_OP_ADD = 1,     // student: id, fname, lname, gpa
+    SDB_OP_GET,         // student.id
+    SDB_OP_DEL,         // student.id
+    SDB_OP_COUNT,
+    SDB_OP_PRINT,
+} sdb_op_t;
+
+typedef struct sdb_request {
+    uint32_t op;            // sdb_op_t
+    uint32_t reserved;
+    student_t student;
+} sdb_request_t;
+
+typedef struct sdb_reply {
+    int32_t rc;             // what the sdbsc.c function returned
+    uint32_t count;         // student records following the reply
+} sdb_reply_t;
+
+//options forwarded to a running server, the rest always run locally
+#define SRV_OPS         "acdfp"
+
+//options that rewrite the db, refused while a server has it open
+#define SRV_LOCAL_OPS   "bBxXz"
+
+//records sent per print reply
+#define SRV_PRINT_BATCH 256
+
+//server side
+int serve_db(int fd, const char *sockPath, int threads);
+
+//client side, same return values and console output as the sdbsc.c
+//functions they stand in for
+int srv_connect(const char *sockPath);
+int srv_add_student(int sfd, int id, char *fname, char *lname, int gpa);
+int srv_get_student(int sfd, int id, student_t *s);
+int srv_del_student(int sfd, int id);
+int srv_count_db_records(int sfd);
+int srv_print_db(int sfd);
+
+//load generator
+int load_db(const char *sockPath, int max_threads, int requests, int write_pct);
+
+//Output messages
+#define M_SRV_READY       "Serving requests on %s\n"
+#define M_ERR_SRV_SOCKET  "Error creating server socket %s, exiting!\n"
+#define M_ERR_SRV_RUNNING "sdbsc -S is serving %s, stop it before using -%c\n"
+#define M_ERR_LOAD_ARGS   "Load test needs threads >= 1, requests >= 1 and 0 <= write_pct <= 100\n"
+#define M_ERR_LOAD_CONN   "Error talking to a server on %s, is sdbsc -S running?\n"
+#define M_LOAD_HDR        "%-8s %12s %10s %10s\n"
+#define M_LOAD_ROW        "%-8d %12.0f %10.1f %10.1f\n"
+
+#endif
@@ -6,6 +6,9 @@ setup_file() {
     if [ -f "student.db" ]; then
         rm "student.db"
     fi
+    rm -f "student.db.bmp" "student.db.idx" "student.db.crc" "student.db.wal" \
+        "student.db.sock"
+    rm -rf "student.db.snap"
 }
 
 @test "Check if database is empty to start" {
@@ -192,4 +195,461 @@ setup_file() {
         echo "Failed Output:  $output"
         return 1
     }
-}
\ No newline at end of file
+}
+
+@test "Batch load students from stdin" {
+    run ./sdbsc -z
+    [ "$status" -eq 0 ]
+
+    run bash -c 'printf "1,john,doe,345\n3 jane doe 390\n# comment\n99999,big,dude,205\n" | ./sdbsc -b'
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Batch loaded 3 student(s), 0 rejected." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 3 student record(s)." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+}
+
+@test "Batch load rejects duplicates and bad rows but keeps the rest" {
+    run bash -c 'printf "3,dup,student,300\n4,new,student,300\n0,bad,id,100\nnot a row\n" | ./sdbsc -b'
+    [ "$status" -eq 1 ] || {
+        echo "Expecting status of 1, got:  $status"
+        return 1
+    }
+    [ "${lines[0]}" = "Cant add student with ID=3, already exists in db." ]
+    [ "${lines[3]}" = "Batch loaded 1 student(s), 3 rejected." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -f 4
+    [ "$status" -eq 0 ]
+}
+
+@test "Batch load rejects overflowing ids and over-long lines" {
+    run ./sdbsc -z
+    long=$(printf 'x%.0s' $(seq 300))
+    run bash -c "printf '4294967297,wrap,around,300\n8,$long,name,300\n9,fits,fine,300\n' | ./sdbsc -b"
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Skipping malformed input on line 1." ]
+    [ "${lines[1]}" = "Skipping line 2, it is longer than 254 characters." ]
+    [ "${lines[2]}" = "Batch loaded 1 student(s), 2 rejected." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -f 1
+    [ "$status" -eq 1 ]
+    run ./sdbsc -f 9
+    [ "$status" -eq 0 ]
+}
+
+@test "Occupancy bitmap is rebuilt when the sidecar is missing" {
+    run ./sdbsc -z
+    run ./sdbsc -a 7 bit map 300
+    run ./sdbsc -a 99999 big dude 205
+    rm -f student.db.bmp
+
+    run ./sdbsc -c
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Database contains 2 student record(s)." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+    [ -f student.db.bmp ]
+}
+
+@test "Query by gpa range and last name prefix" {
+    run ./sdbsc -z
+    run bash -c 'printf "1,john,smith,345\n2,jane,smythe,390\n3,jim,doe,285\n4,sam,smith,410\n" | ./sdbsc -b'
+
+    run ./sdbsc -q gpa=300:400 out=count
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Query matched 2 student record(s)." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    # a range wider than half the int range must not wrap around
+    run ./sdbsc -q id=-2147483648:2147483647 gpa=-2000000000:2000000000 out=count
+    [ "${lines[0]}" = "Query matched 4 student record(s)." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -q lname=sm* out=ids
+    [ "$status" -eq 0 ]
+    [ "$output" = "$(printf '1\n2\n4')" ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -q lname=smith gpa=400:
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 4 sam smith 4.10" ] || {
+        echo "Failed Output:  $normalized_output"
+        return 1
+    }
+}
+
+@test "Find students by last name through the name index" {
+    run ./sdbsc -z
+    run ./sdbsc -a 10 john smith 345
+    run ./sdbsc -a 20 adam smith 300
+    run ./sdbsc -a 30 jane doe 390
+
+    run ./sdbsc -n smith
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 20 adam smith 3.00 10 john smith 3.45" ] || {
+        echo "Failed Output:  $normalized_output"
+        return 1
+    }
+
+    run ./sdbsc -d 20
+    run ./sdbsc -n smith adam
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "No student named smith was found in database." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    # '*' is part of the name, with or without the index
+    run ./sdbsc -n 'smi*'
+    [ "$status" -eq 1 ]
+    rm -f student.db.idx
+    mkdir student.db.idx
+    run ./sdbsc -n 'smi*'
+    rmdir student.db.idx
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "No student named smi* was found in database." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+}
+
+@test "Compaction keeps records addressable" {
+    run ./sdbsc -z
+    run ./sdbsc -a 1 john doe 345
+    run ./sdbsc -a 200 jane doe 390
+    run ./sdbsc -a 300 adam smith 300
+    run ./sdbsc -d 200
+
+    run ./sdbsc -X
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Compaction complete, reclaimed 1 block(s)." ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 2 student record(s)." ]
+
+    run ./sdbsc -f 300
+    [ "$status" -eq 0 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 300 adam smith 3.00" ]
+}
+
+@test "Concurrent adds of the same id only succeed once" {
+    run ./sdbsc -z
+
+    run bash -c 'for i in 1 2 3 4 5 6 7 8; do ./sdbsc -a 42 racer $i 300 & done; wait'
+    added=$(echo "$output" | grep -c "Student 42 added to database.")
+    [ "$added" -eq 1 ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 1 student record(s)." ]
+
+    [ "$(stat -c %s student.db.wal)" -eq 4096 ]
+}
+
+@test "Requests are forwarded to a running server" {
+    run ./sdbsc -z
+    run ./sdbsc -a 1 john doe 345
+
+    ./sdbsc -S > /dev/null 3>&- &
+    server=$!
+    for i in $(seq 1 50); do
+        [ -S student.db.sock ] && break
+        sleep 0.1
+    done
+
+    run ./sdbsc -a 2 jane doe 390
+    [ "$output" = "Student 2 added to database." ]
+    run ./sdbsc -a 2 jane doe 390
+    [ "$status" -eq 1 ]
+    run ./sdbsc -f 1
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 1 john doe 3.45" ] || {
+        echo "Failed Output:  $normalized_output"
+        kill $server
+        return 1
+    }
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 2 student record(s)." ]
+
+    # options that rewrite the file would pull it from under the server
+    run ./sdbsc -z
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "sdbsc -S is serving student.db, stop it before using -z" ] || {
+        echo "Failed Output:  $output"
+        kill $server
+        return 1
+    }
+    run ./sdbsc -x
+    [ "$status" -eq 1 ]
+
+    kill $server
+    wait $server
+    [ ! -e student.db.sock ]
+
+    run ./sdbsc -f 2
+    [ "$status" -eq 0 ]
+}
+
+@test "Server threads only add the same id once" {
+    run ./sdbsc -z
+
+    ./sdbsc -S 4 > /dev/null 3>&- &
+    server=$!
+    for i in $(seq 1 50); do
+        [ -S student.db.sock ] && break
+        sleep 0.1
+    done
+
+    run bash -c 'for i in 1 2 3 4 5 6 7 8; do ./sdbsc -a 42 racer $i 300 & done; wait'
+    added=$(echo "$output" | grep -c "Student 42 added to database.")
+
+    run timeout 60 ./sdbsc -L 3 50 10
+    load3_lines=${#lines[@]}
+    run ./sdbsc -L 2 200 50
+    kill $server
+    wait $server
+    [ "$load3_lines" -eq 4 ]
+
+    [ "$added" -eq 1 ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+    [ "${lines[0]}" = "THREADS       OPS/SEC    P50(us)    P99(us)" ]
+    [ "${#lines[@]}" -eq 3 ]
+}
+
+@test "Columnar export and import round trip" {
+    run ./sdbsc -z
+    run bash -c 'printf "1,john,doe,345\n3,jane,doe,390\n99999,big,dude,205\n" | ./sdbsc -b'
+    run ./sdbsc -p
+    before="$output"
+
+    run ./sdbsc -e students.col dict
+    [ "${lines[0]}" = "Exported 3 student record(s) to students.col." ]
+    # gpa column of the 3 rows, the offset is in the header
+    gpa_off=$(od -A n -t u4 -j 64 -N 4 students.col | tr -d ' ')
+    [ "$(od -A n -t d4 -j "$gpa_off" -N 12 students.col | xargs)" = "345 390 205" ]
+
+    run ./sdbsc -z
+    run ./sdbsc -i students.col
+    [ "${lines[0]}" = "Batch loaded 3 student(s), 0 rejected." ]
+    run ./sdbsc -p
+    [ "$output" = "$before" ]
+
+    head -c 100 students.col > damaged.col
+    run ./sdbsc -i damaged.col
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Error reading columnar file damaged.col, it is missing or damaged!" ]
+    rm -f students.col damaged.col
+}
+
+@test "Benchmark reports every operation on both engines" {
+    run ./sdbsc -T 1000 20 csv
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "engine,op,cache,max_id,density,samples,ops_per_sec,p50_us,p90_us,p99_us,max_us" ]
+    [ "${#lines[@]}" -eq 21 ]
+    [ "$(echo "$output" | grep -c '^rw,')" -eq 10 ]
+    [ "$(echo "$output" | grep -c ',cold,')" -eq 10 ]
+    [ -z "$(ls -d .sdbbench.* 2> /dev/null)" ]
+
+    run ./sdbsc -T 1000 0 csv
+    [ "$status" -eq 2 ]
+}
+
+@test "Header records the id range of the db" {
+    run env SDB_MAX_ID=500000 ./sdbsc -z
+    run ./sdbsc -a 400000 far away 300
+    [ "${lines[0]}" = "Student 400000 added to database." ]
+    run ./sdbsc -a 500001 too far 300
+    [ "$status" -eq 2 ]
+
+    # the id range only comes from the environment for a new or zeroed db
+    run env SDB_MAX_ID=lots ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 1 student record(s)." ]
+    run env SDB_MAX_ID=5000000000 ./sdbsc -z
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "SDB_MAX_ID must be a number from 1 to 33554431, exiting!" ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 1 student record(s)." ]
+
+    run ./sdbsc -z
+    run ./sdbsc -a 400000 far away 300
+    [ "$status" -eq 2 ]
+    [ "${lines[0]}" = "Cant add student, either ID or GPA out of allowable range!" ]
+
+    # a header with 128 byte records
+    printf '\0\0\0\0SDBH\1\0\0\0\1\0\0\0\1\0\0\0\xa0\x86\1\0\x80\0\0\0\x18\0\0\0\x20\0\0\0' > student.db
+    head -c 28 /dev/zero >> student.db
+    run ./sdbsc -c
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "DB file header is not supported by this build, exiting!" ]
+
+    run ./sdbsc -z
+    [ "$status" -eq 0 ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains no student records." ]
+}
+
+@test "Print pads and rounds every row like printf" {
+    run ./sdbsc -z
+    run ./sdbsc -a 1 Al Bo 0
+    run ./sdbsc -a 99999 AbcdefghijklmnopqrstuvwxyzAbcdef Lastname 5
+    run ./sdbsc -a 100000 Mo AbcdefghijklmnopqrstuvwxyzAbcdefghij 400
+
+    run ./sdbsc -p
+    [ "$status" -eq 0 ]
+    [ "${#lines[@]}" -eq 4 ]
+    [ "${lines[1]}" = "$(printf '%-6d %-24.24s %-32.32s %-3.2f' 1 Al Bo 0)" ]
+    [ "${lines[2]}" = "$(printf '%-6d %-24.24s %-32.32s %-3.2f' 99999 Abcdefghijklmnopqrstuvw Lastname 0.05)" ]
+    [ "${lines[3]}" = "$(printf '%-6d %-24.24s %-32.32s %-3.2f' 100000 Mo AbcdefghijklmnopqrstuvwxyzAbcde 4.00)" ]
+}
+
+@test "Parallel scan matches the single threaded scan" {
+    run env SDB_MAX_ID=200000 ./sdbsc -z
+    for id in 3 16000 16385 50000 131072 199999; do
+        ./sdbsc -a $id first$id last$id 300 > /dev/null
+    done
+    ./sdbsc -d 16385 > /dev/null
+    expected="$(./sdbsc -p)"
+
+    run env SDB_SCAN_THREADS=4 ./sdbsc -p
+    [ "$status" -eq 0 ]
+    [ "$output" = "$expected" ]
+    [ "${#lines[@]}" -eq 6 ]
+
+    run env SDB_SCAN_THREADS=4 ./sdbsc -x
+    [ "$status" -eq 0 ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 5 student record(s)." ]
+    run ./sdbsc -p
+    [ "$output" = "$expected" ]
+}
+
+@test "Batched find looks up every listed id" {
+    run ./sdbsc -z
+    run ./sdbsc -a 5 ann lee 350
+    run ./sdbsc -a 6 bob ray 275
+    run ./sdbsc -a 90000 cy fox 199
+
+    run bash -c "printf '90000\n7\n5\n6\n' | SDB_ENGINE=rw ./sdbsc -F"
+    [ "$status" -eq 1 ]
+    [ "${#lines[@]}" -eq 5 ]
+    [ "${lines[1]}" = "90000  cy                       fox                              1.99" ]
+    [ "${lines[2]}" = "5      ann                      lee                              3.50" ]
+    [ "${lines[4]}" = "Student 7 was not found in database." ]
+
+    printf '5\n6\n' > ids.txt
+    run env SDB_IO=sync ./sdbsc -F ids.txt
+    [ "$status" -eq 0 ]
+    [ "${#lines[@]}" -eq 3 ]
+    rm -f ids.txt
+}
+
+@test "Snapshots restore the db as it was" {
+    rm -rf student.db.snap snap1.db snap2.db
+    run ./sdbsc -z
+    run ./sdbsc -a 1 ann lee 350
+    run ./sdbsc -a 2 bob ray 275
+    run ./sdbsc -s
+    [ "$status" -eq 0 ]
+    [ "$output" = "Full snapshot 1 saved to student.db.snap/000001.db." ]
+    first="$(./sdbsc -p)"
+
+    run ./sdbsc -d 2
+    run ./sdbsc -a 64000 cy fox 199
+    run ./sdbsc -s
+    [ "$status" -eq 0 ]
+    [ "$output" = "Incremental snapshot 2 saved to student.db.snap/000002.inc, 2 changed record(s)." ]
+    second="$(./sdbsc -p)"
+    run ./sdbsc -a 3 dee kim 100
+
+    run ./sdbsc -R 1 snap1.db
+    [ "$status" -eq 0 ]
+    run ./sdbsc -R 2 snap2.db
+    [ "$status" -eq 0 ]
+    run ./sdbsc -R 2 snap2.db
+    [ "$status" -eq 1 ]
+    mkdir -p snapdir
+    mv snap1.db snapdir/student.db
+    [ "$(cd snapdir && ../sdbsc -p)" = "$first" ]
+    rm -f snapdir/student.db*
+    mv snap2.db snapdir/student.db
+    [ "$(cd snapdir && ../sdbsc -p)" = "$second" ]
+    rm -rf snapdir student.db.snap
+}
+
+@test "Verify finds and clears a torn record" {
+    run ./sdbsc -z
+    run ./sdbsc -a 1 ann lee 350
+    run ./sdbsc -a 5 bob ray 275
+    run ./sdbsc -V
+    [ "$status" -eq 0 ]
+    [ "$output" = "Verified 100000 slot(s), 0 failed their checksum." ]
+
+    # change the gpa bytes of student 5 behind the db's back
+    printf '\007' | dd of=student.db bs=1 seek=382 conv=notrunc status=none
+    run ./sdbsc -f 5
+    [ "$status" -eq 1 ]
+    [ "$output" = "Student 5 failed its checksum, run sdbsc -V to check the db." ]
+    run bash -c 'printf "1\n5\n" | ./sdbsc -F'
+    [ "$status" -eq 1 ]
+    normalized_output=$(echo -n "$output" | tr -s '[:space:]' ' ')
+    [ "$normalized_output" = "ID FIRST_NAME LAST_NAME GPA 1 ann lee 3.50 Student 5 failed its checksum, run sdbsc -V to check the db." ] || {
+        echo "Failed Output:  $normalized_output"
+        return 1
+    }
+
+    run env SDB_SIMD=scalar ./sdbsc -V
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "Slot 5 failed its checksum." ]
+    [ "${lines[1]}" = "Verified 100000 slot(s), 1 failed their checksum." ]
+
+    run ./sdbsc -V repair
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "Slot 5 failed its checksum and was cleared." ]
+    run ./sdbsc -V
+    [ "$status" -eq 0 ]
+    run ./sdbsc -c
+    [ "${lines[0]}" = "Database contains 1 student record(s)." ]
+
+    # a torn last name must not leave the old index entry behind
+    run ./sdbsc -a 5 bob ray 275
+    printf 'x' | dd of=student.db bs=1 seek=348 conv=notrunc status=none
+    run ./sdbsc -V repair
+    [ "$status" -eq 0 ]
+    run ./sdbsc -a 5 bob ray 275
+    run ./sdbsc -n ray
+    [ "${#lines[@]}" -eq 2 ] || {
+        echo "Failed Output:  $output"
+        return 1
+    }
+}
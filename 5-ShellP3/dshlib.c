@@ -1,10 +1,16 @@
+#define _GNU_SOURCE     // pipe2(), environ
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 #include "dshlib.h"
@@ -59,6 +65,12 @@
   */
  static int last_return_code = 0;
  
+ /*
+  * Launch with fork() and execv() instead of posix_spawn(), set from
+  * DSH_SPAWN by exec_local_cmd_loop()
+  */
+ static bool spawn_fork = false;
+ 
  /* 
   * Helper function to trim leading and trailing whitespace
   */
@@ -78,33 +90,278 @@
  }
  
  /*
-  * Allocates memory for a command buffer
+  * Command line arena
+  *
+  * Everything parsed from a command line, its tokens, the argv arrays and
+  * the command list, lives only until the line has run.  Rather than malloc and free each
+  * piece, exec_local_cmd_loop() owns an arena: a chain of blocks that
+  * allocations are bumped out of and that is rewound, not freed, before
+  * the next line.  Blocks are only ever added, when a line needs more
+  * than the arena has held before, so once the shell has seen its
+  * longest line parsing makes no heap allocations at all.
+  *
+  * Every malloc() and strdup() in dshlib.c goes through dsh_malloc() or
+  * dsh_strdup() and is counted, and the allocs builtin reports the count
+  * for the previous line so tests can check parsing stays at 0.  What the
+  * C library allocates on its own is not seen: getline() growing the line
+  * buffer, posix_spawn() file actions, stdio buffers.  So the count covers
+  * lexing and parsing a line, not running it.
+  */
+ static unsigned long heap_allocs = 0;
+ static unsigned long last_line_allocs = 0;
+ 
+ static void *dsh_malloc(size_t size) {
+     heap_allocs++;
+     return malloc(size);
+ }
+ 
+ static char *dsh_strdup(const char *str) {
+     heap_allocs++;
+     return strdup(str);
+ }
+ 
+ /*
+  * Returns the number of heap allocations dshlib.c has made through
+  * dsh_malloc() and dsh_strdup()
+  */
+ unsigned long dsh_heap_allocs(void) {
+     return heap_allocs;
+ }
+ 
+ /*
+  * Hands out size bytes from the arena, aligned for any type, moving on
+  * to the next block that fits and adding one when none does
+  * Returns the memory, or NULL if a block could not be allocated
+  */
+ void *arena_alloc(arena_t *arena, size_t size) {
+     const size_t align = _Alignof(max_align_t);
+     size = (size + align - 1) & ~(align - 1);
+     
+     while (!arena->cur || arena->used + size > arena->cur->size) {
+         arena_block_t *next = arena->cur ? arena->cur->next : arena->head;
+         
+         if (!next) {
+             size_t block = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+             next = dsh_malloc(sizeof(arena_block_t) + block);
+             if (!next) return NULL;
+             next->next = NULL;
+             next->size = block;
+             if (arena->cur) {
+                 arena->cur->next = next;
+             } else {
+                 arena->head = next;
+             }
+         }
+         arena->cur = next;
+         arena->used = 0;
+     }
+     
+     void *p = arena->cur->data + arena->used;
+     arena->used += size;
+     return p;
+ }
+ 
+ /*
+  * Copies a string into the arena
+  * Returns the copy, or NULL if the arena could not grow
+  */
+ char *arena_strdup(arena_t *arena, const char *str) {
+     size_t len = strlen(str) + 1;
+     char *copy = arena_alloc(arena, len);
+     
+     if (copy) memcpy(copy, str, len);
+     return copy;
+ }
+ 
+ /*
+  * Gives back everything allocated from the arena, keeping its blocks
+  */
+ void arena_reset(arena_t *arena) {
+     arena->cur = NULL;
+     arena->used = 0;
+ }
+ 
+ /*
+  * Frees the arena's blocks
+  */
+ void arena_free(arena_t *arena) {
+     while (arena->head) {
+         arena_block_t *block = arena->head;
+         arena->head = block->next;
+         free(block);
+     }
+     arena_reset(arena);
+ }
+ 
+ /*
+  * Command line lexer
+  *
+  * lex_line() makes one pass over a command line and splits it into
+  * words and the operators |, <, >, >> and 2>, with no separate step that
+  * cuts the line at pipes first.  Tokens are (offset, length) slices of
+  * the line itself, nothing is copied out of it.
+  *
+  * Quoting works like sh: 'single quotes' keep everything up to the
+  * closing quote, "double quotes" keep everything but \" and \\, and
+  * outside quotes a backslash keeps the next character, so "a | b" and
+  * a\ b are one word.  Taking the quotes and backslashes out is done in
+  * place.  A word is written back over its own span of the line, which
+  * is never shorter than what is written, and the word is NUL terminated
+  * at its end once the whole line has been read, so the terminator can
+  * only land on a quote, a blank or an operator that has been lexed.
+  * 2> is an operator only where a word would start, as in sh.
+  */
+ static const char *const token_names[] = {
+     [TOK_WORD] = "word",
+     [TOK_PIPE] = "|",
+     [TOK_IN] = "<",
+     [TOK_OUT] = ">",
+     [TOK_APPEND] = ">>",
+     [TOK_ERR] = "2>",
+ };
+ 
+ // Characters that end a run of plain characters outside quotes
+ static const bool lex_special[256] = {
+     ['\0'] = true, [' '] = true, ['\t'] = true, ['\n'] = true,
+     [PIPE_CHAR] = true, ['<'] = true, ['>'] = true,
+     ['\''] = true, ['"'] = true, ['\\'] = true,
+ };
+ 
+ /*
+  * Lexes a command line in place, see "Command line lexer" above
+  * The token array comes from the arena, *tokens and *count are set
+  * Returns OK, ERR_CMD_ARGS_BAD after printing CMD_ERR_QUOTE if a quote
+  * is not closed, or ERR_MEMORY
+  */
+ int lex_line(char *line, arena_t *arena, token_t **tokens, int *count) {
+     int max = TOKENS_INIT;
+     int n = 0;
+     token_t *toks = arena_alloc(arena, max * sizeof(token_t));
+     if (!toks) return ERR_MEMORY;
+     
+     int r = 0;      // next character to read
+     
+     while (1) {
+         while (line[r] == ' ' || line[r] == '\t' || line[r] == '\n') r++;
+         if (line[r] == '\0') break;
+         
+         if (n == max) {
+             token_t *more = arena_alloc(arena, 2 * max * sizeof(token_t));
+             if (!more) return ERR_MEMORY;
+             memcpy(more, toks, max * sizeof(token_t));
+             toks = more;
+             max *= 2;
+         }
+         
+         token_t *tok = &toks[n++];
+         tok->offset = r;
+         
+         // Operators
+         char c = line[r];
+         if (c == PIPE_CHAR || c == '<' || c == '>' || (c == '2' && line[r + 1] == '>')) {
+             if (c == PIPE_CHAR) {
+                 tok->type = TOK_PIPE;
+             } else if (c == '<') {
+                 tok->type = TOK_IN;
+             } else if (c == '2') {
+                 tok->type = TOK_ERR;
+             } else if (line[r + 1] == '>') {
+                 tok->type = TOK_APPEND;
+             } else {
+                 tok->type = TOK_OUT;
+             }
+             tok->len = (tok->type == TOK_APPEND || tok->type == TOK_ERR) ? 2 : 1;
+             r += tok->len;
+             continue;
+         }
+         
+         // A word, unquoted as it is read.  Runs of plain characters are
+         // skipped over, or moved down as a block once a quote or escape
+         // has been taken out before them.
+         int w = r;      // where its next character goes
+         char quote = 0;
+         
+         tok->type = TOK_WORD;
+         while (1) {
+             int start = r;
+             if (quote == 0) {
+                 while (!lex_special[(unsigned char)line[r]]) r++;
+             } else {
+                 r += strcspn(line + r, quote == '\'' ? "'" : "\"\\");
+             }
+             if (r > start) {
+                 if (w != start) memmove(line + w, line + start, r - start);
+                 w += r - start;
+             }
+             
+             c = line[r];
+             if (c == '\0') {
+                 if (quote) {
+                     printf(CMD_ERR_QUOTE);
+                     return ERR_CMD_ARGS_BAD;
+                 }
+                 break;
+             }
+             if (quote == '\'' || (quote == '"' && c == '"')) {
+                 quote = 0;      // the closing quote
+                 r++;
+             } else if (quote == '"') {
+                 // \" and \\ are escapes in double quotes, other backslashes are kept
+                 if (line[r + 1] == '"' || line[r + 1] == '\\') r++;
+                 line[w++] = line[r++];
+             } else if (c == '\'' || c == '"') {
+                 quote = c;
+                 r++;
+             } else if (c == '\\') {
+                 if (line[r + 1] != '\0') r++;
+                 line[w++] = line[r++];
+             } else {
+                 break;          // a blank or an operator ends the word
+             }
+         }
+         tok->len = w - tok->offset;
+     }
+     
+     for (int i = 0; i < n; i++) {
+         if (toks[i].type == TOK_WORD) {
+             line[toks[i].offset + toks[i].len] = '\0';
+         }
+     }
+     
+     *tokens = toks;
+     *count = n;
+     return OK;
+ }
+ 
+ /*
+  * Allocates memory for a command buffer from cmd_buff->arena
+  * argv starts with ARGV_INIT slots and grows as arguments are added
   * Returns OK on success, ERR_MEMORY on failure
   */
  int alloc_cmd_buff(cmd_buff_t *cmd_buff) {
-     if (!cmd_buff) return ERR_MEMORY;
+     if (!cmd_buff || !cmd_buff->arena) return ERR_MEMORY;
      
-     cmd_buff->_cmd_buffer = malloc(SH_CMD_MAX);
-     if (!cmd_buff->_cmd_buffer) return ERR_MEMORY;
-     
-     cmd_buff->argc = 0;
-     memset(cmd_buff->argv, 0, sizeof(cmd_buff->argv));
+     arena_t *arena = cmd_buff->arena;
+     memset(cmd_buff, 0, sizeof(cmd_buff_t));
+     cmd_buff->arena = arena;
+     cmd_buff->argv = arena_alloc(arena, ARGV_INIT * sizeof(char *));
+     if (!cmd_buff->argv) return ERR_MEMORY;
+     cmd_buff->argv_max = ARGV_INIT;
+     cmd_buff->pid = -1;
      
      return OK;
  }
  
  /*
-  * Frees memory allocated for a command buffer
+  * Lets go of a command buffer, its memory goes back when the arena is reset
   * Returns OK on success, ERR_MEMORY on failure
   */
  int free_cmd_buff(cmd_buff_t *cmd_buff) {
      if (!cmd_buff) return ERR_MEMORY;
      
-     if (cmd_buff->_cmd_buffer) {
-         free(cmd_buff->_cmd_buffer);
-         cmd_buff->_cmd_buffer = NULL;
-     }
-     
+     cmd_buff->_cmd_buffer = NULL;
+     cmd_buff->argv = NULL;
+     cmd_buff->argv_max = 0;
      cmd_buff->argc = 0;
      
      return OK;
@@ -116,89 +373,106 @@
   * Returns OK on success, ERR_MEMORY on failure
   */
  int clear_cmd_buff(cmd_buff_t *cmd_buff) {
-     if (!cmd_buff || !cmd_buff->_cmd_buffer) return ERR_MEMORY;
+     if (!cmd_buff || !cmd_buff->argv) return ERR_MEMORY;
      
-     memset(cmd_buff->_cmd_buffer, 0, SH_CMD_MAX);
+     cmd_buff->_cmd_buffer = NULL;
      cmd_buff->argc = 0;
-     memset(cmd_buff->argv, 0, sizeof(cmd_buff->argv));
+     memset(cmd_buff->argv, 0, cmd_buff->argv_max * sizeof(char *));
      
      // Initialize redirection fields
      cmd_buff->input_file = NULL;
      cmd_buff->output_file = NULL;
      cmd_buff->append_output = false;
+     cmd_buff->error_file = NULL;
+     cmd_buff->pid = -1;
      
      return OK;
  }
  
  /*
-  * Builds a command buffer from a command line string
-  * Parses the command line into argc/argv format
-  * Detects and processes redirection operators (<, >, >>)
+  * Appends one argument to argv, moving it to an array twice the size when
+  * only the slot for the terminating NULL is left
   * Returns OK on success, ERR_MEMORY on failure
   */
- int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff) {
-     if (!cmd_line || !cmd_buff) return ERR_MEMORY;
-     
-     clear_cmd_buff(cmd_buff);
-     strcpy(cmd_buff->_cmd_buffer, cmd_line);
-     
-     char *str = cmd_buff->_cmd_buffer;
-     int i = 0;
-     
-     // Initialize redirection fields
-     cmd_buff->input_file = NULL;
-     cmd_buff->output_file = NULL;
-     cmd_buff->append_output = false;
-     
-     // Parse each token
-     char *token = strtok(str, " \t");
+ static int push_arg(cmd_buff_t *cmd_buff, char *arg) {
+     if (cmd_buff->argc + 1 >= cmd_buff->argv_max) {
+         int max = cmd_buff->argv_max * 2;
+         char **argv = arena_alloc(cmd_buff->arena, max * sizeof(char *));
+         if (!argv) return ERR_MEMORY;
+         memcpy(argv, cmd_buff->argv, cmd_buff->argv_max * sizeof(char *));
+         cmd_buff->argv = argv;
+         cmd_buff->argv_max = max;
+     }
+     cmd_buff->argv[cmd_buff->argc++] = arg;
+     cmd_buff->argv[cmd_buff->argc] = NULL;  // Ensure NULL termination for exec
+     return OK;
+ }
+ 
+ /*
+  * Fills a command buffer from the tokens of one command, no pipes
+  * Words become argv, each redirection operator takes the word after it
+  * Returns OK, ERR_CMD_ARGS_BAD after printing CMD_ERR_SYNTAX, or
+  * ERR_MEMORY
+  */
+ static int fill_cmd_buff(cmd_buff_t *cmd_buff, char *line, const token_t *toks, int n) {
+     cmd_buff->_cmd_buffer = line;
      
-     while (token != NULL && i < CMD_ARGV_MAX - 1) {
-         // Check for input redirection
-         if (strcmp(token, "<") == 0) {
-             token = strtok(NULL, " \t");
-             if (token != NULL) {
-                 cmd_buff->input_file = token;
-                 token = strtok(NULL, " \t");
-             }
-             continue;
-         }
+     for (int i = 0; i < n; i++) {
+         char *word = line + toks[i].offset;
          
-         // Check for output redirection with append
-         if (strcmp(token, ">>") == 0) {
-             token = strtok(NULL, " \t");
-             if (token != NULL) {
-                 cmd_buff->output_file = token;
-                 cmd_buff->append_output = true;
-                 token = strtok(NULL, " \t");
-             }
+         if (toks[i].type == TOK_WORD) {
+             // Regular argument
+             if (push_arg(cmd_buff, word) != OK) return ERR_MEMORY;
              continue;
          }
          
-         // Check for output redirection
-         if (strcmp(token, ">") == 0) {
-             token = strtok(NULL, " \t");
-             if (token != NULL) {
-                 cmd_buff->output_file = token;
-                 cmd_buff->append_output = false;
-                 token = strtok(NULL, " \t");
-             }
-             continue;
+         // A redirection needs a file name, a pipe never gets here in a list
+         if (toks[i].type == TOK_PIPE || i + 1 == n || toks[i + 1].type != TOK_WORD) {
+             printf(CMD_ERR_SYNTAX, token_names[toks[i].type]);
+             return ERR_CMD_ARGS_BAD;
          }
+         char *file = line + toks[++i].offset;
          
-         // Regular argument
-         cmd_buff->argv[i++] = token;
-         token = strtok(NULL, " \t");
+         switch (toks[i - 1].type) {
+             case TOK_IN:
+                 cmd_buff->input_file = file;
+                 break;
+             case TOK_OUT:
+             case TOK_APPEND:
+                 cmd_buff->output_file = file;
+                 cmd_buff->append_output = (toks[i - 1].type == TOK_APPEND);
+                 break;
+             default:
+                 cmd_buff->error_file = file;
+                 break;
+         }
      }
      
-     cmd_buff->argc = i;
-     cmd_buff->argv[i] = NULL;  // Ensure NULL termination for execvp
-     
      return OK;
  }
  
  /*
-  * Frees resources associated with a command list
+  * Builds a command buffer from a command line string
+  * Parses the command line in place into argc/argv format
+  * Detects and processes redirection operators (<, >, >>, 2>)
+  * Returns OK on success, ERR_CMD_ARGS_BAD on a syntax error, ERR_MEMORY
+  * on failure
+  */
+ int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff) {
+     if (!cmd_line || !cmd_buff) return ERR_MEMORY;
+     
+     if (clear_cmd_buff(cmd_buff) != OK) return ERR_MEMORY;
+     
+     token_t *toks;
+     int n;
+     int rc = lex_line(cmd_line, cmd_buff->arena, &toks, &n);
+     if (rc != OK) return rc;
+     
+     return fill_cmd_buff(cmd_buff, cmd_line, toks, n);
+ }
+ 
+ /*
+  * Lets go of a command list, its memory goes back when the arena is reset
   * Returns OK on success, error code on failure
   */
  int free_cmd_list(command_list_t *cmd_lst) {
@@ -207,74 +481,266 @@
      for (int i = 0; i < cmd_lst->num; i++) {
          free_cmd_buff(&cmd_lst->commands[i]);
      }
+     cmd_lst->commands = NULL;
+     cmd_lst->num = 0;
+     cmd_lst->max = 0;
      
      return OK;
  }
  
+ /*
+  * Returns the next free command of the list, moving the list to an array
+  * twice the size when it is full, or NULL if it cannot grow
+  */
+ static cmd_buff_t *next_cmd(command_list_t *clist) {
+     if (clist->num == clist->max) {
+         int max = clist->max ? clist->max * 2 : CMDS_INIT;
+         cmd_buff_t *cmds = arena_alloc(clist->arena, max * sizeof(cmd_buff_t));
+         if (!cmds) return NULL;
+         if (clist->num > 0) {
+             memcpy(cmds, clist->commands, clist->num * sizeof(cmd_buff_t));
+         }
+         clist->commands = cmds;
+         clist->max = max;
+     }
+     clist->commands[clist->num].arena = clist->arena;
+     return &clist->commands[clist->num];
+ }
+ 
  /*
   * Builds a command list from a command line containing pipes
+  * The line is lexed once, in place, and each run of tokens between
+  * pipes becomes a command.  The list holds as many commands as the line
+  * has, all allocated from clist->arena.
   * Returns OK on success, appropriate error code on failure
   */
  int build_cmd_list(char *cmd_line, command_list_t *clist) {
-     if (!cmd_line || !clist) return ERR_MEMORY;
+     if (!cmd_line || !clist || !clist->arena) return ERR_MEMORY;
      
      // Initialize command list
+     arena_t *arena = clist->arena;
      memset(clist, 0, sizeof(command_list_t));
-     clist->num = 0;
+     clist->arena = arena;
+     
+     token_t *toks;
+     int n;
+     int rc = lex_line(cmd_line, arena, &toks, &n);
+     if (rc != OK) return rc;
      
-     // Trim input and check if empty
-     char *trimmed_cmd = trim(cmd_line);
-     if (strlen(trimmed_cmd) == 0) {
+     // An empty command between pipes is skipped
+     int start = 0;
+     for (int i = 0; i <= n; i++) {
+         if (i < n && toks[i].type != TOK_PIPE) continue;
+         
+         if (i > start) {
+             // Allocate buffer for this command
+             cmd_buff_t *cmd = next_cmd(clist);
+             if (!cmd || alloc_cmd_buff(cmd) != OK) {
+                 return ERR_MEMORY;
+             }
+             clist->num++;
+             
+             rc = fill_cmd_buff(cmd, cmd_line, toks + start, i - start);
+             if (rc != OK) return rc;
+         }
+         start = i + 1;
+     }
+     
+     // Check if any commands were found
+     if (clist->num == 0) {
          return WARN_NO_CMDS;
      }
      
-     // Make a copy of the command line
-     char *cmd_copy = strdup(trimmed_cmd);
-     if (!cmd_copy) return ERR_MEMORY;
+     return OK;
+ }
+ 
+ /*
+  * Command hash table
+  *
+  * execvp() and posix_spawnp() find a command by trying every PATH
+  * directory in turn, so every stage of every command line pays a failed
+  * exec for each directory ahead of the one that has it.  Like bash, dsh
+  * remembers where it found each command name and spawns that path
+  * directly.  The table is emptied when PATH changes or by 'hash -r', and
+  * an entry is dropped when its file has gone and spawning it fails.
+  * Names found through a relative PATH directory are not kept, since
+  * where they point depends on the working directory.
+  */
+ typedef struct hash_entry {
+     char *name;
+     char *path;
+     int hits;
+     struct hash_entry *next;
+ } hash_entry_t;
+ 
+ static hash_entry_t *hash_table[HASH_BUCKETS];
+ static int hash_count = 0;
+ static char *hash_path = NULL;      // the PATH the table was filled from
+ static char found_path[PATH_MAX];   // last path_search() result
+ 
+ static unsigned hash_name(const char *name) {
+     unsigned h = 2166136261u;       // FNV-1a
      
-     // Split by pipe character
-     char *cmd_str;
-     char *saveptr;
-     int cmd_idx = 0;
+     while (*name) {
+         h = (h ^ (unsigned char)*name++) * 16777619u;
+     }
+     return h % HASH_BUCKETS;
+ }
+ 
+ static const char *current_path(void) {
+     const char *path = getenv("PATH");
+     return path ? path : DEFAULT_PATH;
+ }
+ 
+ /*
+  * Empties the command hash table
+  */
+ void hash_forget(void) {
+     for (int i = 0; i < HASH_BUCKETS; i++) {
+         while (hash_table[i]) {
+             hash_entry_t *e = hash_table[i];
+             hash_table[i] = e->next;
+             free(e->name);
+             free(e->path);
+             free(e);
+         }
+     }
+     hash_count = 0;
+     free(hash_path);
+     hash_path = NULL;
+ }
+ 
+ /*
+  * Searches PATH the way execvp() does, an empty entry meaning the
+  * current directory, for an executable regular file called name
+  * Returns found_path, or NULL if no directory has one
+  */
+ static const char *path_search(const char *name) {
+     const char *dir = current_path();
      
-     for (cmd_str = strtok_r(cmd_copy, PIPE_STRING, &saveptr); 
-          cmd_str != NULL && cmd_idx < CMD_MAX; 
-          cmd_str = strtok_r(NULL, PIPE_STRING, &saveptr)) {
+     while (1) {
+         size_t len = strcspn(dir, ":");
+         struct stat st;
+         int n;
          
-         // Allocate buffer for this command
-         if (alloc_cmd_buff(&clist->commands[cmd_idx]) != OK) {
-             free(cmd_copy);
-             return ERR_MEMORY;
+         if (len == 0) {
+             n = snprintf(found_path, sizeof(found_path), "%s", name);
+         } else {
+             n = snprintf(found_path, sizeof(found_path), "%.*s/%s", (int)len, dir, name);
          }
-         
-         // Build command buffer from this segment
-         char *trimmed_segment = trim(cmd_str);
-         if (strlen(trimmed_segment) > 0) {
-             if (build_cmd_buff(trimmed_segment, &clist->commands[cmd_idx]) != OK) {
-                 free(cmd_copy);
-                 return ERR_MEMORY;
-             }
-             cmd_idx++;
+         if (n > 0 && (size_t)n < sizeof(found_path) &&
+             stat(found_path, &st) == 0 && S_ISREG(st.st_mode) &&
+             access(found_path, X_OK) == 0) {
+             return found_path;
          }
+         if (dir[len] == '\0') {
+             return NULL;
+         }
+         dir += len + 1;
      }
+ }
+ 
+ static hash_entry_t **hash_find(const char *name) {
+     hash_entry_t **e = &hash_table[hash_name(name)];
      
-     free(cmd_copy);
+     while (*e && strcmp((*e)->name, name) != 0) {
+         e = &(*e)->next;
+     }
+     return e;
+ }
+ 
+ static void hash_drop(const char *name) {
+     hash_entry_t **e = hash_find(name);
      
-     // Check if too many commands
-     if (cmd_str != NULL && cmd_idx >= CMD_MAX) {
-         printf(CMD_ERR_PIPE_LIMIT, CMD_MAX);
-         return ERR_TOO_MANY_COMMANDS;
+     if (*e) {
+         hash_entry_t *gone = *e;
+         *e = gone->next;
+         free(gone->name);
+         free(gone->path);
+         free(gone);
+         hash_count--;
      }
+ }
+ 
+ /*
+  * Resolves a command name to the path to spawn, searching PATH only when
+  * the name is not already in the table.  hit counts the lookup as a use
+  * of the command, which is what 'hash' reports.
+  */
+ static const char *hash_resolve(const char *name, bool hit) {
+     // A name with a slash is a path already and is never searched for
+     if (strchr(name, '/')) return name;
      
-     // Update command count
-     clist->num = cmd_idx;
+     const char *path = current_path();
+     if (!hash_path || strcmp(hash_path, path) != 0) {
+         hash_forget();
+         hash_path = dsh_strdup(path);
+     }
      
-     // Check if any commands were found
-     if (clist->num == 0) {
-         return WARN_NO_CMDS;
+     hash_entry_t **e = hash_find(name);
+     if (*e) {
+         if (hit) (*e)->hits++;
+         return (*e)->path;
      }
      
-     return OK;
+     const char *found = path_search(name);
+     if (!found || found[0] != '/' || !hash_path) return found;
+     
+     hash_entry_t *entry = dsh_malloc(sizeof(hash_entry_t));
+     if (!entry) return found;
+     entry->name = dsh_strdup(name);
+     entry->path = dsh_strdup(found);
+     if (!entry->name || !entry->path) {
+         free(entry->name);
+         free(entry->path);
+         free(entry);
+         return found;
+     }
+     entry->hits = hit ? 1 : 0;
+     entry->next = NULL;
+     *e = entry;
+     hash_count++;
+     return entry->path;
+ }
+ 
+ /*
+  * Looks a command name up in the hash table, adding it on a miss
+  * Returns the path to spawn, or NULL if it is not on PATH
+  */
+ const char *hash_lookup(const char *name) {
+     if (!name) return NULL;
+     return hash_resolve(name, true);
+ }
+ 
+ /*
+  * The hash builtin: with no arguments lists the table, with -r empties
+  * it, otherwise looks each name up again and remembers where it is
+  */
+ static void hash_builtin(cmd_buff_t *cmd) {
+     if (cmd->argc == 1) {
+         if (hash_count == 0) {
+             printf(HASH_EMPTY);
+             return;
+         }
+         printf(HASH_HEADER);
+         for (int i = 0; i < HASH_BUCKETS; i++) {
+             for (hash_entry_t *e = hash_table[i]; e; e = e->next) {
+                 printf(HASH_ENTRY, e->hits, e->path);
+             }
+         }
+         return;
+     }
+     
+     for (int i = 1; i < cmd->argc; i++) {
+         if (strcmp(cmd->argv[i], "-r") == 0) {
+             hash_forget();
+             continue;
+         }
+         hash_drop(cmd->argv[i]);
+         if (!hash_resolve(cmd->argv[i], false)) {
+             fprintf(stderr, HASH_NOT_FOUND, cmd->argv[i]);
+         }
+     }
  }
  
  /*
@@ -287,6 +753,8 @@
      if (strcmp(input, EXIT_CMD) == 0) return BI_CMD_EXIT;
      if (strcmp(input, "dragon") == 0) return BI_CMD_DRAGON;
      if (strcmp(input, "cd") == 0) return BI_CMD_CD;
+     if (strcmp(input, HASH_CMD) == 0) return BI_CMD_HASH;
+     if (strcmp(input, ALLOCS_CMD) == 0) return BI_CMD_ALLOCS;
      
      return BI_NOT_BI;
  }
@@ -322,11 +790,146 @@
              printf("Roar! The dragon breathes fire!\n");
              return BI_EXECUTED;
              
+         case BI_CMD_HASH:
+             hash_builtin(cmd);
+             return BI_EXECUTED;
+             
+         case BI_CMD_ALLOCS:
+             printf(ALLOCS_REPORT, last_line_allocs, heap_allocs);
+             return BI_EXECUTED;
+             
          default:
              return BI_NOT_BI;
      }
  }
  
+ /*
+  * A file the kernel would not exec, a script without a #! line, is run
+  * with /bin/sh the way execvp() does: /bin/sh path args...
+  * Returns that argv, from the line's arena, or NULL if it is out of memory
+  */
+ static char **script_argv(cmd_buff_t *cmd, const char *path) {
+     char **argv = arena_alloc(cmd->arena, (cmd->argc + 2) * sizeof(char *));
+     if (!argv) return NULL;
+     
+     argv[0] = "/bin/sh";
+     argv[1] = (char *)path;
+     for (int i = 1; i <= cmd->argc; i++) {
+         argv[i + 1] = cmd->argv[i];     // including the NULL at the end
+     }
+     return argv;
+ }
+ 
+ static int spawn_script(pid_t *pid, cmd_buff_t *cmd, const char *path,
+                         const posix_spawn_file_actions_t *actions) {
+     char **argv = script_argv(cmd, path);
+     if (!argv) return ENOMEM;
+     return posix_spawn(pid, argv[0], actions, NULL, argv, environ);
+ }
+ 
+ /*
+  * Spawns the command at the path the hash table has for it.  If that
+  * file has gone since it was hashed, the entry is dropped and PATH is
+  * searched again.  A file that is not a binary or #! script is run by
+  * /bin/sh, see spawn_script().
+  * Returns 0 or the error posix_spawn() failed with
+  */
+ static int spawn_path(pid_t *pid, cmd_buff_t *cmd,
+                       const posix_spawn_file_actions_t *actions) {
+     const char *path = hash_lookup(cmd->argv[0]);
+     if (!path) return ENOENT;
+     
+     int rc = posix_spawn(pid, path, actions, NULL, cmd->argv, environ);
+     if ((rc == ENOENT || rc == ENOTDIR || rc == EACCES) && path != cmd->argv[0]) {
+         hash_drop(cmd->argv[0]);
+         path = hash_lookup(cmd->argv[0]);
+         if (!path) return ENOENT;
+         rc = posix_spawn(pid, path, actions, NULL, cmd->argv, environ);
+     }
+     if (rc == ENOEXEC) {
+         rc = spawn_script(pid, cmd, path, actions);
+     }
+     return rc;
+ }
+ 
+ /*
+  * The fork() and execv() launch that posix_spawn() replaced, kept as the
+  * baseline for make bench and picked with DSH_SPAWN=fork.  fork() copies
+  * the shell's page tables, so it gets slower as the shell grows.
+  * Returns 0 or the error the lookup or fork() failed with; the child
+  * reports a failed exec itself and exits with the status of a failed
+  * spawn, ERR_EXEC_CMD & 0xff, so both modes report it the same way
+  */
+ static int fork_path(pid_t *pid, cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+     const char *path = hash_lookup(cmd->argv[0]);
+     if (path && path != cmd->argv[0] && access(path, X_OK) != 0) {
+         hash_drop(cmd->argv[0]);    // gone since it was hashed
+         path = hash_lookup(cmd->argv[0]);
+     }
+     if (!path) return ENOENT;
+     
+     *pid = fork();
+     if (*pid < 0) return errno;
+     if (*pid == 0) {
+         if (in_fd != STDIN_FILENO) dup2(in_fd, STDIN_FILENO);
+         if (out_fd != STDOUT_FILENO) dup2(out_fd, STDOUT_FILENO);
+         if (err_fd != STDERR_FILENO) dup2(err_fd, STDERR_FILENO);
+         execv(path, cmd->argv);
+         if (errno == ENOEXEC) {
+             char **argv = script_argv(cmd, path);
+             if (argv) execv(argv[0], argv);
+         }
+         fprintf(stderr, "Command execution failed: %s\n", strerror(errno));
+         _exit(ERR_EXEC_CMD & 0xff);
+     }
+     return 0;
+ }
+ 
+ /*
+  * Launches one command with posix_spawn(), with its stdin, stdout and
+  * stderr wired to in_fd, out_fd and err_fd by file actions instead of dup2() calls in a
+  * forked child.  glibc spawns with CLONE_VM | CLONE_VFORK, so the shell's
+  * page tables are never copied and launching costs the same however big
+  * the shell gets.  Any other descriptor the shell opened for the command
+  * line is close-on-exec, so the child does not need a list to close.
+  * Returns the child's pid, or -1 after printing why it could not be run
+  */
+ static pid_t spawn_cmd(cmd_buff_t *cmd, int in_fd, int out_fd, int err_fd) {
+     posix_spawn_file_actions_t actions;
+     pid_t pid;
+     int rc;
+     
+     if (spawn_fork) {
+         rc = fork_path(&pid, cmd, in_fd, out_fd, err_fd);
+         if (rc != 0) {
+             fprintf(stderr, "Command execution failed: %s\n", strerror(rc));
+             return -1;
+         }
+         return pid;
+     }
+     
+     rc = posix_spawn_file_actions_init(&actions);
+     if (rc == 0 && in_fd != STDIN_FILENO) {
+         rc = posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+     }
+     if (rc == 0 && out_fd != STDOUT_FILENO) {
+         rc = posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+     }
+     if (rc == 0 && err_fd != STDERR_FILENO) {
+         rc = posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+     }
+     if (rc == 0) {
+         rc = spawn_path(&pid, cmd, &actions);
+     }
+     posix_spawn_file_actions_destroy(&actions);
+     
+     if (rc != 0) {
+         fprintf(stderr, "Command execution failed: %s\n", strerror(rc));
+         return -1;
+     }
+     return pid;
+ }
+ 
  /*
   * Executes a single command (non-piped)
   * Returns OK on success, ERR_EXEC_CMD on failure
@@ -334,34 +937,29 @@
  int exec_cmd(cmd_buff_t *cmd) {
      if (!cmd || !cmd->argv[0]) return ERR_EXEC_CMD;
      
-     pid_t pid = fork();
-     
+     pid_t pid = spawn_cmd(cmd, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO);
      if (pid < 0) {
-         perror("Fork failed");
          return ERR_EXEC_CMD;
      }
      
-     if (pid == 0) {  // Child process
-         execvp(cmd->argv[0], cmd->argv);
-         // If we get here, execvp failed
-         perror("Command execution failed");
-         exit(ERR_EXEC_CMD);
-     } else {  // Parent process
-         int status;
-         waitpid(pid, &status, 0);
-         
-         if (WIFEXITED(status)) {
-             last_return_code = WEXITSTATUS(status);
-             return last_return_code;
-         }
-         
-         return ERR_EXEC_CMD;
+     int status;
+     waitpid(pid, &status, 0);
+     
+     if (WIFEXITED(status)) {
+         last_return_code = WEXITSTATUS(status);
+         return last_return_code;
      }
+     
+     return ERR_EXEC_CMD;
  }
  
  /*
   * Executes a pipeline of commands
-  * Handles both piping and file redirection (<, >, >>)
+  * Handles both piping and file redirection (<, >, >>, 2>)
+  * Each pipe is made just before the command that writes to it is
+  * launched, and the parent closes its ends as soon as both commands
+  * have them, so however long the pipeline is the shell never holds more
+  * than one pipe and the read end of the one before it.
   * Returns OK on success, appropriate error code on failure
   */
  int execute_pipeline(command_list_t *clist) {
@@ -375,111 +973,107 @@
          }
      }
      
-     int pipes[CMD_MAX-1][2]; // Array of pipe file descriptors
-     pid_t child_pids[CMD_MAX]; // Array to store child process IDs
-     
-     // Create pipes
-     for (int i = 0; i < clist->num - 1; i++) {
-         if (pipe(pipes[i]) == -1) {
-             perror("Pipe creation failed");
-             return ERR_EXEC_CMD;
-         }
-     }
+     int prev_read = -1;     // read end of the pipe into this command
+     int launched = 0;
      
-     // Create child processes and set up pipes
+     // Launch each command with its ends of the pipes and its redirections
      for (int i = 0; i < clist->num; i++) {
-         child_pids[i] = fork();
+         cmd_buff_t *cmd = &clist->commands[i];
+         int next[2] = { -1, -1 };
+         int in_fd = (i > 0) ? prev_read : STDIN_FILENO;
+         int out_fd = STDOUT_FILENO;
+         int err_fd = STDERR_FILENO;
          
-         if (child_pids[i] < 0) {
-             perror("Fork failed");
-             return ERR_EXEC_CMD;
+         // The pipe to the next command, close-on-exec so only the ends a
+         // child is given survive
+         if (i < clist->num - 1) {
+             if (pipe2(next, O_CLOEXEC) == -1) {
+                 perror("Pipe creation failed");
+                 break;
+             }
+             out_fd = next[1];
          }
+         launched++;
          
-         if (child_pids[i] == 0) {
-             // Child process
-             
-             // Handle input redirection from file (only for first command)
-             if (i == 0 && clist->commands[i].input_file != NULL) {
-                 int input_fd = open(clist->commands[i].input_file, O_RDONLY);
-                 if (input_fd == -1) {
-                     perror("Failed to open input file");
-                     exit(ERR_EXEC_CMD);
-                 }
-                 if (dup2(input_fd, STDIN_FILENO) == -1) {
-                     perror("dup2 input file redirection failed");
-                     exit(ERR_EXEC_CMD);
-                 }
-                 close(input_fd);
-             } 
-             // Handle input from previous pipe (for commands after the first)
-             else if (i > 0) {
-                 if (dup2(pipes[i-1][0], STDIN_FILENO) == -1) {
-                     perror("dup2 pipe input redirection failed");
-                     exit(ERR_EXEC_CMD);
-                 }
+         // Handle input redirection from file (only for first command)
+         if (i == 0 && cmd->input_file != NULL) {
+             in_fd = open(cmd->input_file, O_RDONLY | O_CLOEXEC);
+             if (in_fd == -1) {
+                 perror("Failed to open input file");
              }
-             
-             // Handle output redirection to file (only for last command)
-             if (i == clist->num - 1 && clist->commands[i].output_file != NULL) {
-                 int flags = O_WRONLY | O_CREAT;
-                 if (clist->commands[i].append_output) {
-                     flags |= O_APPEND;  // Use append mode for >>
-                 } else {
-                     flags |= O_TRUNC;   // Truncate file for >
-                 }
-                 
-                 int output_fd = open(clist->commands[i].output_file, flags, 0644);
-                 if (output_fd == -1) {
-                     perror("Failed to open output file");
-                     exit(ERR_EXEC_CMD);
-                 }
-                 if (dup2(output_fd, STDOUT_FILENO) == -1) {
-                     perror("dup2 output file redirection failed");
-                     exit(ERR_EXEC_CMD);
-                 }
-                 close(output_fd);
-             } 
-             // Handle output to next pipe (for commands before the last)
-             else if (i < clist->num - 1) {
-                 if (dup2(pipes[i][1], STDOUT_FILENO) == -1) {
-                     perror("dup2 pipe output redirection failed");
-                     exit(ERR_EXEC_CMD);
-                 }
+         }
+         
+         // Handle output redirection to file (only for last command)
+         if (i == clist->num - 1 && cmd->output_file != NULL) {
+             int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+             if (cmd->append_output) {
+                 flags |= O_APPEND;  // Use append mode for >>
+             } else {
+                 flags |= O_TRUNC;   // Truncate file for >
              }
              
-             // Close all pipe file descriptors
-             for (int j = 0; j < clist->num - 1; j++) {
-                 close(pipes[j][0]);
-                 close(pipes[j][1]);
+             out_fd = open(cmd->output_file, flags, 0644);
+             if (out_fd == -1) {
+                 perror("Failed to open output file");
              }
-             
-             // Execute command
-             execvp(clist->commands[i].argv[0], clist->commands[i].argv);
-             
-             // If we get here, execvp failed
-             perror("Command execution failed");
-             exit(ERR_EXEC_CMD);
          }
+         
+         // Handle error redirection to file (any command)
+         if (cmd->error_file != NULL) {
+             err_fd = open(cmd->error_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+             if (err_fd == -1) {
+                 perror("Failed to open error file");
+             }
+         }
+         
+         // A command that cannot run is skipped, the rest of the pipeline
+         // still runs and sees end of file on its pipe
+         cmd->pid = -1;
+         if (in_fd != -1 && out_fd != -1 && err_fd != -1) {
+             cmd->pid = spawn_cmd(cmd, in_fd, out_fd, err_fd);
+         }
+         
+         // The redirection files and these pipe ends are the child's now
+         if (i == 0 && cmd->input_file != NULL && in_fd != -1) {
+             close(in_fd);
+         }
+         if (i == clist->num - 1 && cmd->output_file != NULL && out_fd != -1) {
+             close(out_fd);
+         }
+         if (cmd->error_file != NULL && err_fd != -1) {
+             close(err_fd);
+         }
+         if (prev_read != -1) {
+             close(prev_read);
+         }
+         if (next[1] != -1) {
+             close(next[1]);
+         }
+         prev_read = next[0];
      }
      
      // Parent process
-     
-     // Close all pipe file descriptors in the parent
-     for (int i = 0; i < clist->num - 1; i++) {
-         close(pipes[i][0]);
-         close(pipes[i][1]);
+     if (prev_read != -1) {
+         close(prev_read);
      }
      
      // Wait for all child processes to complete
      int status;
      int last_status = 0;
      
-     for (int i = 0; i < clist->num; i++) {
-         waitpid(child_pids[i], &status, 0);
+     for (int i = 0; i < launched; i++) {
+         if (clist->commands[i].pid < 0) {
+             last_status = ERR_EXEC_CMD & 0xff;  // what a failed child exited with
+             continue;
+         }
+         waitpid(clist->commands[i].pid, &status, 0);
          if (WIFEXITED(status)) {
              last_status = WEXITSTATUS(status);
          }
      }
+     if (launched < clist->num) {
+         last_status = ERR_EXEC_CMD & 0xff;
+     }
      
      last_return_code = last_status;
      return OK;
@@ -491,16 +1085,40 @@
   * Returns OK on normal exit
   */
  int exec_local_cmd_loop() {
-     char cmd_buff[SH_CMD_MAX];
+     char *cmd_buff = NULL;      // grown by getline() to fit the longest line
+     size_t cmd_buff_size = 0;
+     arena_t arena = { 0 };      // everything parsed from cmd_buff
+     unsigned long line_start = 0;
      command_list_t cmd_list;
+     char *ballast = NULL;
      int rc;
      
+     // Benchmark knobs, see make bench: how to launch, and how big a shell
+     // to launch from, in MB of heap that is touched so it is really mapped
+     const char *mode = getenv(SPAWN_ENV);
+     spawn_fork = mode && strcmp(mode, SPAWN_FORK) == 0;
+     const char *ballast_mb = getenv(BALLAST_ENV);
+     if (ballast_mb) {
+         char *end;
+         errno = 0;
+         unsigned long mb = strtoul(ballast_mb, &end, 10);
+         if (!isdigit((unsigned char)*ballast_mb) || *end != '\0' || errno != 0 ||
+             mb > BALLAST_MAX_MB) {
+             fprintf(stderr, CMD_ERR_BALLAST, BALLAST_ENV, BALLAST_MAX_MB);
+             return ERR_CMD_ARGS_BAD;
+         }
+         size_t len = (size_t)mb << 20;
+         if (len > 0 && (ballast = dsh_malloc(len)) != NULL) {
+             memset(ballast, 1, len);
+         }
+     }
+     
      while (1) {
          // Display prompt
          printf("%s", SH_PROMPT);
          
          // Get user input
-         if (fgets(cmd_buff, SH_CMD_MAX, stdin) == NULL) {
+         if (getline(&cmd_buff, &cmd_buff_size, stdin) == -1) {
              printf("\n");
              break;
          }
@@ -508,20 +1126,26 @@
          // Remove trailing newline
          cmd_buff[strcspn(cmd_buff, "\n")] = '\0';
          
+         // The line before this one is done with, and so is its memory
+         last_line_allocs = heap_allocs - line_start;
+         line_start = heap_allocs;
+         arena_reset(&arena);
+         
          // Check for exit command (quick check before parsing)
          if (strcmp(trim(cmd_buff), EXIT_CMD) == 0) {
              printf("exiting...\n");
-             return OK;
+             break;
          }
          
          // Parse the command line into a command list
+         cmd_list.arena = &arena;
          rc = build_cmd_list(cmd_buff, &cmd_list);
          
          if (rc == WARN_NO_CMDS) {
              // Empty input, just continue
              continue;
-         } else if (rc == ERR_TOO_MANY_COMMANDS) {
-             // Too many commands, already printed error message
+         } else if (rc == ERR_CMD_ARGS_BAD) {
+             // Bad quoting or redirection, already printed error message
              continue;
          } else if (rc != OK) {
              // Other error
@@ -536,5 +1160,8 @@
          free_cmd_list(&cmd_list);
      }
      
+     arena_free(&arena);
+     free(cmd_buff);
+     free(ballast);
      return OK;
  }
\ No newline at end of file
@@ -2,30 +2,77 @@
     #define __DSHLIB_H__
 
 #include <stdbool.h>
+#include <sys/types.h>
 
 //Constants for command structure sizes
 #define EXE_MAX 64
 #define ARG_MAX 256
-#define CMD_MAX 8
-#define CMD_ARGV_MAX (CMD_MAX + 1)
 // Longest command that can be read from the shell
 #define SH_CMD_MAX EXE_MAX + ARG_MAX
+// Starting sizes of the arrays that grow as a command line is parsed
+#define ARGV_INIT 8
+#define CMDS_INIT 8
+#define TOKENS_INIT 32
+// Size of an arena block, a line that needs more gets another block
+#define ARENA_BLOCK 4096
+
+//Bump allocator for everything parsed from one command line, see
+//"Command line arena" in dshlib.c
+typedef struct arena_block
+{
+    struct arena_block *next;
+    size_t size;
+    char data[];
+} arena_block_t;
+
+typedef struct arena
+{
+    arena_block_t *head;
+    arena_block_t *cur;       // block being allocated from
+    size_t used;              // bytes of cur handed out
+} arena_t;
 
 typedef struct cmd_buff
 {
+    arena_t *arena;           // where argv and _cmd_buffer come from
     int  argc;
-    char *argv[CMD_ARGV_MAX];
-    char *_cmd_buffer;
+    int  argv_max;            // slots in argv, doubled when full
+    char **argv;
+    char *_cmd_buffer;        // the line argv points into, not owned
     
     // Added for redirection support
     char *input_file;         // For < redirection
     char *output_file;        // For > and >> redirection
     bool append_output;       // True for >>, false for >
+    char *error_file;         // For 2> redirection
+    
+    pid_t pid;                // set by execute_pipeline, -1 if it did not run
 } cmd_buff_t;
 
+//Tokens of a command line, see "Command line lexer" in dshlib.c.  A token
+//is a slice of the line, which for a word has had its quotes and escapes
+//taken out and is NUL terminated.
+typedef enum {
+    TOK_WORD,
+    TOK_PIPE,       // |
+    TOK_IN,         // <
+    TOK_OUT,        // >
+    TOK_APPEND,     // >>
+    TOK_ERR,        // 2>
+} token_type_t;
+
+typedef struct token
+{
+    token_type_t type;
+    int offset;               // from the start of the line
+    int len;
+} token_t;
+
 typedef struct command_list{
+    arena_t *arena;           // set by the caller before build_cmd_list
     int num;
-    cmd_buff_t commands[CMD_MAX];
+    int max;                  // slots in commands, doubled when full
+    cmd_buff_t *commands;
 }command_list_t;
 
 //Special character #defines
@@ -48,6 +95,13 @@ typedef struct command_list{
 #define OK_EXIT                 -7
 
 //prototypes
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strdup(arena_t *arena, const char *str);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
+unsigned long dsh_heap_allocs(void);
+int lex_line(char *line, arena_t *arena, token_t **tokens, int *count);
+
 int alloc_cmd_buff(cmd_buff_t *cmd_buff);
 int free_cmd_buff(cmd_buff_t *cmd_buff);
 int clear_cmd_buff(cmd_buff_t *cmd_buff);
@@ -61,12 +115,28 @@ typedef enum {
     BI_CMD_EXIT,
     BI_CMD_DRAGON,
     BI_CMD_CD,
+    BI_CMD_HASH,
+    BI_CMD_ALLOCS,
     BI_NOT_BI,
     BI_EXECUTED,
 } Built_In_Cmds;
 Built_In_Cmds match_command(const char *input); 
 Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd);
 
+//PATH lookup cache, see "Command hash table" in dshlib.c
+#define HASH_CMD        "hash"
+#define ALLOCS_CMD      "allocs"        //dshlib.c's own allocations of the last line
+#define HASH_BUCKETS    64
+#define DEFAULT_PATH    "/bin:/usr/bin"     //what execvp() walks without PATH
+
+//Benchmark knobs, read when the shell starts, see make bench
+#define SPAWN_ENV       "DSH_SPAWN"         //"fork" launches with fork()/execv()
+#define SPAWN_FORK      "fork"
+#define BALLAST_ENV     "DSH_BALLAST_MB"    //heap to allocate and touch first
+#define BALLAST_MAX_MB  16384
+const char *hash_lookup(const char *name);
+void hash_forget(void);
+
 //main execution context
 int exec_local_cmd_loop();
 int exec_cmd(cmd_buff_t *cmd);
@@ -75,6 +145,13 @@ int execute_pipeline(command_list_t *clist);
 //output constants
 #define CMD_OK_HEADER       "PARSED COMMAND LINE - TOTAL COMMANDS %d\n"
 #define CMD_WARN_NO_CMD     "warning: no commands provided\n"
-#define CMD_ERR_PIPE_LIMIT  "error: piping limited to %d commands\n"
+#define CMD_ERR_QUOTE       "error: unterminated quote\n"
+#define CMD_ERR_SYNTAX      "error: syntax error near '%s'\n"
+#define CMD_ERR_BALLAST     "error: %s must be a number from 0 to %d\n"
+#define HASH_EMPTY          "hash: hash table empty\n"
+#define HASH_HEADER         "hits\tcommand\n"
+#define HASH_ENTRY          "%4d\t%s\n"
+#define HASH_NOT_FOUND      "hash: %s: not found\n"
+#define ALLOCS_REPORT       "heap allocations: %lu last line, %lu total\n"
 
 #endif
\ No newline at end of file